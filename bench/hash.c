@@ -0,0 +1,136 @@
+// Author: wangha <wangha at emqx dot io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+//
+// Micro-benchmark of the hashes in src/hash.c.
+//
+// Usage: bench-hash [csv|json] [max size in bytes]
+//
+// Each hash runs over buffers from 16B up to the max size (64MiB by
+// default), aligned and misaligned, and reports GB/s and cycles/byte.
+// Cycles are counted with the TSC on x86, other platforms print -1.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0
+#endif
+
+#include "nftp.h"
+
+#define BENCH_MIN_TIME  0.05 // Seconds for each measurement at least
+#define BENCH_MAX_SIZE  (64 * 1024 * 1024)
+
+static uint64_t bench_djb(const uint8_t *p, size_t n) { return nftp_djb_hashn(p, n); }
+static uint64_t bench_fnv1a(const uint8_t *p, size_t n) { return nftp_fnv1a_hashn(p, n); }
+static uint64_t bench_crc(const uint8_t *p, size_t n) { return nftp_crc(p, n); }
+static uint64_t bench_crc32(const uint8_t *p, size_t n) { return nftp_crc32(p, n); }
+static uint64_t bench_crc32_sw(const uint8_t *p, size_t n) { return nftp_crc32_sw(p, n); }
+static uint64_t bench_crc32c(const uint8_t *p, size_t n) { return nftp_crc32c(p, n); }
+static uint64_t bench_crc32c_sw(const uint8_t *p, size_t n) { return nftp_crc32c_sw(p, n); }
+static uint64_t bench_xxh64(const uint8_t *p, size_t n) { return nftp_xxh64(p, n); }
+
+static struct {
+	const char *name;
+	uint64_t  (*fn)(const uint8_t *, size_t);
+} hashes[] = {
+	{ "djb", bench_djb },
+	{ "fnv1a", bench_fnv1a },
+	{ "crc", bench_crc },
+	{ "crc32", bench_crc32 },
+	{ "crc32_sw", bench_crc32_sw },
+	{ "crc32c", bench_crc32c },
+	{ "crc32c_sw", bench_crc32c_sw },
+	{ "xxh64", bench_xxh64 },
+};
+
+static volatile uint64_t sink;
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	int      json = 0, first = 1;
+	size_t   maxsz = BENCH_MAX_SIZE;
+	uint8_t *buf;
+
+	if (argc > 1)
+		json = (0 == strcmp(argv[1], "json"));
+	if (argc > 2)
+		maxsz = strtoull(argv[2], NULL, 10);
+
+	if ((buf = malloc(maxsz + 64)) == NULL)
+		return 1;
+	srand(1);
+	for (size_t i = 0; i < maxsz + 64; ++i)
+		buf[i] = (uint8_t) rand();
+
+	if (json)
+		printf("[\n");
+	else
+		printf("hash,size,offset,iters,seconds,gbps,cpb\n");
+
+	for (size_t h = 0; h < sizeof(hashes) / sizeof(hashes[0]); ++h) {
+		for (size_t sz = 16; sz <= maxsz; sz *= 4) {
+			for (size_t off = 0; off <= 1; ++off) {
+				const uint8_t *p = buf + off;
+				uint64_t       iters = 0, c0, c1;
+				double         t0, t1;
+
+				// Warm up the caches and the lazy tables
+				sink += hashes[h].fn(p, sz);
+
+				t0 = now();
+				c0 = bench_cycles();
+				do {
+					for (int i = 0; i < 16; ++i)
+						sink += hashes[h].fn(p, sz);
+					iters += 16;
+					t1 = now();
+				} while (t1 - t0 < BENCH_MIN_TIME);
+				c1 = bench_cycles();
+
+				double bytes = (double) sz * iters;
+				double gbps  = bytes / (t1 - t0) / 1e9;
+				double cpb   = c1 > c0 ? (c1 - c0) / bytes : -1;
+
+				if (json)
+					printf("%s  {\"hash\": \"%s\", \"size\": %zu, "
+					       "\"offset\": %zu, \"iters\": %llu, "
+					       "\"seconds\": %.6f, \"gbps\": %.3f, "
+					       "\"cpb\": %.3f}",
+					    first ? "" : ",\n", hashes[h].name, sz, off,
+					    (unsigned long long) iters, t1 - t0, gbps, cpb);
+				else
+					printf("%s,%zu,%zu,%llu,%.6f,%.3f,%.3f\n",
+					    hashes[h].name, sz, off,
+					    (unsigned long long) iters, t1 - t0, gbps, cpb);
+				first = 0;
+			}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,252 @@
+// Author: wangha <wangha at emqx dot io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+//
+// Micro-benchmark of nftp_iovs and nftp_vec, locked and nolock.
+//
+// Usage: bench-iovs [csv|json]
+//
+// Each case runs for a while and reports ns per op. An op of push/pop
+// is one push and one pop. An op of encode is nftp_encode_iovs of a FILE
+// msg, which pushes 6 iovs into a fresh chain. An op of msg is encoding
+// a FILE msg from scratch: a chain by nftp_iovs_alloc, a chain inline on
+// stack by nftp_iovs_init, or a flat buffer by nftp_encode.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nftp.h"
+
+#define BENCH_MIN_TIME 0.2 // Seconds for each measurement at least
+#define BENCH_ROUND    1024
+
+static int
+bench_iovs_pushpop(int nolock, uint64_t *itersp, double *secp);
+static int
+bench_iovs_encode(int nolock, uint64_t *itersp, double *secp);
+static int
+bench_vec_pushpop(int nolock, uint64_t *itersp, double *secp);
+static int
+bench_msg(int mode, uint64_t *itersp, double *secp);
+
+enum { MSG_ALLOC, MSG_INLINE, MSG_FLAT };
+
+static const char *locks[] = { "mutex", "nolock" };
+static const char *msgs[]  = { "alloc", "inline", "flat" };
+
+static struct {
+	const char * name;
+	int (*fn)(int, uint64_t *, double *);
+	const char **modes;
+	int          nmode;
+} cases[] = {
+	{ "iovs_pushpop", bench_iovs_pushpop, locks, 2 },
+	{ "iovs_encode", bench_iovs_encode, locks, 2 },
+	{ "vec_pushpop", bench_vec_pushpop, locks, 2 },
+	{ "msg", bench_msg, msgs, 3 },
+};
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_iovs_pushpop(int nolock, uint64_t *itersp, double *secp)
+{
+	nftp_iovs *iovs;
+	void *     ptr;
+	size_t     len;
+	uint64_t   iters = 0;
+	double     t0, t1;
+	char       buf[8];
+
+	if (0 != (nolock ? nftp_iovs_alloc_nolock(&iovs) : nftp_iovs_alloc(&iovs)))
+		return 1;
+
+	t0 = now();
+	do {
+		for (int i = 0; i < BENCH_ROUND; ++i) {
+			nftp_iovs_push(iovs, buf, sizeof(buf), NFTP_TAIL);
+			nftp_iovs_pop(iovs, &ptr, &len, NFTP_HEAD);
+		}
+		iters += BENCH_ROUND;
+		t1 = now();
+	} while (t1 - t0 < BENCH_MIN_TIME);
+
+	nftp_iovs_free(iovs);
+	*itersp = iters;
+	*secp   = t1 - t0;
+	return 0;
+}
+
+static int
+bench_iovs_encode(int nolock, uint64_t *itersp, double *secp)
+{
+	nftp       p;
+	nftp_iovs *iovs;
+	void *     ptr;
+	size_t     len;
+	uint64_t   iters = 0;
+	double     t0, t1;
+	uint8_t    content[64];
+
+	memset(content, 'x', sizeof(content));
+	nftp_init(&p);
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 1;
+	p.content  = content;
+	p.ctlen    = sizeof(content);
+	p.len      = nftp_encoded_size(&p);
+
+	if (0 != (nolock ? nftp_iovs_alloc_nolock(&iovs) : nftp_iovs_alloc(&iovs)))
+		return 1;
+
+	t0 = now();
+	do {
+		for (int i = 0; i < BENCH_ROUND; ++i) {
+			nftp_encode_iovs(&p, iovs);
+			while (0 == nftp_iovs_pop(iovs, &ptr, &len, NFTP_TAIL))
+				;
+		}
+		iters += BENCH_ROUND;
+		t1 = now();
+	} while (t1 - t0 < BENCH_MIN_TIME);
+
+	nftp_iovs_free(iovs);
+	p.content = NULL;
+	nftp_fini(&p);
+	*itersp = iters;
+	*secp   = t1 - t0;
+	return 0;
+}
+
+static int
+bench_vec_pushpop(int nolock, uint64_t *itersp, double *secp)
+{
+	nftp_vec *v;
+	void *    ptr;
+	uint64_t  iters = 0;
+	double    t0, t1;
+
+	if (0 != (nolock ? nftp_vec_alloc_nolock(&v, 0) : nftp_vec_alloc(&v, 0)))
+		return 1;
+
+	t0 = now();
+	do {
+		for (int i = 0; i < BENCH_ROUND; ++i) {
+			nftp_vec_push(v, &iters, NFTP_TAIL);
+			nftp_vec_pop(v, &ptr, NFTP_HEAD);
+		}
+		iters += BENCH_ROUND;
+		t1 = now();
+	} while (t1 - t0 < BENCH_MIN_TIME);
+
+	nftp_vec_free(v);
+	*itersp = iters;
+	*secp   = t1 - t0;
+	return 0;
+}
+
+static int
+bench_msg(int mode, uint64_t *itersp, double *secp)
+{
+	nftp       p;
+	nftp_iovs  stk, *iovs;
+	uint8_t *  v;
+	size_t     len;
+	uint64_t   iters = 0;
+	double     t0, t1;
+	uint8_t    content[64];
+
+	memset(content, 'x', sizeof(content));
+	nftp_init(&p);
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 1;
+	p.content  = content;
+	p.ctlen    = sizeof(content);
+	p.len      = nftp_encoded_size(&p);
+
+	t0 = now();
+	do {
+		for (int i = 0; i < BENCH_ROUND; ++i) {
+			switch (mode) {
+			case MSG_ALLOC:
+				nftp_iovs_alloc(&iovs);
+				nftp_encode_iovs(&p, iovs);
+				nftp_iovs_free(iovs);
+				break;
+			case MSG_INLINE:
+				nftp_iovs_init(&stk);
+				nftp_encode_iovs(&p, &stk);
+				nftp_iovs_fini(&stk);
+				break;
+			case MSG_FLAT:
+				nftp_encode(&p, &v, &len);
+				free(v);
+				break;
+			}
+		}
+		iters += BENCH_ROUND;
+		t1 = now();
+	} while (t1 - t0 < BENCH_MIN_TIME);
+
+	p.content = NULL;
+	nftp_fini(&p);
+	*itersp = iters;
+	*secp   = t1 - t0;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int json = 0, first = 1;
+
+	if (argc > 1)
+		json = (0 == strcmp(argv[1], "json"));
+
+	if (json)
+		printf("[\n");
+	else
+		printf("case,mode,iters,seconds,nsop\n");
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		for (int m = 0; m < cases[c].nmode; ++m) {
+			uint64_t    iters;
+			double      sec, nsop;
+			const char *mode = cases[c].modes[m];
+
+			if (0 != cases[c].fn(m, &iters, &sec))
+				return 1;
+			nsop = sec * 1e9 / iters;
+
+			if (json)
+				printf("%s  {\"case\": \"%s\", \"mode\": \"%s\", "
+				       "\"iters\": %llu, \"seconds\": %.6f, "
+				       "\"nsop\": %.2f}",
+				    first ? "" : ",\n", cases[c].name, mode,
+				    (unsigned long long) iters, sec, nsop);
+			else
+				printf("%s,%s,%llu,%.6f,%.2f\n", cases[c].name,
+				    mode, (unsigned long long) iters, sec, nsop);
+			first = 0;
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+	return 0;
+}
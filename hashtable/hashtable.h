@@ -107,4 +107,30 @@ int _ht_resize(HashTable* table, size_t new_capacity);
 void _ht_rehash(HashTable* table, HTNode** old, size_t old_capacity);
 
 void ht_iterate(HashTable* ht, void* user, void (*callback)(void* key, void* value, void* user));
+
+/* Iterator */
+typedef struct HTIter {
+	HashTable* table;
+	size_t chain;
+	HTNode* node;
+} HTIter;
+
+static inline void ht_iter_init(HTIter* it, HashTable* table) {
+	it->table = table;
+	it->chain = 0;
+	it->node = NULL;
+}
+
+/* The next node, or NULL at the end. Don't erase the node returned
+ * before moving on. */
+static inline HTNode* ht_iter_next(HTIter* it) {
+	if (it->node) it->node = it->node->next;
+	while (!it->node && it->chain < it->table->capacity) {
+		it->node = it->table->nodes[it->chain++];
+	}
+	return it->node;
+}
+
+#define HT_FOREACH(table, it, node) \
+	for (ht_iter_init(&(it), (table)); ((node) = ht_iter_next(&(it))) != NULL;)
 #endif /* HASHTABLE_H */
@@ -9,6 +9,7 @@
 // This is a Customized File Transfer Protocol nftp.
 //
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -22,44 +23,119 @@ nftp_alloc(nftp ** pp)
 	if ((p = malloc(sizeof(nftp))) == NULL) {
 		return (NFTP_ERR_MEM);
 	}
+	nftp_init(p);
+
+	*pp = p;
+	return (0);
+}
+
+// Initialize a nftp in place, e.g. on stack or inside another struct.
+// It must be released by nftp_fini rather than nftp_free.
+int
+nftp_init(nftp * p)
+{
+	if (p == NULL) {
+		return (NFTP_ERR_EMPTY);
+	}
 
 	p->type = 0x00;
+	p->len = 0;
 	p->id = 0;
 	p->blocks = 0;
+	p->blockseq = 0;
 	p->fpath = NULL;
 	p->fname = NULL;
 	p->namelen = 0;
 	p->fileid = 0;
+	p->hashid = NFTP_HASH_CRC32C;
 	p->hashcode = 0;
-	p->content = 0;
+	p->content = NULL;
 	p->ctlen = 0;
-	if ((p->exbuf = malloc(sizeof(char) * 14)) == NULL) {
-		return (NFTP_ERR_MEM);
-	}
+	p->flags = 0;
+	p->blkcrc = 0;
+	p->opts = 0;
+	p->sid = 0;
 
-	*pp = p;
 	return (0);
 }
 
+// Release what p owns and make it ready for next msg
 int
-nftp_decode_iovs(nftp * p, nftp_iovs * iovs)
+nftp_reset(nftp * p)
 {
-	uint8_t * v;
-	size_t iolen;
+	int rv;
 
-	if (!p || !iovs) {
+	if (0 != (rv = nftp_fini(p))) {
+		return rv;
+	}
+	return nftp_init(p);
+}
+
+int
+nftp_fini(nftp * p)
+{
+	if (p == NULL) {
 		return (NFTP_ERR_EMPTY);
 	}
 
-	if (0 != nftp_iovs2stream(iovs, &v, &iolen)) {
-		return (NFTP_ERR_IOVS);
+	if (p->fpath) {
+		free(p->fpath);
+		p->fpath = NULL;
+	}
+	if (p->fname) {
+		free(p->fname);
+		p->fname = NULL;
+	}
+	if (p->content) {
+		free(p->content);
+		p->content = NULL;
 	}
 
-	return nftp_decode(p, v, iolen);
+	return (0);
 }
 
+// The hash trailer of HELLO. CRC32C is a bare 4 bytes as v1, options
+// follow it as a u16 count (1) and a byte of NFTP_OPT, which v1 peers
+// ignore. Other engines send the engine id followed by a digest of the
+// engine width, and optionally a byte of NFTP_OPT. The 7 bytes of CRC32C
+// with options never match a tagged trailer of 5, 6, 9 or 10 bytes.
+static int
+nftp_decode_hash(const uint8_t *v, size_t len, uint8_t *idp, uint64_t *hashp,
+    uint8_t *optsp)
+{
+	const nftp_hash_engine *e;
+
+	if (len == 4 || len == 7) {
+		*idp = NFTP_HASH_CRC32C;
+		nftp_get_u32(v, *hashp);
+		if (len == 7) {
+			if (v[4] != 0 || v[5] != 1)
+				return (NFTP_ERR_HASH);
+			*optsp = v[6];
+		}
+		return (0);
+	}
+	if (len < 1 || (e = nftp_hash_engine_get(v[0])) == NULL)
+		return (NFTP_ERR_HASH);
+	if (len < 1 + (size_t)e->width)
+		return (NFTP_ERR_STREAM);
+
+	*idp = e->id;
+	if (e->width == 8) {
+		nftp_get_u64(v + 1, *hashp);
+	} else {
+		nftp_get_u32(v + 1, *hashp);
+	}
+	if (len > 1 + (size_t)e->width)
+		*optsp = v[1 + e->width];
+	return (0);
+}
+
+// Each field is checked against the remaining bytes before it's read
+#define NFTP_NEED(n) if (len - pos < (size_t)(n)) return (NFTP_ERR_STREAM)
+
 int
-nftp_decode(nftp *p, uint8_t *v, size_t len)
+nftp_decode_view(nftp_view *p, const uint8_t *v, size_t len)
 {
 	size_t pos = 0;
 
@@ -67,6 +143,7 @@ nftp_decode(nftp *p, uint8_t *v, size_t len)
 	// Ensure the length of stream is longger than fixed header
 	if (len < 6) return (NFTP_ERR_STREAM);
 
+	memset(p, 0, offsetof(nftp_view, namebuf));
 	p->type = *(v + pos); ++pos; // type
 	nftp_get_u32(v + pos, p->len); pos += 4; // len
 
@@ -76,48 +153,63 @@ nftp_decode(nftp *p, uint8_t *v, size_t len)
 	// Option parameter
 	switch ((uint32_t)p->type) {
 	case NFTP_TYPE_HELLO:
+		NFTP_NEED(1 + 2 + 2);
 		p->id = *(v + pos); ++pos; // id
 
 		nftp_get_u16(v + pos, p->blocks); pos += 2;
 		nftp_get_u16(v + pos, p->namelen); pos += 2;
 
-		if ((p->fname = malloc(sizeof(char) * (1 + p->namelen))) == NULL)
-			return (NFTP_ERR_MEM);
-		memcpy(p->fname, v + pos, p->namelen); pos += p->namelen;
-		p->fname[p->namelen] = '\0';
+		NFTP_NEED(p->namelen);
+		p->fname = v + pos; pos += p->namelen;
 
-		p->ctlen = p->len - pos;
-		if ((p->content = malloc(sizeof(char) * p->ctlen)) == NULL)
-			return (NFTP_ERR_MEM);
-		memcpy(p->content, v + pos, p->ctlen); pos = p->len;
-		nftp_get_u32(p->content, p->hashcode);
-		break;
+		p->ctlen = len - pos;
+		p->content = v + pos; pos = len;
+		return nftp_decode_hash(p->content, p->ctlen,
+		    &p->hashid, &p->hashcode, &p->opts);
 
 	case NFTP_TYPE_ACK:
+		NFTP_NEED(1 + 4);
 		p->id = *(v + pos); ++pos; // id
 
 		nftp_get_u32(v + pos, p->fileid); pos += 4;
+		// The sid of compact mode given by recver
+		if (len > pos) {
+			p->sid = *(v + pos); ++pos;
+		}
 		break;
 
 	case NFTP_TYPE_FILE:
 	case NFTP_TYPE_END:
+		NFTP_NEED(4 + 2 + 4);
 		nftp_get_u32(v + pos, p->fileid); pos += 4;
 
 		nftp_get_u16(v + pos, p->blockseq); pos += 2;
 
 		nftp_get_u32(v + pos, p->ctlen); pos += 4;
 
-		if ((p->content = malloc(sizeof(char) * p->ctlen)) == NULL)
-			return (NFTP_ERR_MEM);
-		memcpy(p->content, v + pos, p->ctlen); pos = p->len;
+		NFTP_NEED(p->ctlen);
+		p->content = v + pos; pos += p->ctlen;
+
+		// Block CRC, nothing else may follow the content
+		if (len - pos == 4) {
+			nftp_get_u32(v + pos, p->blkcrc); pos += 4;
+			p->flags |= NFTP_FLAG_BLKCRC;
+		} else if (len != pos) {
+			return (NFTP_ERR_STREAM);
+		}
 		break;
 
 	case NFTP_TYPE_GIVEME:
+		NFTP_NEED(4 + 2);
 		nftp_get_u32(v + pos, p->fileid); pos += 4;
 
-		// TODO here we still according the standard in ver1.0
-		// Or the API (nftp_handler) needs to be update.
+		// The first block asked. In v2.0 it's followed by a bitmap of
+		// blocks from it, see nftp_bitmap_runs.
 		nftp_get_u16(v + pos, p->blockseq); pos += 2;
+		if (len > pos) {
+			p->ctlen = len - pos;
+			p->content = v + pos; pos = len;
+		}
 		break;
 
 	default:
@@ -126,10 +218,311 @@ nftp_decode(nftp *p, uint8_t *v, size_t len)
 	return (0);
 }
 
+// Copy the fields of a view to p. The content buffer is allocated but
+// left to the caller to fill.
+static int
+nftp_from_view(nftp *p, const nftp_view *view)
+{
+	p->type     = view->type;
+	p->len      = view->len;
+	p->id       = view->id;
+	p->blocks   = view->blocks;
+	p->blockseq = view->blockseq;
+	p->namelen  = view->namelen;
+	p->fileid   = view->fileid;
+	p->hashid   = view->hashid;
+	p->hashcode = view->hashcode;
+	p->ctlen    = view->ctlen;
+	p->flags    = view->flags;
+	p->blkcrc   = view->blkcrc;
+	p->opts     = view->opts;
+	p->sid      = view->sid;
+
+	if (view->fname) {
+		if ((p->fname = malloc(sizeof(char) * (1 + p->namelen))) == NULL)
+			return (NFTP_ERR_MEM);
+		memcpy(p->fname, view->fname, p->namelen);
+		p->fname[p->namelen] = '\0';
+	}
+	if (p->type == NFTP_TYPE_HELLO || p->type == NFTP_TYPE_FILE ||
+	    p->type == NFTP_TYPE_END ||
+	    (p->type == NFTP_TYPE_GIVEME && p->ctlen > 0)) {
+		if ((p->content = malloc(sizeof(char) * p->ctlen)) == NULL)
+			return (NFTP_ERR_MEM);
+	}
+	return (0);
+}
+
+int
+nftp_decode(nftp *p, uint8_t *v, size_t len)
+{
+	int       rv;
+	nftp_view view;
+
+	if (!p) return (NFTP_ERR_EMPTY);
+	if (0 != (rv = nftp_decode_view(&view, v, len)))
+		return rv;
+	if (0 != (rv = nftp_from_view(p, &view)))
+		return rv;
+	if (p->flags & NFTP_FLAG_BLKCRC) {
+		// Verify in the pass of copy
+		if (p->blkcrc != nftp_crc32c_copy(p->content, view.content, p->ctlen))
+			return (NFTP_ERR_HASH);
+	} else if (p->content) {
+		memcpy(p->content, view.content, p->ctlen);
+	}
+	return (0);
+}
+
+// A read position in iovs, it never stops at the end of a segment
+struct iovs_cur {
+	nftp_iovs *iovs;
+	size_t     idx;
+	size_t     off;
+};
+
+static void
+iovs_cur_settle(struct iovs_cur *c)
+{
+	void * base;
+	size_t len;
+
+	while (0 == nftp_iovs_get(c->iovs, c->idx, &base, &len) &&
+	    c->off == len) {
+		c->idx ++;
+		c->off = 0;
+	}
+}
+
+// Copy n bytes to dst and move forward, dst is NULL to skip them
+static int
+iovs_cur_read(struct iovs_cur *c, uint8_t *dst, size_t n)
+{
+	void * base;
+	size_t len, cp;
+
+	while (n > 0) {
+		if (0 != nftp_iovs_get(c->iovs, c->idx, &base, &len))
+			return (NFTP_ERR_STREAM);
+		cp = len - c->off < n ? len - c->off : n;
+		if (dst) {
+			memcpy(dst, (uint8_t *)base + c->off, cp);
+			dst += cp;
+		}
+		c->off += cp;
+		n -= cp;
+		iovs_cur_settle(c);
+	}
+	return (0);
+}
+
+// Same as iovs_cur_read, and hash the bytes copied in the same pass
+static int
+iovs_cur_read_crc(struct iovs_cur *c, uint8_t *dst, size_t n,
+    nftp_crc32c_ctx *ctx)
+{
+	void * base;
+	size_t len, cp;
+
+	while (n > 0) {
+		if (0 != nftp_iovs_get(c->iovs, c->idx, &base, &len))
+			return (NFTP_ERR_STREAM);
+		cp = len - c->off < n ? len - c->off : n;
+		nftp_crc32c_update_copy(ctx, dst, (uint8_t *)base + c->off, cp);
+		dst += cp;
+		c->off += cp;
+		n -= cp;
+		iovs_cur_settle(c);
+	}
+	return (0);
+}
+
+// The address of next n bytes, or NULL if they are not in one segment
+static const uint8_t *
+iovs_cur_ptr(struct iovs_cur *c, size_t n)
+{
+	void * base;
+	size_t len;
+
+	if (0 != nftp_iovs_get(c->iovs, c->idx, &base, &len))
+		return NULL;
+	if (len - c->off < n)
+		return NULL;
+	return (uint8_t *)base + c->off;
+}
+
+// Append the next n bytes to dst as references to the segments
+static int
+iovs_cur_slice(struct iovs_cur *c, nftp_iovs *dst, size_t n)
+{
+	int    rv;
+	void * base;
+	size_t len, cp;
+
+	while (n > 0) {
+		if (0 != nftp_iovs_get(c->iovs, c->idx, &base, &len))
+			return (NFTP_ERR_STREAM);
+		cp = len - c->off < n ? len - c->off : n;
+		if (0 != (rv = nftp_iovs_append(dst, (uint8_t *)base + c->off, cp)))
+			return rv;
+		c->off += cp;
+		n -= cp;
+		iovs_cur_settle(c);
+	}
+	return (0);
+}
+
+// Same as nftp_decode_view, but fields are read across the segments.
+// The cursor is left at the beginning of content.
+static int
+nftp_decode_cur(nftp_view *p, struct iovs_cur *c, size_t len)
+{
+	uint8_t         hd[10];
+	size_t          pos = 0;
+	struct iovs_cur t;
+
+	// Ensure the length of stream is longger than fixed header
+	if (len < 6) return (NFTP_ERR_STREAM);
+
+	memset(p, 0, offsetof(nftp_view, namebuf));
+	iovs_cur_settle(c);
+	if (0 != iovs_cur_read(c, hd, 5)) return (NFTP_ERR_STREAM);
+	pos += 5;
+	p->type = hd[0];
+	nftp_get_u32(hd + 1, p->len);
+
+	// Check if iolen eq to the length from decoding
+	if (len != p->len) return (NFTP_ERR_STREAM);
+
+	switch ((uint32_t)p->type) {
+	case NFTP_TYPE_HELLO:
+		NFTP_NEED(1 + 2 + 2);
+		iovs_cur_read(c, hd, 5); pos += 5;
+		p->id = hd[0];
+		nftp_get_u16(hd + 1, p->blocks);
+		nftp_get_u16(hd + 3, p->namelen);
+
+		NFTP_NEED(p->namelen);
+		if ((p->fname = iovs_cur_ptr(c, p->namelen)) != NULL) {
+			iovs_cur_read(c, NULL, p->namelen);
+		} else {
+			if (p->namelen > NFTP_FNAME_LEN)
+				return (NFTP_ERR_FILENAME);
+			iovs_cur_read(c, p->namebuf, p->namelen);
+			p->fname = p->namebuf;
+		}
+		pos += p->namelen;
+
+		// Peek the hash, it's at most an id with 8 bytes digest
+		p->ctlen = len - pos;
+		p->content = iovs_cur_ptr(c, p->ctlen);
+		t = *c;
+		iovs_cur_read(&t, hd, p->ctlen < 10 ? p->ctlen : 10);
+		return nftp_decode_hash(hd, p->ctlen,
+		    &p->hashid, &p->hashcode, &p->opts);
+
+	case NFTP_TYPE_ACK:
+		NFTP_NEED(1 + 4);
+		iovs_cur_read(c, hd, 5); pos += 5;
+		p->id = hd[0];
+		nftp_get_u32(hd + 1, p->fileid);
+		if (len > pos) {
+			iovs_cur_read(c, &p->sid, 1); ++pos;
+		}
+		break;
+
+	case NFTP_TYPE_FILE:
+	case NFTP_TYPE_END:
+		NFTP_NEED(4 + 2 + 4);
+		iovs_cur_read(c, hd, 10); pos += 10;
+		nftp_get_u32(hd, p->fileid);
+		nftp_get_u16(hd + 4, p->blockseq);
+		nftp_get_u32(hd + 6, p->ctlen);
+
+		NFTP_NEED(p->ctlen);
+		p->content = iovs_cur_ptr(c, p->ctlen);
+
+		// Block CRC, nothing else may follow the content
+		if (len - pos - p->ctlen == 4) {
+			t = *c;
+			iovs_cur_read(&t, NULL, p->ctlen);
+			iovs_cur_read(&t, hd, 4);
+			nftp_get_u32(hd, p->blkcrc);
+			p->flags |= NFTP_FLAG_BLKCRC;
+		} else if (len - pos != p->ctlen) {
+			return (NFTP_ERR_STREAM);
+		}
+		break;
+
+	case NFTP_TYPE_GIVEME:
+		NFTP_NEED(4 + 2);
+		iovs_cur_read(c, hd, 6); pos += 6;
+		nftp_get_u32(hd, p->fileid);
+		nftp_get_u16(hd + 4, p->blockseq);
+		if (len > pos) {
+			p->ctlen = len - pos;
+			p->content = iovs_cur_ptr(c, p->ctlen);
+		}
+		break;
+
+	default:
+		return (NFTP_ERR_TYPE);
+	}
+	return (0);
+}
+
+// Decode a msg which is scattered in iovs without linearizing it. The
+// content is appended to ctiovs (if not NULL) as references to the
+// segments of iovs.
+int
+nftp_decode_iovs_view(nftp_view *p, nftp_iovs *ctiovs, nftp_iovs *iovs)
+{
+	int             rv;
+	struct iovs_cur c = { iovs, 0, 0 };
+
+	if (!p || !iovs) return (NFTP_ERR_EMPTY);
+	if (0 != (rv = nftp_decode_cur(p, &c, nftp_iovs_iolen(iovs))))
+		return rv;
+	if (ctiovs && p->type != NFTP_TYPE_ACK)
+		return iovs_cur_slice(&c, ctiovs, p->ctlen);
+	return (0);
+}
+
+int
+nftp_decode_iovs(nftp * p, nftp_iovs * iovs)
+{
+	int             rv;
+	nftp_view       view;
+	struct iovs_cur c;
+	nftp_crc32c_ctx ctx;
+
+	if (!p || !iovs) {
+		return (NFTP_ERR_EMPTY);
+	}
+
+	c.iovs = iovs;
+	c.idx  = 0;
+	c.off  = 0;
+	if (0 != (rv = nftp_decode_cur(&view, &c, nftp_iovs_iolen(iovs))))
+		return rv;
+	if (0 != (rv = nftp_from_view(p, &view)))
+		return rv;
+	if (p->flags & NFTP_FLAG_BLKCRC) {
+		nftp_crc32c_init(&ctx);
+		iovs_cur_read_crc(&c, p->content, p->ctlen, &ctx);
+		if (p->blkcrc != nftp_crc32c_final(&ctx))
+			return (NFTP_ERR_HASH);
+	} else if (p->content) {
+		iovs_cur_read(&c, p->content, p->ctlen);
+	}
+	return (0);
+}
+
 int
 nftp_encode_iovs(nftp * p, nftp_iovs * iovs)
 {
 	int rv = 0;
+	const nftp_hash_engine *e;
 
 	if (!p || !iovs) return (NFTP_ERR_EMPTY);
 	if (nftp_iovs_len(iovs) != 0) return (NFTP_ERR_IOVS); // Dirty Iovs
@@ -148,14 +541,34 @@ nftp_encode_iovs(nftp * p, nftp_iovs * iovs)
 			goto error;
 		}
 
-		nftp_put_u32(p->exbuf + 8, p->hashcode);
-		rv |= nftp_iovs_append(iovs, (void *)(p->exbuf + 8), 4);
+		if (p->hashid == NFTP_HASH_CRC32C) {
+			nftp_put_u32(p->exbuf + 8, p->hashcode);
+			p->exbuf[12] = 0;
+			p->exbuf[13] = 1;
+			p->exbuf[14] = p->opts;
+			rv |= nftp_iovs_append(iovs, (void *)(p->exbuf + 8),
+			    p->opts ? 7 : 4);
+			break;
+		}
+		if ((e = nftp_hash_engine_get(p->hashid)) == NULL)
+			return (NFTP_ERR_HASH);
+		p->exbuf[8] = e->id;
+		if (e->width == 8) {
+			nftp_put_u64(p->exbuf + 9, p->hashcode);
+		} else {
+			nftp_put_u32(p->exbuf + 9, p->hashcode);
+		}
+		p->exbuf[9 + e->width] = p->opts;
+		rv |= nftp_iovs_append(iovs, (void *)(p->exbuf + 8),
+		    1 + e->width + (p->opts ? 1 : 0));
 		break;
 
 	case NFTP_TYPE_ACK:
 		if (0 != nftp_iovs_append(iovs, (void *)&p->id, 1)) goto error;
 		nftp_put_u32(p->exbuf + 4, p->fileid);
 		rv |= nftp_iovs_append(iovs, (void *)(p->exbuf + 4), 4);
+		if (p->sid)
+			rv |= nftp_iovs_append(iovs, (void *)&p->sid, 1);
 		break;
 
 	case NFTP_TYPE_FILE:
@@ -174,6 +587,13 @@ nftp_encode_iovs(nftp * p, nftp_iovs * iovs)
 
 		if (0 != nftp_iovs_append(iovs, (void *)p->content, p->ctlen))
 			goto error;
+
+		if (p->flags & NFTP_FLAG_BLKCRC) {
+			p->blkcrc = nftp_crc32c(p->content, p->ctlen);
+			nftp_put_u32(p->exbuf + 14, p->blkcrc);
+			if (0 != nftp_iovs_append(iovs, (void *)(p->exbuf + 14), 4))
+				goto error;
+		}
 		break;
 
 	case NFTP_TYPE_GIVEME:
@@ -184,6 +604,10 @@ nftp_encode_iovs(nftp * p, nftp_iovs * iovs)
 		nftp_put_u16(p->exbuf + 8, p->blockseq);
 		if (0 != nftp_iovs_append(iovs, (void *)(p->exbuf + 8), 2))
 			goto error;
+
+		if (p->ctlen > 0 &&
+		    0 != nftp_iovs_append(iovs, (void *)p->content, p->ctlen))
+			goto error;
 		break;
 
 	default:
@@ -203,50 +627,594 @@ error:
 	return (NFTP_ERR_IOVS);
 }
 
+int
+nftp_encode_iovs_owned(nftp *p, nftp_iovs *iovs)
+{
+	nftp_iovs  tmpiovs, *tmp = &tmpiovs;
+	nftp_buf * hb = NULL, *cb = NULL;
+	uint8_t *  ptr;
+	size_t     len, hlen = 0, pos = 0, run = 0;
+	int        rv;
+
+	if (!p || !iovs) return (NFTP_ERR_EMPTY);
+	if (nftp_iovs_len(iovs) != 0) return (NFTP_ERR_IOVS); // Dirty Iovs
+
+	nftp_iovs_init(tmp);
+	if (0 != (rv = nftp_encode_iovs(p, tmp)))
+		goto done;
+
+	// Everything but content goes to one buffer
+	hlen = nftp_iovs_iolen(tmp);
+	for (size_t i = 0; i < nftp_iovs_len(tmp); ++i) {
+		nftp_iovs_get(tmp, i, (void **)&ptr, &len);
+		if (p->content && ptr == p->content && len == p->ctlen && len > 0) {
+			hlen -= len;
+			if (0 != (rv = nftp_buf_wrap(&cb, p->content, len, free)))
+				goto done;
+			break;
+		}
+	}
+	if (0 != (rv = nftp_buf_alloc(&hb, hlen)))
+		goto done;
+
+	for (size_t i = 0; i < nftp_iovs_len(tmp); ++i) {
+		nftp_iovs_get(tmp, i, (void **)&ptr, &len);
+		if (cb && ptr == cb->data) {
+			// Flush the header bytes before content
+			if (run > 0 &&
+			    0 != (rv = nftp_iovs_push_buf(iovs, hb, pos - run, run, NFTP_TAIL)))
+				goto done;
+			run = 0;
+			if (0 != (rv = nftp_iovs_push_buf(iovs, cb, 0, len, NFTP_TAIL)))
+				goto done;
+			continue;
+		}
+		memcpy((uint8_t *)hb->data + pos, ptr, len);
+		pos += len;
+		run += len;
+	}
+	if (run > 0)
+		rv = nftp_iovs_push_buf(iovs, hb, pos - run, run, NFTP_TAIL);
+
+done:
+	if (0 != rv)
+		nftp_iovs_consume(iovs, nftp_iovs_iolen(iovs));
+	else if (cb)
+		p->content = NULL; // Moved to iovs
+	if (cb) {
+		// Keep content in nftp if it was not moved
+		if (0 != rv) cb->release = NULL;
+		nftp_buf_unref(cb);
+	}
+	if (hb)
+		nftp_buf_unref(hb);
+	nftp_iovs_fini(tmp);
+	return rv;
+}
+
+// Bytes of the hash trailer of HELLO, 0 if the engine is unknown
+static size_t
+nftp_hash_size(nftp *p)
+{
+	const nftp_hash_engine *e;
+
+	if (p->hashid == NFTP_HASH_CRC32C)
+		return p->opts ? 7 : 4;
+	if ((e = nftp_hash_engine_get(p->hashid)) == NULL)
+		return 0;
+	return 1 + e->width + (p->opts ? 1 : 0);
+}
+
+// Return the bytes p takes on the wire, 0 if p can't be encoded.
+size_t
+nftp_encoded_size(nftp *p)
+{
+	size_t hsz;
+
+	if (!p) return 0;
+
+	switch (p->type) {
+	case NFTP_TYPE_HELLO:
+		if ((hsz = nftp_hash_size(p)) == 0)
+			return 0;
+		return 5 + 1 + 2 + 2 + p->namelen + hsz;
+	case NFTP_TYPE_ACK:
+		return 5 + 1 + 4 + (p->sid ? 1 : 0);
+	case NFTP_TYPE_FILE:
+	case NFTP_TYPE_END:
+		return 5 + 4 + 2 + 4 + p->ctlen +
+		    (p->flags & NFTP_FLAG_BLKCRC ? 4 : 0);
+	case NFTP_TYPE_GIVEME:
+		return 5 + 4 + 2 + p->ctlen;
+	default:
+		return 0;
+	}
+}
+
+// Encode p to buf which is owned by caller, nothing is allocated. The
+// length written is nftp_encoded_size(p).
+int
+nftp_encode_into(nftp *p, uint8_t *buf, size_t cap)
+{
+	size_t len, pos = 0;
+	const nftp_hash_engine *e;
+
+	if (!p || !buf) return (NFTP_ERR_EMPTY);
+	if ((len = nftp_encoded_size(p)) == 0)
+		return p->type == NFTP_TYPE_HELLO ? (NFTP_ERR_HASH) : (NFTP_ERR_TYPE);
+	if (len > cap) return (NFTP_ERR_OVERFLOW);
+
+	buf[pos] = p->type; ++pos;
+	nftp_put_u32(buf + pos, len); pos += 4;
+
+	switch (p->type) {
+	case NFTP_TYPE_HELLO:
+		buf[pos] = p->id; ++pos;
+		nftp_put_u16(buf + pos, p->blocks); pos += 2;
+		nftp_put_u16(buf + pos, p->namelen); pos += 2;
+		memcpy(buf + pos, p->fname, p->namelen); pos += p->namelen;
+
+		if (p->hashid == NFTP_HASH_CRC32C) {
+			nftp_put_u32(buf + pos, p->hashcode);
+			if (p->opts) {
+				buf[pos + 4] = 0;
+				buf[pos + 5] = 1;
+				buf[pos + 6] = p->opts;
+			}
+			break;
+		}
+		e = nftp_hash_engine_get(p->hashid);
+		buf[pos] = e->id; ++pos;
+		if (e->width == 8) {
+			nftp_put_u64(buf + pos, p->hashcode);
+		} else {
+			nftp_put_u32(buf + pos, p->hashcode);
+		}
+		pos += e->width;
+		if (p->opts)
+			buf[pos] = p->opts;
+		break;
+
+	case NFTP_TYPE_ACK:
+		buf[pos] = p->id; ++pos;
+		nftp_put_u32(buf + pos, p->fileid); pos += 4;
+		if (p->sid)
+			buf[pos] = p->sid;
+		break;
+
+	case NFTP_TYPE_FILE:
+	case NFTP_TYPE_END:
+		nftp_put_u32(buf + pos, p->fileid); pos += 4;
+		nftp_put_u16(buf + pos, p->blockseq); pos += 2;
+		nftp_put_u32(buf + pos, p->ctlen); pos += 4;
+		if (p->flags & NFTP_FLAG_BLKCRC) {
+			// Hash in the pass of copy
+			p->blkcrc = nftp_crc32c_copy(buf + pos, p->content, p->ctlen);
+			nftp_put_u32(buf + pos + p->ctlen, p->blkcrc);
+		} else if (p->ctlen) {
+			memcpy(buf + pos, p->content, p->ctlen);
+		}
+		break;
+
+	case NFTP_TYPE_GIVEME:
+		nftp_put_u32(buf + pos, p->fileid); pos += 4;
+		nftp_put_u16(buf + pos, p->blockseq); pos += 2;
+		if (p->ctlen)
+			memcpy(buf + pos, p->content, p->ctlen);
+		break;
+	}
+
+	return (0);
+}
+
 int
 nftp_encode(nftp * p, uint8_t ** vp, size_t * len)
 {
 	uint8_t * v;
-	nftp_iovs * iovs;
-	int rv = 0;
+	size_t    sz;
+	int       rv = 0;
 
-	if ((rv = nftp_iovs_alloc(&iovs)) != 0) {
+	if (!p) return (NFTP_ERR_EMPTY);
+	if ((sz = nftp_encoded_size(p)) == 0)
+		return p->type == NFTP_TYPE_HELLO ? (NFTP_ERR_HASH) : (NFTP_ERR_TYPE);
+	if ((v = malloc(sz)) == NULL)
+		return (NFTP_ERR_MEM);
+	if ((rv = nftp_encode_into(p, v, sz)) != 0) {
+		free(v);
 		return rv;
 	}
-	if ((rv = nftp_encode_iovs(p, iovs)) != 0) {
+
+	*vp = v;
+	*len = sz;
+	return (0);
+}
+
+int
+nftp_free(nftp * p)
+{
+	int rv;
+
+	if (0 != (rv = nftp_fini(p))) {
 		return rv;
 	}
-	if ((rv = nftp_iovs2stream(iovs, &v, len)) != 0) {
-		return rv;
+
+	free(p);
+	return (0);
+}
+
+int
+nftp_framer_init(nftp_framer *f, size_t cap)
+{
+	if (f == NULL) return (NFTP_ERR_EMPTY);
+	if (cap < 5) cap = 5;
+
+	if ((f->buf = malloc(cap)) == NULL)
+		return (NFTP_ERR_MEM);
+	f->cap  = cap;
+	f->head = 0;
+	f->tail = 0;
+	return (0);
+}
+
+int
+nftp_framer_fini(nftp_framer *f)
+{
+	if (f == NULL) return (NFTP_ERR_EMPTY);
+
+	free(f->buf);
+	f->buf = NULL;
+	f->cap = f->head = f->tail = 0;
+	return (0);
+}
+
+// Make room for n bytes after tail. Bytes already returned are dropped,
+// and the buffer only grows when the pending bytes can't fit.
+static int
+framer_reserve(nftp_framer *f, size_t n)
+{
+	uint8_t *buf;
+	size_t   cap;
+
+	if (f->cap - f->tail >= n)
+		return (0);
+
+	if (f->head > 0) {
+		memmove(f->buf, f->buf + f->head, f->tail - f->head);
+		f->tail -= f->head;
+		f->head = 0;
+		if (f->cap - f->tail >= n)
+			return (0);
 	}
 
-	nftp_iovs_free(iovs);
+	for (cap = f->cap * 2; cap - f->tail < n; cap *= 2)
+		;
+	if ((buf = realloc(f->buf, cap)) == NULL)
+		return (NFTP_ERR_MEM);
+	f->buf = buf;
+	f->cap = cap;
+	return (0);
+}
 
-	*vp = v;
+int
+nftp_framer_feed(nftp_framer *f, const uint8_t *v, size_t len)
+{
+	int rv;
+
+	if (f == NULL || (v == NULL && len > 0)) return (NFTP_ERR_EMPTY);
+	if (0 != (rv = framer_reserve(f, len)))
+		return rv;
+	memcpy(f->buf + f->tail, v, len);
+	f->tail += len;
 	return (0);
 }
 
+// Get at least n bytes free space to recv() into, then commit the
+// number of bytes received. This saves the copy of feed.
 int
-nftp_free(nftp * p)
+nftp_framer_space(nftp_framer *f, size_t n, uint8_t **ptrp, size_t *lenp)
 {
-	if (p == NULL) {
+	int rv;
+
+	if (f == NULL) return (NFTP_ERR_EMPTY);
+	if (0 != (rv = framer_reserve(f, n)))
+		return rv;
+	*ptrp = f->buf + f->tail;
+	*lenp = f->cap - f->tail;
+	return (0);
+}
+
+int
+nftp_framer_commit(nftp_framer *f, size_t n)
+{
+	if (f == NULL) return (NFTP_ERR_EMPTY);
+	if (n > f->cap - f->tail) return (NFTP_ERR_OVERFLOW);
+
+	f->tail += n;
+	return (0);
+}
+
+static inline size_t varint_get(const uint8_t *, size_t, uint64_t *);
+
+// Return next complete msg. NFTP_ERR_EMPTY if more bytes are needed,
+// NFTP_ERR_STREAM if the len of msg is broken and the stream can't
+// be recovered. Compact msgs are split by their varint len after sid.
+int
+nftp_framer_next(nftp_framer *f, const uint8_t **msgp, size_t *lenp)
+{
+	uint64_t len;
+	size_t   n;
+
+	if (f == NULL) return (NFTP_ERR_EMPTY);
+
+	n = f->tail - f->head;
+	if (n > 0 && (f->buf[f->head] & NFTP_TYPE_COMPACT)) {
+		// The type & sid & len may be split. A len of 64MB fits
+		// in 4 bytes of varint, a 5th byte is a broken stream.
+		if (n < 3)
+			return (NFTP_ERR_EMPTY);
+		if (varint_get(f->buf + f->head + 2, n - 2, &len) == 0)
+			return n - 2 < 5 ? NFTP_ERR_EMPTY : NFTP_ERR_STREAM;
+		if (len < 4 || len > NFTP_FRAME_MAX)
+			return (NFTP_ERR_STREAM);
+	} else {
+		// The type & len may be split
+		if (n < 5)
+			return (NFTP_ERR_EMPTY);
+		nftp_get_u32(f->buf + f->head + 1, len);
+		if (len < 6 || len > NFTP_FRAME_MAX)
+			return (NFTP_ERR_STREAM);
+	}
+	if (f->tail - f->head < len)
 		return (NFTP_ERR_EMPTY);
+
+	*msgp = f->buf + f->head;
+	*lenp = len;
+	f->head += len;
+	if (f->head == f->tail)
+		f->head = f->tail = 0;
+	return (0);
+}
+
+// Bytes fed but not returned yet, i.e. the partial msg once next()
+// returns NFTP_ERR_EMPTY
+size_t
+nftp_framer_pending(nftp_framer *f)
+{
+	return f->tail - f->head;
+}
+
+// Bitmaps are LSB first, the bit i is (bm[i/8] >> (i%8)) & 1. Load 64
+// bits from bit off, bits out of nbits are 0.
+static inline uint64_t
+bitmap_load64(const uint8_t *bm, size_t nbits, size_t off)
+{
+	uint64_t w = 0;
+	size_t   byte = off / 8, nbytes = (nbits + 7) / 8, n;
+	uint8_t  tmp[9] = { 0 };
+
+	if (off >= nbits)
+		return 0;
+	n = nbytes - byte < 9 ? nbytes - byte : 9;
+	memcpy(tmp, bm + byte, n);
+	for (int i = 7; i >= 0; --i)
+		w = (w << 8) | tmp[i];
+	w = (w >> (off % 8)) | (off % 8 ? (uint64_t)tmp[8] << (64 - off % 8) : 0);
+	if (nbits - off < 64)
+		w &= ((uint64_t)1 << (nbits - off)) - 1;
+	return w;
+}
+
+// Position of the first bit from off which equals to v, or nbits
+static size_t
+bitmap_scan(const uint8_t *bm, size_t nbits, size_t off, int v)
+{
+	uint64_t w;
+
+	for (; off < nbits; off += 64) {
+		w = bitmap_load64(bm, nbits, off);
+		if (!v) {
+			w = ~w;
+			if (nbits - off < 64)
+				w &= ((uint64_t)1 << (nbits - off)) - 1;
+		}
+		if (w)
+			return off + __builtin_ctzll(w);
 	}
+	return nbits;
+}
 
-	if (p->fpath) {
-		free(p->fpath);
+// Split the set bits of bm into runs of consecutive bits. Whole words of
+// 0 or 1 are skipped with one ctz. Return the number of runs, which are
+// no more than max.
+size_t
+nftp_bitmap_runs(const uint8_t *bm, size_t nbits, nftp_run *runs, size_t max)
+{
+	size_t i = 0, j, n = 0;
+
+	while (n < max) {
+		if ((i = bitmap_scan(bm, nbits, i, 1)) >= nbits)
+			break;
+		j = bitmap_scan(bm, nbits, i, 0);
+		runs[n].start = i;
+		runs[n].len   = j - i;
+		n++;
+		i = j;
 	}
-	if (p->fname) {
-		free(p->fname);
+	return n;
+}
+
+size_t
+nftp_bitmap_count(const uint8_t *bm, size_t nbits)
+{
+	size_t n = 0;
+
+	for (size_t off = 0; off < nbits; off += 64)
+		n += __builtin_popcountll(bitmap_load64(bm, nbits, off));
+	return n;
+}
+
+// Write the bits [off, off+nbits) of src to dst inverted, i.e. the
+// blocks missing from a bitmap of blocks received.
+void
+nftp_bitmap_invert(uint8_t *dst, const uint8_t *src, size_t off, size_t nbits)
+{
+	uint64_t w;
+	size_t   n;
+
+	for (size_t i = 0; i < nbits; i += 64) {
+		w = ~bitmap_load64(src, off + nbits, off + i);
+		n = (nbits - i) < 64 ? (nbits - i + 7) / 8 : 8;
+		for (size_t k = 0; k < n; ++k)
+			dst[i / 8 + k] = (uint8_t)(w >> (8 * k));
 	}
-	if (p->content) {
-		free(p->content);
+	if (nbits % 8)
+		dst[nbits / 8] &= (1u << (nbits % 8)) - 1;
+}
+
+// Compact FILE(END), for links where the 15 bytes header is a big share
+// of a small block.
+//
+//   type | NFTP_TYPE_COMPACT [| NFTP_TYPE_BLKCRC]   1
+//   sid                                             1
+//   len                                             varint
+//   blockseq                                        varint
+//   content                                         len - above
+//   block crc                                       4, if NFTP_TYPE_BLKCRC
+//
+// The fileid is replaced by the sid given in ACK, and ctlen is implied
+// by len. The blockseq is absolute, 1 byte below 128 and 3 at most, so
+// a lost or resent msg does not shift the blocks after it.
+
+static inline size_t
+varint_len(uint64_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
 	}
-	if (p->exbuf) {
-		free(p->exbuf);
+	return n;
+}
+
+static inline size_t
+varint_put(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
 	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
 
-	free(p);
+// Return bytes read, 0 if it's truncated or too long
+static inline size_t
+varint_get(const uint8_t *p, size_t len, uint64_t *vp)
+{
+	uint64_t v = 0;
+
+	for (size_t n = 0; n < len && n < 10; ++n) {
+		v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+		if (!(p[n] & 0x80)) {
+			*vp = v;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+int
+nftp_compact_init(nftp_compact *cs, uint8_t sid, uint32_t fileid)
+{
+	if (cs == NULL || sid == 0) return (NFTP_ERR_EMPTY);
+
+	cs->sid    = sid;
+	cs->fileid = fileid;
 	return (0);
 }
 
+size_t
+nftp_compact_size(nftp *p, nftp_compact *cs)
+{
+	size_t body, n = 1;
+
+	if (!p || !cs) return 0;
+	if (p->type != NFTP_TYPE_FILE && p->type != NFTP_TYPE_END) return 0;
+
+	body = 1 + 1 + varint_len(p->blockseq) + p->ctlen +
+	    (p->flags & NFTP_FLAG_BLKCRC ? 4 : 0);
+	// The len counts its own varint
+	while (varint_len(body + n) != n)
+		n++;
+	return body + n;
+}
+
+// Encode a FILE(END) in compact form
+int
+nftp_encode_compact(nftp *p, nftp_compact *cs, uint8_t *buf, size_t cap)
+{
+	size_t len, pos = 0;
+
+	if (!p || !cs || !buf) return (NFTP_ERR_EMPTY);
+	if ((len = nftp_compact_size(p, cs)) == 0) return (NFTP_ERR_TYPE);
+	if (len > cap) return (NFTP_ERR_OVERFLOW);
+
+	buf[pos++] = p->type | NFTP_TYPE_COMPACT |
+	    (p->flags & NFTP_FLAG_BLKCRC ? NFTP_TYPE_BLKCRC : 0);
+	buf[pos++] = cs->sid;
+	pos += varint_put(buf + pos, len);
+	pos += varint_put(buf + pos, p->blockseq);
+
+	if (p->flags & NFTP_FLAG_BLKCRC) {
+		p->blkcrc = nftp_crc32c_copy(buf + pos, p->content, p->ctlen);
+		nftp_put_u32(buf + pos + p->ctlen, p->blkcrc);
+	} else if (p->ctlen) {
+		memcpy(buf + pos, p->content, p->ctlen);
+	}
+	return (0);
+}
+
+// Decode a compact msg of session cs to a view, as if it was a FILE(END)
+// of cs->fileid. The sid of a msg is v[1], to find its session.
+int
+nftp_decode_compact(nftp_view *p, nftp_compact *cs, const uint8_t *v, size_t len)
+{
+	size_t   pos = 0, n;
+	uint64_t u;
+
+	if (!p || !cs || !v) return (NFTP_ERR_EMPTY);
+	if (len < 4) return (NFTP_ERR_STREAM);
+	if (!(v[0] & NFTP_TYPE_COMPACT)) return (NFTP_ERR_TYPE);
+
+	memset(p, 0, offsetof(nftp_view, namebuf));
+	p->type = v[0] & ~(NFTP_TYPE_COMPACT | NFTP_TYPE_BLKCRC);
+	if (p->type != NFTP_TYPE_FILE && p->type != NFTP_TYPE_END)
+		return (NFTP_ERR_TYPE);
+	pos = 1;
+	if ((p->sid = v[pos++]) != cs->sid)
+		return (NFTP_ERR_ID);
+
+	if ((n = varint_get(v + pos, len - pos, &u)) == 0 || u != len)
+		return (NFTP_ERR_STREAM);
+	pos += n;
+	p->len = len;
+
+	if ((n = varint_get(v + pos, len - pos, &u)) == 0)
+		return (NFTP_ERR_STREAM);
+	pos += n;
+	if (u > NFTP_BLOCK_NUM)
+		return (NFTP_ERR_BLOCKS);
+	p->blockseq = (uint16_t)u;
+	p->fileid   = cs->fileid;
+
+	if (v[0] & NFTP_TYPE_BLKCRC) {
+		NFTP_NEED(4);
+		nftp_get_u32(v + len - 4, p->blkcrc);
+		p->flags |= NFTP_FLAG_BLKCRC;
+		len -= 4;
+	}
+	p->ctlen   = len - pos;
+	p->content = v + pos;
+	return (0);
+}
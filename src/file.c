@@ -7,6 +7,7 @@
 //
 //
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -205,6 +206,72 @@ nftp_file_readblk(char *fpath, int n, char **strp, size_t *sz)
 	return (0);
 }
 
+// Read cnt blocks from the nth block into one buffer. The number of
+// blocks is cut at the end of file, *cntp is the blocks read. If crcs
+// is not NULL, the crc32c of each block is computed right after it's
+// read, while it's still in cache.
+int
+nftp_file_readblks(char *fpath, int n, int *cntp, char **strp, size_t *sz,
+        uint32_t *crcs)
+{
+	FILE * fp;
+	char * str;
+	size_t filesize;
+	size_t blocks;
+	size_t off, len, pos, blksz;
+
+	if (n < 0 || *cntp <= 0) {
+		return (NFTP_ERR_BLOCKS);
+	}
+
+	if ((fp = fopen(fpath, "rb")) == NULL) {
+		nftp_fatal("open error");
+		return (NFTP_ERR_FILE);
+	}
+
+	fseek(fp, 0, SEEK_END);
+	filesize = ftell(fp);
+
+	blocks = filesize/nftp_get_blocksz() + 1;
+	if ((size_t)n >= blocks) {
+		fclose(fp);
+		return (NFTP_ERR_BLOCKS);
+	}
+	if ((size_t)(n + *cntp) > blocks) {
+		*cntp = blocks - n;
+	}
+
+	off = (size_t)n * nftp_get_blocksz();
+	len = (size_t)*cntp * nftp_get_blocksz();
+	if (off + len > filesize) {
+		len = filesize - off;
+	}
+
+	if ((str = malloc(len + 1)) == NULL) {
+		fclose(fp);
+		return (NFTP_ERR_MEM);
+	}
+
+	fseek(fp, off, SEEK_SET);
+	for (int i = 0; i < *cntp; ++i) {
+		pos   = (size_t)i * nftp_get_blocksz();
+		blksz = len - pos < nftp_get_blocksz() ? len - pos : nftp_get_blocksz();
+		if (blksz != fread(str + pos, 1, blksz, fp)) {
+			free(str);
+			fclose(fp);
+			return (NFTP_ERR_FILERD);
+		}
+		if (crcs) {
+			crcs[i] = nftp_crc32c((uint8_t *)str + pos, blksz);
+		}
+	}
+
+	fclose(fp);
+	*strp = str;
+	*sz   = len;
+	return (0);
+}
+
 int
 nftp_file_read(char *fpath, char **strp, size_t *sz)
 {
@@ -304,35 +371,199 @@ nftp_file_clear(char * fpath)
 	return (0);
 }
 
+#define NFTP_HASH_CHUNK  (256 * 1024)      // Read granularity of hashing
+#define NFTP_HASH_RANGE  (4 * 1024 * 1024) // Minimal range of a worker
+#define NFTP_HASH_MT_MIN (4 * NFTP_HASH_RANGE) // Smaller, no threads
+
+static int file_digest_mt(char *, const nftp_hash_engine *, int, uint64_t *);
+
 int
 nftp_file_hash(char *fpath, uint32_t *hashval)
 {
-	FILE *   fp;
-	size_t   sz;
-	char *   str;
+	uint64_t digest;
 	int      rv;
 
-	if (0 != (rv = nftp_file_size(fpath, &sz)))
+	if (0 != (rv = nftp_file_digest(fpath, NFTP_HASH_CRC32C, &digest)))
 		return rv;
+	*hashval = (uint32_t) digest;
+	return (0);
+}
+
+int
+nftp_file_digest(char *fpath, int hashid, uint64_t *hashval)
+{
+	FILE *                  fp;
+	uint8_t *               buf;
+	size_t                  n;
+	int                     rv = 0;
+	nftp_hash_ctx           ctx;
+	const nftp_hash_engine *e;
+
+	if ((e = nftp_hash_engine_get(hashid)) == NULL)
+		return (NFTP_ERR_HASH);
+	if (e->combine)
+		return file_digest_mt(fpath, e, 0, hashval);
 
-	if ((str = malloc(sz)) == NULL)
+	if (0 == nftp_file_exist(fpath)) {
+		nftp_fatal("Not exist");
+		return (NFTP_ERR_FILEPATH);
+	}
+
+	if ((buf = malloc(NFTP_HASH_CHUNK)) == NULL)
 		return (NFTP_ERR_MEM);
 
 	if ((fp = fopen(fpath, "rb")) == NULL) {
 		nftp_fatal("open error");
+		free(buf);
 		return (NFTP_ERR_FILE);
 	}
 
-	if (sz != fread(str, 1, sz, fp)) {
+	e->init(&ctx);
+	while ((n = fread(buf, 1, NFTP_HASH_CHUNK, fp)) > 0)
+		e->update(&ctx, buf, n);
+	if (ferror(fp)) {
 		nftp_fatal("read error");
-		return (NFTP_ERR_FILERD);
+		rv = NFTP_ERR_FILERD;
 	}
+	*hashval = e->final(&ctx);
 
-	*hashval = NFTP_HASH((const uint8_t *)str, sz);
+	fclose(fp);
+	free(buf);
+
+	return rv;
+}
+
+struct hash_range {
+	char *                  fpath;
+	const nftp_hash_engine *e;
+	size_t                  off;
+	size_t                  len;
+	uint64_t                digest;
+	int                     rv;
+};
+
+static void *
+file_hash_range(void *arg)
+{
+	struct hash_range *r = arg;
+	FILE *             fp;
+	uint8_t *          buf;
+	size_t             n, left = r->len;
+	nftp_hash_ctx      ctx;
+
+	r->e->init(&ctx);
+	r->digest = 0;
+	r->rv     = 0;
+	if ((buf = malloc(NFTP_HASH_CHUNK)) == NULL) {
+		r->rv = NFTP_ERR_MEM;
+		return NULL;
+	}
+	if ((fp = fopen(r->fpath, "rb")) == NULL) {
+		nftp_fatal("open error");
+		free(buf);
+		r->rv = NFTP_ERR_FILE;
+		return NULL;
+	}
+	fseek(fp, r->off, SEEK_SET);
+
+	while (left) {
+		n = left < NFTP_HASH_CHUNK ? left : NFTP_HASH_CHUNK;
+		if (n != fread(buf, 1, n, fp)) {
+			nftp_fatal("read error");
+			r->rv = NFTP_ERR_FILERD;
+			break;
+		}
+		r->e->update(&ctx, buf, n);
+		left -= n;
+	}
+	r->digest = r->e->final(&ctx);
 
 	fclose(fp);
-	free(str);
+	free(buf);
+	return NULL;
+}
 
-	return (0);
+// Split the file into ranges of a worker each, and merge the digests by
+// e->combine. Threads are only for files of several ranges.
+static int
+file_digest_mt(char *fpath, const nftp_hash_engine *e, int nthreads,
+    uint64_t *hashval)
+{
+	struct hash_range *ranges;
+	pthread_t *        tids;
+	size_t             sz, step;
+	int                n, started, rv;
+
+	if (0 != (rv = nftp_file_size(fpath, &sz)))
+		return rv;
+
+	if (nthreads <= 0) {
+#ifdef _WIN32
+		nthreads = 1;
+#else
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (nthreads > NFTP_HASH_WORKERS)
+		nthreads = NFTP_HASH_WORKERS;
+	n = sz < NFTP_HASH_MT_MIN ? 1 : (int) (sz / NFTP_HASH_RANGE);
+	if (n > nthreads)
+		n = nthreads;
+	if (n < 1)
+		n = 1;
+
+	if ((ranges = malloc(sizeof(*ranges) * n)) == NULL)
+		return (NFTP_ERR_MEM);
+	if ((tids = malloc(sizeof(*tids) * n)) == NULL) {
+		free(ranges);
+		return (NFTP_ERR_MEM);
+	}
+
+	step = sz / n;
+	for (int i = 0; i < n; ++i) {
+		ranges[i].fpath = fpath;
+		ranges[i].e     = e;
+		ranges[i].off   = step * i;
+		ranges[i].len   = (i == n - 1) ? sz - step * i : step;
+	}
+
+	// The caller hashes the first range itself
+	for (started = 1; started < n; ++started)
+		if (0 != pthread_create(&tids[started], NULL, file_hash_range,
+		        &ranges[started]))
+			break;
+	file_hash_range(&ranges[0]);
+	// Ranges without a worker are hashed here as well
+	for (int i = started; i < n; ++i)
+		file_hash_range(&ranges[i]);
+	for (int i = 1; i < started; ++i)
+		pthread_join(tids[i], NULL);
+
+	*hashval = ranges[0].digest;
+	for (int i = 0; i < n; ++i) {
+		if (0 != ranges[i].rv) {
+			rv = ranges[i].rv;
+			break;
+		}
+		if (i > 0)
+			*hashval = e->combine(
+			    *hashval, ranges[i].digest, ranges[i].len);
+	}
+
+	free(tids);
+	free(ranges);
+	return rv;
 }
 
+int
+nftp_file_hash_mt(char *fpath, uint32_t *hashval, int nthreads)
+{
+	uint64_t digest;
+	int      rv;
+
+	if (0 != (rv = file_digest_mt(fpath,
+	        nftp_hash_engine_get(NFTP_HASH_CRC32C), nthreads, &digest)))
+		return rv;
+	*hashval = (uint32_t) digest;
+	return (0);
+}
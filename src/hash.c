@@ -7,12 +7,14 @@
 //
 //
 
+#include <pthread.h>
 #include <string.h>
 
 #if defined(__APPLE__)
 
 #include <libkern/OSByteOrder.h>
 #define le64toh(x) OSSwapLittleToHostInt64(x)
+#define le32toh(x) OSSwapLittleToHostInt32(x)
 
 #else
 
@@ -22,32 +24,174 @@
 
 #include "nftp.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <nmmintrin.h>
+
+#define NFTP_CRC32C_HW
+#define NFTP_CRC32C_TARGET __attribute__((target("sse4.2")))
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u8(uint64_t crc, uint8_t v)
+{
+	return _mm_crc32_u8((uint32_t)crc, v);
+}
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u64v(uint64_t crc, uint64_t v)
+{
+	return _mm_crc32_u64(crc, v);
+}
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u64(uint64_t crc, const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return crc32c_u64v(crc, v);
+}
+
+static int
+crc32c_hw_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__AARCH64EL__)
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#define NFTP_CRC32C_HW
+#if defined(__clang__)
+#define NFTP_CRC32C_TARGET __attribute__((target("crc")))
+#else
+#define NFTP_CRC32C_TARGET __attribute__((target("+crc")))
+#endif
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u8(uint64_t crc, uint8_t v)
+{
+	uint32_t c = (uint32_t)crc;
+	__asm__("crc32cb %w0, %w0, %w1" : "+r"(c) : "r"(v));
+	return c;
+}
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u64v(uint64_t crc, uint64_t v)
+{
+	uint32_t c = (uint32_t)crc;
+	__asm__("crc32cx %w0, %w0, %x1" : "+r"(c) : "r"(v));
+	return c;
+}
+
+NFTP_CRC32C_TARGET
+static inline uint64_t
+crc32c_u64(uint64_t crc, const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return crc32c_u64v(crc, v);
+}
+
+static int
+crc32c_hw_supported(void)
+{
+#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__APPLE__) || defined(__ARM_FEATURE_CRC32)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#endif
+
 /* D. J. Bernstein hash function */
-uint32_t
-nftp_djb_hashn(const uint8_t * cp, size_t n)
+void
+nftp_djb_init(nftp_djb_ctx *ctx)
+{
+	ctx->hash = 5381;
+}
+
+void
+nftp_djb_update(nftp_djb_ctx *ctx, const uint8_t * cp, size_t n)
 {
-    uint32_t hash = 5381;
+    uint32_t hash = ctx->hash;
     while (n--)
         hash = 33 * hash ^ (uint8_t) *cp++;
-    return hash;
+    ctx->hash = hash;
 }
 
-/* Fowler/Noll/Vo (FNV) hash function, variant 1a */
 uint32_t
-nftp_fnv1a_hashn(const uint8_t * cp, size_t n)
+nftp_djb_final(nftp_djb_ctx *ctx)
+{
+	return ctx->hash;
+}
+
+uint32_t
+nftp_djb_hashn(const uint8_t * cp, size_t n)
+{
+	nftp_djb_ctx ctx;
+	nftp_djb_init(&ctx);
+	nftp_djb_update(&ctx, cp, n);
+	return nftp_djb_final(&ctx);
+}
+
+/* Fowler/Noll/Vo (FNV) hash function, variant 1a */
+void
+nftp_fnv1a_init(nftp_fnv1a_ctx *ctx)
+{
+	ctx->hash = 0x811c9dc5;
+}
+
+void
+nftp_fnv1a_update(nftp_fnv1a_ctx *ctx, const uint8_t * cp, size_t n)
 {
-    uint32_t hash = 0x811c9dc5;
+    uint32_t hash = ctx->hash;
     while (n--) {
         hash ^= (uint8_t) *cp++;
         hash *= 0x01000193;
     }
-    return hash;
+    ctx->hash = hash;
 }
 
-uint8_t
-nftp_crc(const uint8_t *data, size_t n)
+uint32_t
+nftp_fnv1a_final(nftp_fnv1a_ctx *ctx)
+{
+	return ctx->hash;
+}
+
+uint32_t
+nftp_fnv1a_hashn(const uint8_t * cp, size_t n)
+{
+	nftp_fnv1a_ctx ctx;
+	nftp_fnv1a_init(&ctx);
+	nftp_fnv1a_update(&ctx, cp, n);
+	return nftp_fnv1a_final(&ctx);
+}
+
+void
+nftp_crc_init(nftp_crc_ctx *ctx)
+{
+	ctx->crc = 0xff;
+}
+
+void
+nftp_crc_update(nftp_crc_ctx *ctx, const uint8_t *data, size_t n)
 {
-	uint8_t crc = 0xff;
+	uint8_t crc = ctx->crc;
 	size_t  i, j;
 	for (i = 0; i < n; i++) {
 		crc ^= data[i];
@@ -58,7 +202,22 @@ nftp_crc(const uint8_t *data, size_t n)
 				crc <<= 1;
 		}
 	}
-	return crc;
+	ctx->crc = crc;
+}
+
+uint8_t
+nftp_crc_final(nftp_crc_ctx *ctx)
+{
+	return ctx->crc;
+}
+
+uint8_t
+nftp_crc(const uint8_t *data, size_t n)
+{
+	nftp_crc_ctx ctx;
+	nftp_crc_init(&ctx);
+	nftp_crc_update(&ctx, data, n);
+	return nftp_crc_final(&ctx);
 }
 
 /* Refer. https://homes.cs.washington.edu/~suciu/XMLTK/xmill/www/XMILL/html/crc32_8c-source.html */
@@ -118,10 +277,280 @@ static const uint32_t crc32_table[256] = {
   0x2d02ef8dL
 };
 
-uint32_t
-nftp_crc32(const uint8_t *data, size_t n)
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+#define NFTP_CRC32_FOLD
+#define NFTP_CRC32_PCLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#define NFTP_CRC32_VPCLMUL_TARGET \
+	__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.1")))
+
+/* Fold the CRC with carry-less multiplication, following "Fast CRC
+   Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel)
+   in the bit-reflected domain. The constants are x^(D+32) and x^(D-32)
+   modulo P(x), reflected and shifted left by one, for a fold distance of
+   D bits, and the Barrett constants at the end of the paper. */
+static const uint64_t crc32_k1k2[] __attribute__((aligned(16))) = {
+	0x0154442bd4, 0x01c6e41596 // D = 512
+};
+static const uint64_t crc32_k3k4[] __attribute__((aligned(16))) = {
+	0x01751997d0, 0x00ccaa009e // D = 128
+};
+static const uint64_t crc32_k5k0[] __attribute__((aligned(16))) = {
+	0x0163cd6124, 0x0000000000
+};
+static const uint64_t crc32_poly[] __attribute__((aligned(16))) = {
+	0x01db710641, 0x01f7011641
+};
+static const uint64_t crc32_k2048[] __attribute__((aligned(16))) = {
+	0x011542778a, 0x01322d1430 // D = 2048
+};
+
+/* Fold the four 128-bit accumulators into one, consume the remaining
+   16-byte blocks and reduce the result to the 32-bit crc register. */
+NFTP_CRC32_PCLMUL_TARGET
+static inline uint32_t
+crc32_pclmul_tail(__m128i x1, __m128i x2, __m128i x3, __m128i x4,
+    const uint8_t *buf, size_t len)
+{
+	__m128i x0, x5;
+
+	x0 = _mm_load_si128((__m128i *) crc32_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(x1, x2);
+	x1 = _mm_xor_si128(x1, x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(x1, x3);
+	x1 = _mm_xor_si128(x1, x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(x1, x4);
+	x1 = _mm_xor_si128(x1, x5);
+
+	// Single fold blocks of 16
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((__m128i *) buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(x1, x2);
+		x1 = _mm_xor_si128(x1, x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((__m128i *) crc32_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduce to 32 bits
+	x0 = _mm_load_si128((__m128i *) crc32_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+/* len must be at least 64 and a multiple of 16. */
+NFTP_CRC32_PCLMUL_TARGET
+static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((__m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((__m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((__m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((__m128i *) (buf + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	x0 = _mm_load_si128((__m128i *) crc32_k1k2);
+
+	buf += 64;
+	len -= 64;
+
+	// Parallel fold blocks of 64
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((__m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((__m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((__m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((__m128i *) (buf + 0x30));
+
+		x1 = _mm_xor_si128(x1, x5);
+		x2 = _mm_xor_si128(x2, x6);
+		x3 = _mm_xor_si128(x3, x7);
+		x4 = _mm_xor_si128(x4, x8);
+
+		x1 = _mm_xor_si128(x1, y5);
+		x2 = _mm_xor_si128(x2, y6);
+		x3 = _mm_xor_si128(x3, y7);
+		x4 = _mm_xor_si128(x4, y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	return crc32_pclmul_tail(x1, x2, x3, x4, buf, len);
+}
+
+NFTP_CRC32_VPCLMUL_TARGET
+static inline __m512i
+crc32_vfold(__m512i x, __m512i k, __m512i y)
+{
+	__m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+	__m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+	return _mm512_ternarylogic_epi64(lo, hi, y, 0x96); // lo ^ hi ^ y
+}
+
+/* Same as crc32_pclmul, but folds 256 bytes per round in four 512-bit
+   accumulators with VPCLMULQDQ. */
+NFTP_CRC32_VPCLMUL_TARGET
+static uint32_t
+crc32_vpclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	__m512i z0, z1, z2, z3, k;
+
+	if (len < 256)
+		return crc32_pclmul(crc, buf, len);
+
+	z0 = _mm512_loadu_si512((const void *) (buf + 0x00));
+	z1 = _mm512_loadu_si512((const void *) (buf + 0x40));
+	z2 = _mm512_loadu_si512((const void *) (buf + 0x80));
+	z3 = _mm512_loadu_si512((const void *) (buf + 0xc0));
+
+	z0 = _mm512_xor_si512(z0, _mm512_inserti32x4(_mm512_setzero_si512(),
+	                              _mm_cvtsi32_si128(crc), 0));
+
+	k = _mm512_broadcast_i32x4(_mm_load_si128((__m128i *) crc32_k2048));
+
+	buf += 256;
+	len -= 256;
+
+	while (len >= 256) {
+		z0 = crc32_vfold(z0, k,
+		    _mm512_loadu_si512((const void *) (buf + 0x00)));
+		z1 = crc32_vfold(z1, k,
+		    _mm512_loadu_si512((const void *) (buf + 0x40)));
+		z2 = crc32_vfold(z2, k,
+		    _mm512_loadu_si512((const void *) (buf + 0x80)));
+		z3 = crc32_vfold(z3, k,
+		    _mm512_loadu_si512((const void *) (buf + 0xc0)));
+
+		buf += 256;
+		len -= 256;
+	}
+
+	// Fold the four accumulators into z3, 512 bits apart
+	k  = _mm512_broadcast_i32x4(_mm_load_si128((__m128i *) crc32_k1k2));
+	z1 = crc32_vfold(z0, k, z1);
+	z2 = crc32_vfold(z1, k, z2);
+	z3 = crc32_vfold(z2, k, z3);
+
+	return crc32_pclmul_tail(_mm512_extracti32x4_epi32(z3, 0),
+	    _mm512_extracti32x4_epi32(z3, 1), _mm512_extracti32x4_epi32(z3, 2),
+	    _mm512_extracti32x4_epi32(z3, 3), buf, len);
+}
+
+#endif // NFTP_CRC32_FOLD
+
+/* Folding kernel for large inputs, NULL if the cpu has none. */
+static uint32_t (*crc32_fold_fn)(uint32_t, const uint8_t *, size_t) = NULL;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_init(void)
+{
+#ifdef NFTP_CRC32_FOLD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc32_fold_fn = crc32_pclmul;
+	if (crc32_fold_fn && __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("vpclmulqdq"))
+		crc32_fold_fn = crc32_vpclmul;
+#endif
+}
+
+// For tests and benchmarks. Not thread-safe, crc32_fold_fn is read by
+// nftp_crc32 without a lock.
+int
+nftp_crc32_set_kernel(int k)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	switch (k) {
+	case NFTP_CRC32_SW:
+		crc32_fold_fn = NULL;
+		return (0);
+#ifdef NFTP_CRC32_FOLD
+	case NFTP_CRC32_PCLMUL:
+		if (!__builtin_cpu_supports("pclmul") ||
+		    !__builtin_cpu_supports("sse4.1"))
+			return (NFTP_ERR_HASH);
+		crc32_fold_fn = crc32_pclmul;
+		return (0);
+	case NFTP_CRC32_VPCLMUL:
+		if (!__builtin_cpu_supports("pclmul") ||
+		    !__builtin_cpu_supports("sse4.1") ||
+		    !__builtin_cpu_supports("avx512f") ||
+		    !__builtin_cpu_supports("vpclmulqdq"))
+			return (NFTP_ERR_HASH);
+		crc32_fold_fn = crc32_vpclmul;
+		return (0);
+#endif
+	default:
+		return (NFTP_ERR_HASH);
+	}
+}
+
+int
+nftp_crc32_get_kernel()
+{
+	pthread_once(&crc32_once, crc32_init);
+
+#ifdef NFTP_CRC32_FOLD
+	if (crc32_fold_fn == crc32_vpclmul)
+		return NFTP_CRC32_VPCLMUL;
+	if (crc32_fold_fn == crc32_pclmul)
+		return NFTP_CRC32_PCLMUL;
+#endif
+	return NFTP_CRC32_SW;
+}
+
+static uint32_t
+crc32_sw(uint32_t crc, const uint8_t *data, size_t n)
 {
-	uint32_t crc = 0xffffffff;
 	while (n >= 8) {
 		crc = crc32_table[((int)crc ^ (*data++)) & 0xff] ^ (crc >> 8);
 		crc = crc32_table[((int)crc ^ (*data++)) & 0xff] ^ (crc >> 8);
@@ -137,13 +566,56 @@ nftp_crc32(const uint8_t *data, size_t n)
 		do {
 			crc = crc32_table[((int)crc ^ (*data++)) & 0xff] ^ (crc >> 8);
 		} while (--n);
-	return crc ^ 0xffffffff;
+	return crc;
+}
+
+void
+nftp_crc32_init(nftp_crc32_ctx *ctx)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	ctx->crc = 0xffffffff;
+}
+
+void
+nftp_crc32_update(nftp_crc32_ctx *ctx, const uint8_t *data, size_t n)
+{
+	uint32_t crc = ctx->crc;
+	size_t   m;
+
+	if (crc32_fold_fn && n >= 64) {
+		m    = n & ~(size_t) 15;
+		crc  = crc32_fold_fn(crc, data, m);
+		data += m;
+		n    -= m;
+	}
+	ctx->crc = crc32_sw(crc, data, n);
+}
+
+uint32_t
+nftp_crc32_final(nftp_crc32_ctx *ctx)
+{
+	return ctx->crc ^ 0xffffffff;
+}
+
+uint32_t
+nftp_crc32(const uint8_t *data, size_t n)
+{
+	nftp_crc32_ctx ctx;
+	nftp_crc32_init(&ctx);
+	nftp_crc32_update(&ctx, data, n);
+	return nftp_crc32_final(&ctx);
+}
+
+uint32_t
+nftp_crc32_sw(const uint8_t *data, size_t n)
+{
+	return crc32_sw(0xffffffff, data, n) ^ 0xffffffff;
 }
 
 /* CRC32C from https://github.com/confluentinc/librdkafka/blob/master/src/crc32c.c */
 #define POLY 0x82f63b78
 static uint32_t crc32c_table[8][256];
-static int      crc32c_init = 0;
 
 /* Construct table for software CRC-32C calculation. */
 static void crc32c_init_sw(void)
@@ -207,14 +679,722 @@ static uint32_t crc32c_sw(uint32_t crci, const void *buf, size_t len)
     return (uint32_t)crc ^ 0xffffffff;
 }
 
+#ifdef NFTP_CRC32C_HW
+
+/* Multiply a matrix times a vector over the Galois field of two elements,
+   GF(2).  Each element is a bit in an unsigned integer.  mat must have at
+   least as many entries as the power of two for most significant one bit in
+   vec. */
+static inline uint32_t gf2_matrix_times(uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+/* Multiply a matrix by itself over GF(2).  Both mat and square must have 32
+   rows. */
+static inline void gf2_matrix_square(uint32_t *square, uint32_t *mat)
+{
+    int n;
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Construct an operator to apply len zeros to a crc.  len must be a power of
+   two.  If len is not a power of two, then the result is the same as for the
+   largest power of two less than len.  The result for len == 0 is the same as
+   for len == 1. */
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+    int n;
+    uint32_t row;
+    uint32_t odd[32];       /* odd-power-of-two zeros operator */
+
+    /* put operator for one zero bit in odd */
+    odd[0] = POLY;
+    row = 1;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    /* put operator for two zero bits in even */
+    gf2_matrix_square(even, odd);
+
+    /* put operator for four zero bits in odd */
+    gf2_matrix_square(odd, even);
+
+    /* first square will put the operator for one zero byte (eight zero bits),
+       in even -- next square puts operator for two zero bytes in odd, and so
+       on, until len has been rotated down to zero */
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+
+    /* answer ended up in odd -- copy to even */
+    for (n = 0; n < 32; n++)
+        even[n] = odd[n];
+}
+
+/* Take a length and build four lookup tables for applying the zeros operator
+   for that length, byte-by-byte on the operand. */
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    uint32_t n;
+    uint32_t op[32];
+
+    crc32c_zeros_op(op, len);
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+/* Apply the zeros operator table to crc. */
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* Block sizes for three-way parallel crc computation.  LONG and SHORT must
+   both be powers of two. */
+#define LONG 8192
+#define SHORT 256
+
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static void crc32c_init_hw(void)
+{
+    crc32c_zeros(crc32c_long, LONG);
+    crc32c_zeros(crc32c_short, SHORT);
+}
+
+/* Compute CRC-32C using the crc32c instructions (SSE4.2 crc32 on x86-64,
+   the CRC extension of ARMv8).  The crc instruction has a latency of three
+   cycles but a throughput of one per cycle, so large buffers are split in
+   three streams which are computed in parallel and merged with the shift
+   tables above. */
+NFTP_CRC32C_TARGET
+static uint32_t crc32c_hw(uint32_t crci, const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+
+    crc0 = crci ^ 0xffffffff;
+
+    /* compute the crc for up to seven leading bytes to bring the data pointer
+       to an eight-byte boundary */
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = crc32c_u8(crc0, *next++);
+        len--;
+    }
+
+    /* compute the crc on sets of LONG*3 bytes, executing three independent crc
+       instructions, each on LONG bytes */
+    while (len >= LONG * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            crc0 = crc32c_u64(crc0, next);
+            crc1 = crc32c_u64(crc1, next + LONG);
+            crc2 = crc32c_u64(crc2, next + LONG * 2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        next += LONG * 2;
+        len -= LONG * 3;
+    }
+
+    /* do the same thing, but now on SHORT*3 blocks for the remaining data less
+       than a LONG*3 block */
+    while (len >= SHORT * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            crc0 = crc32c_u64(crc0, next);
+            crc1 = crc32c_u64(crc1, next + SHORT);
+            crc2 = crc32c_u64(crc2, next + SHORT * 2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        next += SHORT * 2;
+        len -= SHORT * 3;
+    }
+
+    /* compute the crc on the remaining eight-byte units less than a SHORT*3
+       block */
+    end = next + (len - (len & 7));
+    while (next < end) {
+        crc0 = crc32c_u64(crc0, next);
+        next += 8;
+    }
+    len &= 7;
+
+    /* compute the crc for up to seven trailing bytes */
+    while (len) {
+        crc0 = crc32c_u8(crc0, *next++);
+        len--;
+    }
+
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+/* Copy one eight-byte unit and feed it to the crc in the same load. */
+#define CRC32C_COPY8(crc, dst, src)             \
+    do {                                        \
+        uint64_t v_;                            \
+        memcpy(&v_, src, sizeof(v_));           \
+        memcpy(dst, &v_, sizeof(v_));           \
+        crc = crc32c_u64v(crc, v_);             \
+    } while (0)
+
+/* Same as crc32c_hw, but the data is copied to dst while it is in
+   registers, so the receiver touches each byte of a block only once. */
+NFTP_CRC32C_TARGET
+static uint32_t crc32c_copy_hw(uint32_t crci, unsigned char *dst,
+                               const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+
+    crc0 = crci ^ 0xffffffff;
+
+    while (len && ((uintptr_t)next & 7) != 0) {
+        *dst = *next;
+        crc0 = crc32c_u8(crc0, *next++);
+        dst++;
+        len--;
+    }
+
+    while (len >= LONG * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            CRC32C_COPY8(crc0, dst, next);
+            CRC32C_COPY8(crc1, dst + LONG, next + LONG);
+            CRC32C_COPY8(crc2, dst + LONG * 2, next + LONG * 2);
+            next += 8;
+            dst += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        next += LONG * 2;
+        dst += LONG * 2;
+        len -= LONG * 3;
+    }
+
+    while (len >= SHORT * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            CRC32C_COPY8(crc0, dst, next);
+            CRC32C_COPY8(crc1, dst + SHORT, next + SHORT);
+            CRC32C_COPY8(crc2, dst + SHORT * 2, next + SHORT * 2);
+            next += 8;
+            dst += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        next += SHORT * 2;
+        dst += SHORT * 2;
+        len -= SHORT * 3;
+    }
+
+    end = next + (len - (len & 7));
+    while (next < end) {
+        CRC32C_COPY8(crc0, dst, next);
+        next += 8;
+        dst += 8;
+    }
+    len &= 7;
+
+    while (len) {
+        *dst = *next;
+        crc0 = crc32c_u8(crc0, *next++);
+        dst++;
+        len--;
+    }
+
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#endif // NFTP_CRC32C_HW
+
+/* x^(2^n) modulo p(x), for n = 0..31, used by crc32c_combine. */
+static uint32_t crc32c_x2n_table[32];
+
+/* Return a(x) multiplied by b(x) modulo p(x), where p(x) is the CRC
+   polynomial, reflected. For speed, this requires that a not be zero. */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m, p;
+
+    m = (uint32_t)1 << 31;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* Return x^(n * 2^k) modulo p(x). */
+static uint32_t crc32c_x2nmodp(uint64_t n, unsigned k)
+{
+    uint32_t p;
+
+    p = (uint32_t)1 << 31;      /* x^0 == 1 */
+    while (n) {
+        if (n & 1)
+            p = crc32c_multmodp(crc32c_x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static void crc32c_init_combine(void)
+{
+    uint32_t p;
+    int n;
+
+    p = (uint32_t)1 << 30;      /* x^1 */
+    crc32c_x2n_table[0] = p;
+    for (n = 1; n < 32; n++)
+        crc32c_x2n_table[n] = p = crc32c_multmodp(p, p);
+}
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_sw;
+
+/* Without the instructions, copy a chunk which still fits in L1 and hash
+   it from there. */
+static uint32_t crc32c_copy_sw(uint32_t crc, unsigned char *dst,
+                               const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+    size_t n;
+
+    while (len) {
+        n = len < 4096 ? len : 4096;
+        memcpy(dst, next, n);
+        crc = crc32c_fn(crc, dst, n);
+        next += n;
+        dst += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static uint32_t (*crc32c_copy_fn)(uint32_t, unsigned char *, const void *,
+                                  size_t) = crc32c_copy_sw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Build the tables and pick the fastest implementation, exactly once. */
+static void
+crc32c_init(void)
+{
+	crc32c_init_sw();
+	crc32c_init_combine();
+#ifdef NFTP_CRC32C_HW
+	if (crc32c_hw_supported()) {
+		crc32c_init_hw();
+		crc32c_fn = crc32c_hw;
+		crc32c_copy_fn = crc32c_copy_hw;
+	}
+#endif
+}
+
+void
+nftp_crc32c_init(nftp_crc32c_ctx *ctx)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	ctx->crc = 0;
+}
+
+void
+nftp_crc32c_update(nftp_crc32c_ctx *ctx, const uint8_t *data, size_t n)
+{
+	ctx->crc = crc32c_fn(ctx->crc, (void *)data, n);
+}
+
+// Copy n bytes from data to dst and hash them in one pass
+void
+nftp_crc32c_update_copy(nftp_crc32c_ctx *ctx, uint8_t *dst,
+        const uint8_t *data, size_t n)
+{
+	ctx->crc = crc32c_copy_fn(ctx->crc, dst, (void *)data, n);
+}
+
+uint32_t
+nftp_crc32c_final(nftp_crc32c_ctx *ctx)
+{
+	return ctx->crc;
+}
+
 uint32_t
 nftp_crc32c(const uint8_t *data, size_t n)
 {
-	if (crc32c_init == 0) {
-		crc32c_init_sw();
-		crc32c_init = 1;
-	}
+	nftp_crc32c_ctx ctx;
+	nftp_crc32c_init(&ctx);
+	nftp_crc32c_update(&ctx, data, n);
+	return nftp_crc32c_final(&ctx);
+}
+
+uint32_t
+nftp_crc32c_copy(uint8_t *dst, const uint8_t *data, size_t n)
+{
+	nftp_crc32c_ctx ctx;
+	nftp_crc32c_init(&ctx);
+	nftp_crc32c_update_copy(&ctx, dst, data, n);
+	return nftp_crc32c_final(&ctx);
+}
+
+uint32_t
+nftp_crc32c_sw(const uint8_t *data, size_t n)
+{
+	pthread_once(&crc32c_once, crc32c_init);
 
 	return crc32c_sw(0, (void *)data, n);
 }
 
+// Return the crc32c of A followed by B, given crc32c(A), crc32c(B) and the
+// length of B. It runs in O(log(lenb)), which lets ranges of a file (or
+// blocks) be hashed independently and merged afterwards.
+uint32_t
+nftp_crc32c_combine(uint32_t crca, uint32_t crcb, size_t lenb)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return crc32c_multmodp(crc32c_x2nmodp(lenb, 3), crca) ^ crcb;
+}
+
+/* xxHash 64-bit (XXH64) by Yann Collet, seed 0. Refer.
+   https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+#define xxh_rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t
+xxh_read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t
+xxh_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = xxh_rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t
+xxh64_finalize(uint64_t h, const uint8_t *p, size_t len)
+{
+	while (len >= 8) {
+		h ^= xxh64_round(0, xxh_read64(p));
+		h = xxh_rotl64(h, 27) * XXH_P1 + XXH_P4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t) xxh_read32(p) * XXH_P1;
+		h = xxh_rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		h ^= (*p++) * XXH_P5;
+		h = xxh_rotl64(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+void
+nftp_xxh64_init(nftp_xxh64_ctx *ctx)
+{
+	ctx->v[0]   = XXH_P1 + XXH_P2;
+	ctx->v[1]   = XXH_P2;
+	ctx->v[2]   = 0;
+	ctx->v[3]   = -XXH_P1;
+	ctx->total  = 0;
+	ctx->memlen = 0;
+}
+
+void
+nftp_xxh64_update(nftp_xxh64_ctx *ctx, const uint8_t *data, size_t n)
+{
+	ctx->total += n;
+
+	if (ctx->memlen + n < 32) {
+		memcpy(ctx->mem + ctx->memlen, data, n);
+		ctx->memlen += n;
+		return;
+	}
+	if (ctx->memlen) {
+		size_t fill = 32 - ctx->memlen;
+		memcpy(ctx->mem + ctx->memlen, data, fill);
+		ctx->v[0] = xxh64_round(ctx->v[0], xxh_read64(ctx->mem));
+		ctx->v[1] = xxh64_round(ctx->v[1], xxh_read64(ctx->mem + 8));
+		ctx->v[2] = xxh64_round(ctx->v[2], xxh_read64(ctx->mem + 16));
+		ctx->v[3] = xxh64_round(ctx->v[3], xxh_read64(ctx->mem + 24));
+		data += fill;
+		n -= fill;
+		ctx->memlen = 0;
+	}
+	if (n >= 32) {
+		uint64_t v1 = ctx->v[0], v2 = ctx->v[1];
+		uint64_t v3 = ctx->v[2], v4 = ctx->v[3];
+		do {
+			v1 = xxh64_round(v1, xxh_read64(data));
+			v2 = xxh64_round(v2, xxh_read64(data + 8));
+			v3 = xxh64_round(v3, xxh_read64(data + 16));
+			v4 = xxh64_round(v4, xxh_read64(data + 24));
+			data += 32;
+			n -= 32;
+		} while (n >= 32);
+		ctx->v[0] = v1;
+		ctx->v[1] = v2;
+		ctx->v[2] = v3;
+		ctx->v[3] = v4;
+	}
+	if (n) {
+		memcpy(ctx->mem, data, n);
+		ctx->memlen = n;
+	}
+}
+
+uint64_t
+nftp_xxh64_final(nftp_xxh64_ctx *ctx)
+{
+	uint64_t h;
+
+	if (ctx->total >= 32) {
+		h = xxh_rotl64(ctx->v[0], 1) + xxh_rotl64(ctx->v[1], 7) +
+		    xxh_rotl64(ctx->v[2], 12) + xxh_rotl64(ctx->v[3], 18);
+		h = xxh64_merge(h, ctx->v[0]);
+		h = xxh64_merge(h, ctx->v[1]);
+		h = xxh64_merge(h, ctx->v[2]);
+		h = xxh64_merge(h, ctx->v[3]);
+	} else {
+		h = XXH_P5;
+	}
+	h += ctx->total;
+
+	return xxh64_finalize(h, ctx->mem, ctx->memlen);
+}
+
+uint64_t
+nftp_xxh64(const uint8_t *data, size_t n)
+{
+	nftp_xxh64_ctx ctx;
+	nftp_xxh64_init(&ctx);
+	nftp_xxh64_update(&ctx, data, n);
+	return nftp_xxh64_final(&ctx);
+}
+
+// Adapters of the builtin hashes to the engine interface
+static uint64_t
+engine_crc32c_hash(const uint8_t *data, size_t n)
+{
+	return nftp_crc32c(data, n);
+}
+
+static void
+engine_crc32c_init(nftp_hash_ctx *ctx)
+{
+	nftp_crc32c_init(&ctx->crc32c);
+}
+
+static void
+engine_crc32c_update(nftp_hash_ctx *ctx, const uint8_t *data, size_t n)
+{
+	nftp_crc32c_update(&ctx->crc32c, data, n);
+}
+
+static uint64_t
+engine_crc32c_final(nftp_hash_ctx *ctx)
+{
+	return nftp_crc32c_final(&ctx->crc32c);
+}
+
+static uint64_t
+engine_crc32c_combine(uint64_t a, uint64_t b, size_t lenb)
+{
+	return nftp_crc32c_combine((uint32_t)a, (uint32_t)b, lenb);
+}
+
+static uint64_t
+engine_crc32_hash(const uint8_t *data, size_t n)
+{
+	return nftp_crc32(data, n);
+}
+
+static void
+engine_crc32_init(nftp_hash_ctx *ctx)
+{
+	nftp_crc32_init(&ctx->crc32);
+}
+
+static void
+engine_crc32_update(nftp_hash_ctx *ctx, const uint8_t *data, size_t n)
+{
+	nftp_crc32_update(&ctx->crc32, data, n);
+}
+
+static uint64_t
+engine_crc32_final(nftp_hash_ctx *ctx)
+{
+	return nftp_crc32_final(&ctx->crc32);
+}
+
+static uint64_t
+engine_fnv1a_hash(const uint8_t *data, size_t n)
+{
+	return nftp_fnv1a_hashn(data, n);
+}
+
+static void
+engine_fnv1a_init(nftp_hash_ctx *ctx)
+{
+	nftp_fnv1a_init(&ctx->fnv1a);
+}
+
+static void
+engine_fnv1a_update(nftp_hash_ctx *ctx, const uint8_t *data, size_t n)
+{
+	nftp_fnv1a_update(&ctx->fnv1a, data, n);
+}
+
+static uint64_t
+engine_fnv1a_final(nftp_hash_ctx *ctx)
+{
+	return nftp_fnv1a_final(&ctx->fnv1a);
+}
+
+static void
+engine_xxh64_init(nftp_hash_ctx *ctx)
+{
+	nftp_xxh64_init(&ctx->xxh64);
+}
+
+static void
+engine_xxh64_update(nftp_hash_ctx *ctx, const uint8_t *data, size_t n)
+{
+	nftp_xxh64_update(&ctx->xxh64, data, n);
+}
+
+static uint64_t
+engine_xxh64_final(nftp_hash_ctx *ctx)
+{
+	return nftp_xxh64_final(&ctx->xxh64);
+}
+
+static const nftp_hash_engine engine_crc32c = {
+	NFTP_HASH_CRC32C, "crc32c", 4, engine_crc32c_hash,
+	engine_crc32c_init, engine_crc32c_update, engine_crc32c_final,
+	engine_crc32c_combine,
+};
+
+static const nftp_hash_engine engine_crc32 = {
+	NFTP_HASH_CRC32, "crc32", 4, engine_crc32_hash,
+	engine_crc32_init, engine_crc32_update, engine_crc32_final,
+	NULL,
+};
+
+static const nftp_hash_engine engine_fnv1a = {
+	NFTP_HASH_FNV1A, "fnv1a", 4, engine_fnv1a_hash,
+	engine_fnv1a_init, engine_fnv1a_update, engine_fnv1a_final,
+	NULL,
+};
+
+static const nftp_hash_engine engine_xxh64 = {
+	NFTP_HASH_XXH64, "xxh64", 8, nftp_xxh64,
+	engine_xxh64_init, engine_xxh64_update, engine_xxh64_final,
+	NULL,
+};
+
+static const nftp_hash_engine *engines[256] = {
+	[NFTP_HASH_CRC32C] = &engine_crc32c,
+	[NFTP_HASH_CRC32]  = &engine_crc32,
+	[NFTP_HASH_FNV1A]  = &engine_fnv1a,
+	[NFTP_HASH_XXH64]  = &engine_xxh64,
+};
+
+const nftp_hash_engine *
+nftp_hash_engine_get(int id)
+{
+	if (id <= 0 || id > 0xff)
+		return NULL;
+	return engines[id];
+}
+
+int
+nftp_hash_engine_register(const nftp_hash_engine *e)
+{
+	if (!e || !e->hash || !e->init || !e->update || !e->final)
+		return (NFTP_ERR_HASH);
+	// With 4 or 8 bytes digest, a tagged HELLO never looks like a legacy one
+	if (e->id == 0 || (e->width != 4 && e->width != 8))
+		return (NFTP_ERR_HASH);
+	if (engines[e->id] != NULL)
+		return (NFTP_ERR_HASH);
+
+	engines[e->id] = e;
+	return (0);
+}
@@ -13,50 +13,239 @@
 
 #include "nftp.h"
 
-struct _iovs {
-	struct iovec *  iovs;
-	size_t          low; // iov loaded from iovs+low
-	size_t          len; // counter of iov in iovs
-	size_t          cap;
-	size_t          iolen;
-	pthread_mutex_t mtx;
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Release of an iov, called when it leaves the iovs
+struct iovs_rel {
+	void (*cb)(void *);
+	void * arg;
 };
 
-/*
+static inline void
+iovs_lock(nftp_iovs *iovs)
+{
+	if (!iovs->nolock)
+		pthread_mutex_lock(&iovs->mtx);
+}
+
+static inline void
+iovs_unlock(nftp_iovs *iovs)
+{
+	if (!iovs->nolock)
+		pthread_mutex_unlock(&iovs->mtx);
+}
+
+// Lock two iovs by address, so a pair taken from both sides in two
+// threads can't deadlock
+static inline void
+iovs_lock2(nftp_iovs *a, nftp_iovs *b)
+{
+	if (a > b) {
+		nftp_iovs *t = a;
+		a = b;
+		b = t;
+	}
+	iovs_lock(a);
+	iovs_lock(b);
+}
+
+// Make room for nhead iovs before low and ntail iovs after the tail.
+// Space is doubled when more than half is used, else iovs are recentered
+// in place. Free space is split 1:2 between head and tail as alloc, so
+// pushes on both ends are amortized O(1). Call with mtx held.
 static int
-resize(nftp_iovs *iovs, size_t sz)
+resize(nftp_iovs *iovs, size_t nhead, size_t ntail)
 {
-	(void)iovs;
-	(void)sz;
+	struct iovec *   v = iovs->iovs;
+	struct iovs_rel *r = iovs->rel;
+	size_t           cap = iovs->cap, low, need;
+
+	if (iovs->low >= nhead && iovs->cap - iovs->low - iovs->len >= ntail)
+		return (0);
+
+	need = iovs->len + nhead + ntail;
+	while (need > cap / 2)
+		cap *= 2;
+	low = nhead + (cap - need) / 3;
+
+	if (cap != iovs->cap) {
+		if ((v = malloc(sizeof(struct iovec) * cap)) == NULL)
+			return (NFTP_ERR_MEM);
+		if (iovs->rel && (r = calloc(cap, sizeof(*r))) == NULL) {
+			free(v);
+			return (NFTP_ERR_MEM);
+		}
+		memcpy(v + low, iovs->iovs + iovs->low,
+		    sizeof(struct iovec) * iovs->len);
+		if (iovs->iovs != iovs->inl) // Spill from inline storage
+			free(iovs->iovs);
+		if (iovs->rel) {
+			memcpy(r + low, iovs->rel + iovs->low,
+			    sizeof(*r) * iovs->len);
+			free(iovs->rel);
+		}
+	} else {
+		memmove(v + low, iovs->iovs + iovs->low,
+		    sizeof(struct iovec) * iovs->len);
+		if (r) {
+			memmove(r + low, r + iovs->low, sizeof(*r) * iovs->len);
+			memset(r, 0, sizeof(*r) * low);
+			memset(r + low + iovs->len, 0,
+			    sizeof(*r) * (cap - low - iovs->len));
+		}
+	}
+
+	iovs->iovs = v;
+	iovs->rel  = r;
+	iovs->cap  = cap;
+	iovs->low  = low;
 	return (0);
 }
-*/
 
-int
-nftp_iovs_alloc(nftp_iovs **iovsp)
+// Set the release of iov at absolute index i. Call with mtx held.
+static int
+rel_set(nftp_iovs *iovs, size_t i, void (*cb)(void *), void *arg)
+{
+	if (!iovs->rel) {
+		if (!cb)
+			return (0);
+		if ((iovs->rel = calloc(iovs->cap, sizeof(*iovs->rel))) == NULL)
+			return (NFTP_ERR_MEM);
+	}
+	iovs->rel[i].cb  = cb;
+	iovs->rel[i].arg = arg;
+	return (0);
+}
+
+static void
+rel_call(nftp_iovs *iovs, size_t i)
+{
+	struct iovs_rel r;
+
+	if (!iovs->rel || !iovs->rel[i].cb)
+		return;
+	r = iovs->rel[i];
+	iovs->rel[i].cb  = NULL;
+	iovs->rel[i].arg = NULL;
+	r.cb(r.arg);
+}
+
+static void
+iovs_buf_release(void *arg)
+{
+	nftp_buf_unref(arg);
+}
+
+// A copy of iov holds a new ref if it's from a nftp_buf, else nothing
+static struct iovs_rel
+rel_dup(nftp_iovs *iovs, size_t i)
+{
+	struct iovs_rel r = { NULL, NULL };
+
+	if (iovs->rel && iovs->rel[i].cb == iovs_buf_release) {
+		r = iovs->rel[i];
+		nftp_buf_ref(r.arg);
+	}
+	return r;
+}
+
+static void
+iovs_setup(nftp_iovs *iovs, struct iovec *v, size_t cap, int nolock)
+{
+	iovs->iovs = v;
+	iovs->rel = NULL;
+	iovs->nolock = nolock;
+	iovs->sent = 0;
+	iovs->sidx = 0;
+	iovs->soff = 0;
+	iovs->cap = cap;
+	iovs->len = 0;
+	iovs->low = iovs->cap / 3;
+	iovs->iolen = 0;
+	if (!nolock)
+		pthread_mutex_init(&iovs->mtx, NULL);
+}
+
+static int
+iovs_alloc(nftp_iovs **iovsp, int nolock)
 {
-	nftp_iovs *iovs;
+	nftp_iovs *   iovs;
+	struct iovec *v;
 
 	if ((iovs = malloc(sizeof(nftp_iovs))) == NULL) {
 		return (NFTP_ERR_MEM);
 	}
 
-	if ((iovs->iovs = malloc(sizeof(struct iovec) * NFTP_SIZE)) == NULL) {
+	if ((v = malloc(sizeof(struct iovec) * NFTP_SIZE)) == NULL) {
 		free(iovs);
 		return (NFTP_ERR_MEM);
 	}
 
-	pthread_mutex_init(&iovs->mtx, NULL);
-
-	iovs->cap = NFTP_SIZE;
-	iovs->len = 0;
-	iovs->low = iovs->cap / 3;
-	iovs->iolen = 0;
+	iovs_setup(iovs, v, NFTP_SIZE, nolock);
 
 	*iovsp = iovs;
 	return (0);
 }
 
+int
+nftp_iovs_alloc(nftp_iovs **iovsp)
+{
+	return iovs_alloc(iovsp, 0);
+}
+
+int
+nftp_iovs_alloc_nolock(nftp_iovs **iovsp)
+{
+	return iovs_alloc(iovsp, 1);
+}
+
+int
+nftp_iovs_init(nftp_iovs *iovs)
+{
+	if (!iovs) return (NFTP_ERR_IOVS);
+	iovs_setup(iovs, iovs->inl, NFTP_IOVS_INLINE, 1);
+	return (0);
+}
+
+int
+nftp_iovs_fini(nftp_iovs *iovs)
+{
+	if (iovs == NULL || iovs->iovs == NULL) {
+		return (NFTP_ERR_MEM);
+	}
+
+	for (size_t i = iovs->low; i < iovs->low + iovs->len; ++i)
+		rel_call(iovs, i);
+	if (!iovs->nolock)
+		pthread_mutex_destroy(&iovs->mtx);
+	if (iovs->iovs != iovs->inl)
+		free(iovs->iovs);
+	free(iovs->rel);
+	iovs->iovs = NULL;
+	iovs->rel  = NULL;
+	return (0);
+}
+
+int
+nftp_iovs_reserve(nftp_iovs *iovs, size_t n)
+{
+	int rv;
+
+	iovs_lock(iovs);
+	rv = resize(iovs, 0, n);
+	iovs_unlock(iovs);
+	return rv;
+}
+
 int
 nftp_iovs_append(nftp_iovs *iovs, void *ptr, size_t len)
 {
@@ -67,62 +256,85 @@ nftp_iovs_append(nftp_iovs *iovs, void *ptr, size_t len)
 int
 nftp_iovs_insert(nftp_iovs *iovs, void *ptr, size_t len, size_t pos)
 {
-	if (iovs->low + iovs->len + 1 > iovs->cap) {
-		return (NFTP_ERR_OVERFLOW); // Resize TODO
-	}
+	int rv;
 
 	if (pos > iovs->len) {
 		return nftp_iovs_push(iovs, ptr, len, NFTP_TAIL);
 	}
 
-	pthread_mutex_lock(&iovs->mtx);
+	iovs_lock(iovs);
+
+	if (0 != (rv = resize(iovs, 0, 1))) {
+		iovs_unlock(iovs);
+		return rv;
+	}
 
 	for (size_t i = iovs->low + iovs->len; i > iovs->low + pos; --i) {
 		iovs->iovs[i].iov_base = iovs->iovs[i - 1].iov_base;
 		iovs->iovs[i].iov_len  = iovs->iovs[i - 1].iov_len;
+		if (iovs->rel)
+			iovs->rel[i] = iovs->rel[i - 1];
+	}
+	iovs->iovs[iovs->low + pos].iov_base = ptr;
+	iovs->iovs[iovs->low + pos].iov_len  = len;
+	rel_set(iovs, iovs->low + pos, NULL, NULL);
+	if (pos <= iovs->sidx && iovs->sent > 0) {
+		iovs->sidx++;
+		iovs->sent += len;
 	}
-	iovs->iovs[pos].iov_base = ptr;
-	iovs->iovs[pos].iov_len  = len;
 
 	iovs->len ++;
 	iovs->iolen += len;
 
-	pthread_mutex_unlock(&iovs->mtx);
+	iovs_unlock(iovs);
 	return (0);
 }
 
 int
 nftp_iovs_push(nftp_iovs *iovs, void *ptr, size_t len, int flag)
+{
+	return nftp_iovs_push_cb(iovs, ptr, len, flag, NULL, NULL);
+}
+
+int
+nftp_iovs_push_cb(nftp_iovs *iovs, void *ptr, size_t len, int flag,
+    void (*cb)(void *), void *arg)
 {
 	struct iovec *iov;
+	size_t        idx;
+	int           rv;
 
-	pthread_mutex_lock(&iovs->mtx);
-	if (flag == NFTP_HEAD) {
-		if (iovs->low == 0) {
-			pthread_mutex_unlock(&iovs->mtx);
-			return (NFTP_ERR_OVERFLOW); // Resize TODO
-		}
+	iovs_lock(iovs);
+	if (flag != NFTP_HEAD && flag != NFTP_TAIL) {
+		iovs_unlock(iovs);
+		return (NFTP_ERR_FLAG);
+	}
+	if (0 != (rv = resize(iovs, flag == NFTP_HEAD, flag == NFTP_TAIL))) {
+		iovs_unlock(iovs);
+		return rv;
+	}
+	idx = flag == NFTP_HEAD ? iovs->low - 1 : iovs->low + iovs->len;
+	if (0 != (rv = rel_set(iovs, idx, cb, arg))) {
+		iovs_unlock(iovs);
+		return rv;
+	}
 
+	if (flag == NFTP_HEAD) {
 		iovs->low--;
-		iov = &iovs->iovs[iovs->low];
-	} else if (flag == NFTP_TAIL) {
-		if (iovs->low + iovs->len > iovs->cap) {
-			pthread_mutex_unlock(&iovs->mtx);
-			return (NFTP_ERR_OVERFLOW); // Resize TODO
+		// Cursor stays at the same byte
+		if (iovs->sent > 0) {
+			iovs->sidx++;
+			iovs->sent += len;
 		}
-
-		iov = &iovs->iovs[iovs->low + iovs->len];
-	} else {
-		pthread_mutex_unlock(&iovs->mtx);
-		return (NFTP_ERR_FLAG);
 	}
+	iov = &iovs->iovs[idx];
 	iov->iov_base = ptr;
 	iov->iov_len  = len;
 
 	iovs->len++;
 	iovs->iolen += len;
 
-	pthread_mutex_unlock(&iovs->mtx);
+	iovs_unlock(iovs);
 	return (0);
 }
 
@@ -135,15 +347,30 @@ nftp_iovs_pop(nftp_iovs *iovs, void **ptrp, size_t *lenp, int flag)
 		return (NFTP_ERR_EMPTY);
 	}
 
-	pthread_mutex_lock(&iovs->mtx);
+	iovs_lock(iovs);
 
 	if (flag == NFTP_HEAD) {
 		iov = &iovs->iovs[iovs->low];
 		iovs->low++;
+		// Sent bytes go with the iov
+		if (iovs->sidx > 0) {
+			iovs->sidx--;
+			iovs->sent -= iov->iov_len;
+		} else {
+			iovs->sent -= iovs->soff;
+			iovs->soff = 0;
+		}
 	} else if (flag == NFTP_TAIL) {
 		iov = &iovs->iovs[iovs->low + iovs->len - 1];
+		if (iovs->sidx == iovs->len - 1) {
+			iovs->sent -= iovs->soff;
+			iovs->soff = 0;
+		} else if (iovs->sidx == iovs->len) {
+			iovs->sidx--;
+			iovs->sent -= iov->iov_len;
+		}
 	} else {
-		pthread_mutex_unlock(&iovs->mtx);
+		iovs_unlock(iovs);
 		return (NFTP_ERR_FLAG);
 	}
 
@@ -151,14 +378,80 @@ nftp_iovs_pop(nftp_iovs *iovs, void **ptrp, size_t *lenp, int flag)
 	*lenp         = iov->iov_len;
 	iov->iov_base = NULL;
 	iov->iov_len  = 0;
+	rel_call(iovs, iov - iovs->iovs);
 
 	iovs->len--;
 	iovs->iolen -= (*lenp);
 
-	pthread_mutex_unlock(&iovs->mtx);
+	iovs_unlock(iovs);
 	return 0;
 }
 
+int
+nftp_iovs_push_buf(nftp_iovs *iovs, nftp_buf *b, size_t off, size_t len, int flag)
+{
+	int rv;
+
+	if (!b) return (NFTP_ERR_EMPTY);
+	if (off > b->len || len > b->len - off) return (NFTP_ERR_OVERFLOW);
+
+	nftp_buf_ref(b);
+	rv = nftp_iovs_push_cb(iovs, (uint8_t *)b->data + off, len, flag,
+	    iovs_buf_release, b);
+	if (0 != rv)
+		nftp_buf_unref(b);
+	return rv;
+}
+
+int
+nftp_buf_alloc(nftp_buf **bp, size_t len)
+{
+	nftp_buf *b;
+
+	if ((b = malloc(sizeof(*b) + len)) == NULL)
+		return (NFTP_ERR_MEM);
+	b->data    = b + 1;
+	b->len     = len;
+	b->refcnt  = 1;
+	b->release = NULL;
+	*bp = b;
+	return (0);
+}
+
+int
+nftp_buf_wrap(nftp_buf **bp, void *data, size_t len, void (*release)(void *))
+{
+	nftp_buf *b;
+
+	if ((b = malloc(sizeof(*b))) == NULL)
+		return (NFTP_ERR_MEM);
+	b->data    = data;
+	b->len     = len;
+	b->refcnt  = 1;
+	b->release = release;
+	*bp = b;
+	return (0);
+}
+
+nftp_buf *
+nftp_buf_ref(nftp_buf *b)
+{
+	__atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+int
+nftp_buf_unref(nftp_buf *b)
+{
+	if (!b) return (NFTP_ERR_EMPTY);
+	if (0 != __atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL))
+		return (0);
+	if (b->release)
+		b->release(b->data);
+	free(b);
+	return (0);
+}
+
 size_t
 nftp_iovs_len(nftp_iovs *iovs)
 {
@@ -171,45 +464,326 @@ nftp_iovs_cap(nftp_iovs *iovs)
 	return iovs->cap;
 }
 
+size_t
+nftp_iovs_iolen(nftp_iovs *iovs)
+{
+	return iovs->iolen;
+}
+
+int
+nftp_iovs_get(nftp_iovs *iovs, size_t idx, void **ptrp, size_t *lenp)
+{
+	iovs_lock(iovs);
+	if (idx >= iovs->len) {
+		iovs_unlock(iovs);
+		return (NFTP_ERR_OVERFLOW);
+	}
+	*ptrp = iovs->iovs[iovs->low + idx].iov_base;
+	*lenp = iovs->iovs[iovs->low + idx].iov_len;
+	iovs_unlock(iovs);
+	return (0);
+}
+
 int
 nftp_iovs_cat(nftp_iovs *dest, nftp_iovs *src)
 {
 	nftp_iovs *d = dest, *s = src;
+	int        rv;
 
-	if (d->low + d->len + s->len > d->cap) {
-		return (NFTP_ERR_OVERFLOW); // Resize TODO
-	}
+	iovs_lock2(d, s);
 
-	pthread_mutex_lock(&d->mtx);
-	pthread_mutex_lock(&s->mtx);
+	if (0 != (rv = resize(d, 0, s->len))) {
+		iovs_unlock(s);
+		iovs_unlock(d);
+		return rv;
+	}
 
 	size_t idx = d->low + d->len;
 	for (size_t i = 0; i < s->len; ++i) {
+		struct iovs_rel r = rel_dup(s, s->low + i);
+		if (0 != (rv = rel_set(d, idx + i, r.cb, r.arg))) {
+			if (r.cb)
+				r.cb(r.arg);
+			break;
+		}
 		d->iovs[idx + i].iov_base = s->iovs[s->low + i].iov_base;
 		d->iovs[idx + i].iov_len  = s->iovs[s->low + i].iov_len;
 	}
-	pthread_mutex_unlock(&s->mtx);
+	iovs_unlock(s);
+	if (0 != rv) {
+		// Nothing added
+		for (size_t i = 0; i < s->len; ++i)
+			rel_call(d, idx + i);
+		iovs_unlock(d);
+		return rv;
+	}
 
 	d->len += s->len;
 	d->iolen += s->iolen;
 
-	pthread_mutex_unlock(&d->mtx);
+	iovs_unlock(d);
 	return (0);
 }
 
 int
 nftp_iovs_free(nftp_iovs *iovs)
 {
-	if (iovs == NULL || iovs->iovs == NULL) {
-		return (NFTP_ERR_MEM);
-	}
+	int rv;
 
-	pthread_mutex_destroy(&iovs->mtx);
-	free(iovs->iovs);
+	if (0 != (rv = nftp_iovs_fini(iovs)))
+		return rv;
 	free(iovs);
 	return (0);
 }
 
+int
+nftp_iovs_consume(nftp_iovs *iovs, size_t n)
+{
+	struct iovec *iov;
+	size_t        k;
+
+	iovs_lock(iovs);
+	if (n > iovs->iolen) {
+		iovs_unlock(iovs);
+		return (NFTP_ERR_OVERFLOW);
+	}
+
+	while (n > 0 || (iovs->len > 0 && iovs->iovs[iovs->low].iov_len == 0)) {
+		iov = &iovs->iovs[iovs->low];
+		k   = n < iov->iov_len ? n : iov->iov_len;
+
+		// Cursor stays at the same byte, or the start if it's consumed
+		if (iovs->sidx > 0) {
+			iovs->sent -= k;
+		} else {
+			iovs->sent -= k < iovs->soff ? k : iovs->soff;
+			iovs->soff -= k < iovs->soff ? k : iovs->soff;
+		}
+
+		if (k == iov->iov_len) {
+			iov->iov_base = NULL;
+			iov->iov_len  = 0;
+			rel_call(iovs, iovs->low);
+			iovs->low++;
+			iovs->len--;
+			if (iovs->sidx > 0)
+				iovs->sidx--;
+		} else {
+			iov->iov_base = (uint8_t *)iov->iov_base + k;
+			iov->iov_len -= k;
+		}
+		iovs->iolen -= k;
+		n -= k;
+	}
+	iovs_unlock(iovs);
+	return (0);
+}
+
+// Find the iov where offset off is in. Call with mtx held.
+static size_t
+iovs_seek(nftp_iovs *iovs, size_t *offp)
+{
+	size_t i, off = *offp;
+
+	for (i = 0; i < iovs->len; ++i) {
+		if (off < iovs->iovs[iovs->low + i].iov_len)
+			break;
+		off -= iovs->iovs[iovs->low + i].iov_len;
+	}
+	*offp = off;
+	return i;
+}
+
+int
+nftp_iovs_slice(nftp_iovs *src, size_t off, size_t len, nftp_iovs *dst)
+{
+	nftp_iovs *     d = dst, *s = src;
+	struct iovec *  iov;
+	struct iovs_rel r;
+	size_t          i, k, len0, iolen0;
+	int             rv = 0;
+
+	if (d == s) return (NFTP_ERR_IOVS);
+
+	iovs_lock2(d, s);
+	if (off > s->iolen || len > s->iolen - off) {
+		rv = NFTP_ERR_OVERFLOW;
+		goto done;
+	}
+	len0   = d->len;
+	iolen0 = d->iolen;
+
+	for (i = iovs_seek(s, &off); len > 0; ++i, off = 0) {
+		iov = &s->iovs[s->low + i];
+		k   = iov->iov_len - off < len ? iov->iov_len - off : len;
+		if (0 != (rv = resize(d, 0, 1)))
+			goto fail;
+		r = rel_dup(s, s->low + i);
+		if (0 != (rv = rel_set(d, d->low + d->len, r.cb, r.arg))) {
+			if (r.cb)
+				r.cb(r.arg);
+			goto fail;
+		}
+		d->iovs[d->low + d->len].iov_base = (uint8_t *)iov->iov_base + off;
+		d->iovs[d->low + d->len].iov_len  = k;
+		d->len++;
+		d->iolen += k;
+		len -= k;
+	}
+	goto done;
+
+fail:
+	// Nothing added, drop the iovs and refs taken so far
+	while (d->len > len0) {
+		d->len--;
+		rel_call(d, d->low + d->len);
+		d->iovs[d->low + d->len].iov_base = NULL;
+		d->iovs[d->low + d->len].iov_len  = 0;
+	}
+	d->iolen = iolen0;
+done:
+	iovs_unlock(s);
+	iovs_unlock(d);
+	return rv;
+}
+
+int
+nftp_iovs_copyout(nftp_iovs *iovs, size_t off, size_t len, void *buf)
+{
+	struct iovec *iov;
+	uint8_t *     v = buf;
+	size_t        i, k;
+
+	iovs_lock(iovs);
+	if (off > iovs->iolen || len > iovs->iolen - off) {
+		iovs_unlock(iovs);
+		return (NFTP_ERR_OVERFLOW);
+	}
+
+	for (i = iovs_seek(iovs, &off); len > 0; ++i, off = 0) {
+		iov = &iovs->iovs[iovs->low + i];
+		k   = iov->iov_len - off < len ? iov->iov_len - off : len;
+		memcpy(v, (uint8_t *)iov->iov_base + off, k);
+		v   += k;
+		len -= k;
+	}
+	iovs_unlock(iovs);
+	return (0);
+}
+
+size_t
+nftp_iovs_sent(nftp_iovs *iovs)
+{
+	return iovs->sent;
+}
+
+int
+nftp_iovs_rewind(nftp_iovs *iovs)
+{
+	iovs_lock(iovs);
+	iovs->sent = 0;
+	iovs->sidx = 0;
+	iovs->soff = 0;
+	iovs_unlock(iovs);
+	return (0);
+}
+
+#ifndef _WIN32
+// Move the cursor n bytes forward, across iovs
+static void
+iovs_advance(nftp_iovs *iovs, size_t n)
+{
+	size_t rest;
+
+	iovs->sent += n;
+	while (n > 0) {
+		rest = iovs->iovs[iovs->low + iovs->sidx].iov_len - iovs->soff;
+		if (n < rest) {
+			iovs->soff += n;
+			return;
+		}
+		n -= rest;
+		iovs->sidx++;
+		iovs->soff = 0;
+	}
+}
+
+// Write iovs from the cursor until all are written or fd would block.
+static int
+iovs_write(nftp_iovs *iovs, int fd, int flags, int msg)
+{
+	struct iovec *iov, head;
+	struct msghdr mh;
+	ssize_t       n;
+	size_t        cnt;
+	int           rv = 0;
+
+	iovs_lock(iovs);
+	while (iovs->sent < iovs->iolen) {
+		iov  = iovs->iovs + iovs->low + iovs->sidx;
+		cnt  = iovs->len - iovs->sidx;
+		if (cnt > IOV_MAX)
+			cnt = IOV_MAX;
+
+		// Skip the part written of the first iov, restore it then
+		head = iov[0];
+		iov[0].iov_base = (uint8_t *)head.iov_base + iovs->soff;
+		iov[0].iov_len -= iovs->soff;
+		if (msg) {
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov    = iov;
+			mh.msg_iovlen = cnt;
+			n = sendmsg(fd, &mh, flags);
+		} else {
+			n = writev(fd, iov, cnt);
+		}
+		iov[0] = head;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				rv = NFTP_ERR_AGAIN;
+			else
+				rv = NFTP_ERR_STREAM;
+			break;
+		}
+		iovs_advance(iovs, (size_t)n);
+	}
+	iovs_unlock(iovs);
+	return rv;
+}
+
+int
+nftp_iovs_writev(nftp_iovs *iovs, int fd)
+{
+	return iovs_write(iovs, fd, 0, 0);
+}
+
+int
+nftp_iovs_sendmsg(nftp_iovs *iovs, int fd, int flags)
+{
+	return iovs_write(iovs, fd, flags, 1);
+}
+#else
+int
+nftp_iovs_writev(nftp_iovs *iovs, int fd)
+{
+	(void)iovs;
+	(void)fd;
+	return (NFTP_ERR_STREAM);
+}
+
+int
+nftp_iovs_sendmsg(nftp_iovs *iovs, int fd, int flags)
+{
+	(void)iovs;
+	(void)fd;
+	(void)flags;
+	return (NFTP_ERR_STREAM);
+}
+#endif
+
 int
 nftp_iovs2stream(nftp_iovs *iovs, uint8_t **strp, size_t *len)
 {
@@ -219,14 +793,14 @@ nftp_iovs2stream(nftp_iovs *iovs, uint8_t **strp, size_t *len)
 		return (NFTP_ERR_MEM);
 	}
 
-	pthread_mutex_lock(&iovs->mtx);
+	iovs_lock(iovs);
 
 	for (size_t i=iovs->low; i<iovs->low + iovs->len; ++i) {
 		memcpy(str + pos, iovs->iovs[i].iov_base, iovs->iovs[i].iov_len);
 		pos += iovs->iovs[i].iov_len;
 	}
 
-	pthread_mutex_unlock(&iovs->mtx);
+	iovs_unlock(iovs);
 
 	*strp = str;
 	*len = iovs->iolen;
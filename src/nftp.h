@@ -12,6 +12,7 @@
 #ifndef NANO_FTP_H
 #define NANO_FTP_H
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -23,13 +24,22 @@
 #define NFTP_TYPE_FILE    0x03
 #define NFTP_TYPE_END     0x04
 #define NFTP_TYPE_GIVEME  0x05
+#define NFTP_TYPE_COMPACT 0x80 // Bit of type, FILE(END) in compact form
+#define NFTP_TYPE_BLKCRC  0x40 // Bit of type, compact with Block CRC
 
 #define NFTP_SIZE         32
 #define NFTP_BLOCK_NUM    (0xFFFF) // Maximal number of blocks
 #define NFTP_FILES        32 // Receive up to 32 files at once
 #define NFTP_HASH(p, n)   nftp_crc32c(p, n)
+#define NFTP_HASH_CTX     nftp_crc32c_ctx
+#define NFTP_HASH_INIT(c)         nftp_crc32c_init(c)
+#define NFTP_HASH_UPDATE(c, p, n) nftp_crc32c_update(c, p, n)
+#define NFTP_HASH_FINAL(c)        nftp_crc32c_final(c)
 #define NFTP_FNAME_LEN    64
 #define NFTP_FDIR_LEN     256
+#define NFTP_EXBUF_LEN    24 // Scratch for encoding fixed fields
+#define NFTP_FRAME_MAX    (64 * 1024 * 1024) // Larger len is a broken stream
+#define NFTP_HASH_WORKERS 8 // Threads hashing a file at most
 
 enum NFTP_ERR {
 	NFTP_ERR_HASH = 0x01,
@@ -52,6 +62,7 @@ enum NFTP_ERR {
 	NFTP_ERR_TYPE,
 	NFTP_ERR_FILEWR,
 	NFTP_ERR_FILERD,
+	NFTP_ERR_AGAIN,
 };
 
 enum NFTP_SCHEMA {
@@ -59,6 +70,16 @@ enum NFTP_SCHEMA {
 	NFTP_SCHEMA_VEC,
 };
 
+/*
+ * FILE and END carry a Block CRC (v2.0) after content when the len is
+ * 4 bytes more than the header and content. The ctlen of v1 is kept,
+ * so the receivers of v1 just ignore it.
+ */
+#define NFTP_FLAG_BLKCRC 0x01
+
+// Options sender supports, carried after the hash of HELLO
+#define NFTP_OPT_COMPACT 0x01
+
 #define NFTP_HEAD (-1)
 #define NFTP_TAIL (0x7FFFFFFF)
 
@@ -89,12 +110,44 @@ typedef struct {
 	char *    fname;
 	uint16_t  namelen;
 	uint32_t  fileid;
-	uint32_t  hashcode;
+	uint8_t   hashid;
+	uint64_t  hashcode;
 	uint8_t * content;
 	size_t    ctlen;
-	uint8_t * exbuf;
+	uint8_t   flags;  // NFTP_FLAG
+	uint32_t  blkcrc; // crc32c of content if NFTP_FLAG_BLKCRC
+	uint8_t   opts;   // NFTP_OPT in HELLO
+	uint8_t   sid;    // Session id of compact mode in ACK, 0 if refused
+	uint8_t   exbuf[NFTP_EXBUF_LEN]; // scratch of nftp_encode_iovs
 } nftp;
 
+/*
+ * A decoded msg which points into the buffer it was decoded from, nothing
+ * is allocated. It's valid as long as that buffer. fname is not
+ * terminated by '\0'. For HELLO, content is the raw hash trailer.
+ * When decoded from iovs, a fname split over segments is gathered into
+ * namebuf, and content is NULL if it's split (see the content iovs).
+ */
+typedef struct {
+	uint8_t         type;
+	uint32_t        len;
+	uint8_t         id;
+	uint16_t        blocks;
+	uint16_t        blockseq;
+	const uint8_t * fname;
+	uint16_t        namelen;
+	uint32_t        fileid;
+	uint8_t         hashid;
+	uint64_t        hashcode;
+	const uint8_t * content;
+	size_t          ctlen;
+	uint8_t         flags;
+	uint32_t        blkcrc;
+	uint8_t         opts;
+	uint8_t         sid;
+	uint8_t         namebuf[NFTP_FNAME_LEN];
+} nftp_view;
+
 typedef struct _iter {
 	int    schema;
 	int    key;
@@ -121,11 +174,117 @@ typedef struct _iter {
 		}                                         \
 	} while (0)
 
+/*
+ * Streaming hashes. Feed data in any number of chunks with *_update, the
+ * result equals the one-shot function over the concatenation.
+ */
+typedef struct {
+	uint32_t hash;
+} nftp_djb_ctx;
+
+typedef struct {
+	uint32_t hash;
+} nftp_fnv1a_ctx;
+
+typedef struct {
+	uint8_t crc;
+} nftp_crc_ctx;
+
+typedef struct {
+	uint32_t crc;
+} nftp_crc32_ctx;
+
+typedef struct {
+	uint32_t crc;
+} nftp_crc32c_ctx;
+
+typedef struct {
+	uint64_t v[4];
+	uint64_t total;
+	uint8_t  mem[32];
+	size_t   memlen;
+} nftp_xxh64_ctx;
+
+void     nftp_djb_init(nftp_djb_ctx *);
+void     nftp_djb_update(nftp_djb_ctx *, const uint8_t *, size_t);
+uint32_t nftp_djb_final(nftp_djb_ctx *);
+void     nftp_fnv1a_init(nftp_fnv1a_ctx *);
+void     nftp_fnv1a_update(nftp_fnv1a_ctx *, const uint8_t *, size_t);
+uint32_t nftp_fnv1a_final(nftp_fnv1a_ctx *);
+void     nftp_crc_init(nftp_crc_ctx *);
+void     nftp_crc_update(nftp_crc_ctx *, const uint8_t *, size_t);
+uint8_t  nftp_crc_final(nftp_crc_ctx *);
+void     nftp_crc32_init(nftp_crc32_ctx *);
+void     nftp_crc32_update(nftp_crc32_ctx *, const uint8_t *, size_t);
+uint32_t nftp_crc32_final(nftp_crc32_ctx *);
+void     nftp_crc32c_init(nftp_crc32c_ctx *);
+void     nftp_crc32c_update(nftp_crc32c_ctx *, const uint8_t *, size_t);
+void     nftp_crc32c_update_copy(nftp_crc32c_ctx *, uint8_t *, const uint8_t *, size_t);
+uint32_t nftp_crc32c_final(nftp_crc32c_ctx *);
+void     nftp_xxh64_init(nftp_xxh64_ctx *);
+void     nftp_xxh64_update(nftp_xxh64_ctx *, const uint8_t *, size_t);
+uint64_t nftp_xxh64_final(nftp_xxh64_ctx *);
+
 uint32_t nftp_djb_hashn(const uint8_t *, size_t);
 uint32_t nftp_fnv1a_hashn(const uint8_t *, size_t);
 uint8_t  nftp_crc(const uint8_t *, size_t);
 uint32_t nftp_crc32(const uint8_t *, size_t);
+// Table-driven CRC32, always available. nftp_crc32 folds with PCLMULQDQ.
+uint32_t nftp_crc32_sw(const uint8_t *, size_t);
+// Folding kernel of nftp_crc32, picked by cpu at first use. Setting one
+// is for tests and benchmarks, NFTP_ERR_HASH if the cpu lacks it. Not
+// thread-safe, set it while no other thread calls nftp_crc32.
+enum NFTP_CRC32_KERNEL {
+	NFTP_CRC32_SW = 0,
+	NFTP_CRC32_PCLMUL,
+	NFTP_CRC32_VPCLMUL,
+};
+int nftp_crc32_set_kernel(int);
+int nftp_crc32_get_kernel();
 uint32_t nftp_crc32c(const uint8_t *, size_t);
+// Table-driven CRC32C, always available. nftp_crc32c picks the fastest path.
+uint32_t nftp_crc32c_sw(const uint8_t *, size_t);
+uint32_t nftp_crc32c_combine(uint32_t, uint32_t, size_t);
+// Copy to dst and return the crc32c of bytes copied, in one pass.
+uint32_t nftp_crc32c_copy(uint8_t *, const uint8_t *, size_t);
+uint64_t nftp_xxh64(const uint8_t *, size_t);
+
+/*
+ * Integrity hash engines. The sender tells the engine of a transfer in the
+ * HELLO packet, and the recver checks the file with the same one.
+ * CRC32C is the default and is sent in the legacy HELLO layout.
+ */
+enum NFTP_HASH_ID {
+	NFTP_HASH_CRC32C = 0x01,
+	NFTP_HASH_CRC32,
+	NFTP_HASH_FNV1A,
+	NFTP_HASH_XXH64,
+};
+
+typedef union {
+	nftp_crc32c_ctx crc32c;
+	nftp_crc32_ctx  crc32;
+	nftp_fnv1a_ctx  fnv1a;
+	nftp_xxh64_ctx  xxh64;
+	uint8_t         opaque[64]; // For engines registered by user
+} nftp_hash_ctx;
+
+typedef struct {
+	uint8_t      id;
+	const char * name;
+	uint8_t      width; // Bytes of digest on wire, 4 or 8
+	uint64_t   (*hash)(const uint8_t *, size_t);
+	void       (*init)(nftp_hash_ctx *);
+	void       (*update)(nftp_hash_ctx *, const uint8_t *, size_t);
+	uint64_t   (*final)(nftp_hash_ctx *);
+	// Digest of a then b from both digests and the length of b. NULL
+	// if the engine can't hash a file in ranges by several threads.
+	uint64_t   (*combine)(uint64_t, uint64_t, size_t);
+} nftp_hash_engine;
+
+const nftp_hash_engine * nftp_hash_engine_get(int);
+// Not thread-safe. Register engines before any transfer starts.
+int nftp_hash_engine_register(const nftp_hash_engine *);
 
 char * nftp_file_bname(char *);
 char * nftp_file_path(char *);
@@ -137,11 +296,23 @@ int nftp_file_rename(char *, char *);
 int nftp_file_size(char *, size_t *);
 int nftp_file_blocks(char *, size_t *);
 int nftp_file_readblk(char *, int, char **, size_t *);
+int nftp_file_readblks(char *, int, int *, char **, size_t *, uint32_t *);
 int nftp_file_read(char *, char **, size_t *);
 int nftp_file_write(char *, char *, size_t);
 int nftp_file_append(char *, char *, size_t);
 int nftp_file_clear(char *);
+// CRC32C of a file, as nftp_file_digest with NFTP_HASH_CRC32C
 int nftp_file_hash(char *, uint32_t *);
+/*
+ * Same result as nftp_file_hash. A file of several ranges (4MB each) is
+ * hashed by up to nthreads workers and merged with nftp_crc32c_combine.
+ * nthreads <= 0 means one worker per online cpu. Workers are at most
+ * NFTP_HASH_WORKERS, and smaller files are hashed by the caller only.
+ */
+int nftp_file_hash_mt(char *, uint32_t *, int);
+// Hash a file with the engine of given NFTP_HASH_ID. It's done as
+// nftp_file_hash_mt if the engine can combine.
+int nftp_file_digest(char *, int, uint64_t *);
 
 nftp_iter * nftp_iter_alloc(int, void *);
 void        nftp_iter_free(nftp_iter *);
@@ -151,15 +322,32 @@ nftp_iter * nftp_iter_prev(nftp_iter *);
 #define NFTP_NEXT(iter) nftp_iter_next(iter)
 #define NFTP_PREV(iter) nftp_iter_prev(iter)
 
-typedef struct _vec nftp_vec;
+/*
+ * Fields are private. It's public only for the iterators on stack and
+ * NFTP_VEC_FOREACH below.
+ */
+typedef struct _vec {
+	int             cap; // capicity
+	int             len; // number of elements
+	int             low; // elements stored from here
+	void          **vec;
+	int             nolock; // Single owner, mtx is not used
+	pthread_mutex_t mtx;
+} nftp_vec;
 
 int nftp_vec_alloc(nftp_vec **, int);
+// Without lock, for a vec never shared between threads
+int nftp_vec_alloc_nolock(nftp_vec **, int);
 int nftp_vec_free(nftp_vec *);
 int nftp_vec_append(nftp_vec *, void *);
 int nftp_vec_insert(nftp_vec *, void *, int);
 int nftp_vec_delete(nftp_vec *, void **, int);
 int nftp_vec_push(nftp_vec *, void *, int);
 int nftp_vec_pop(nftp_vec *, void **, int);
+// Append n entries at tail
+int nftp_vec_append_n(nftp_vec *, void **, int n);
+// Pop up to n entries from head, *cntp is the number popped
+int nftp_vec_pop_n(nftp_vec *, void **, int n, int *cntp);
 int nftp_vec_get(nftp_vec *, int, void **);
 int nftp_vec_getidx(nftp_vec *, void *, int*);
 int nftp_vec_cap(nftp_vec *);
@@ -167,9 +355,114 @@ int nftp_vec_len(nftp_vec *);
 // Iterator
 nftp_iter * nftp_vec_iter(nftp_vec *);
 
-typedef struct _iovs nftp_iovs;
+/*
+ * Iterators on stack, without malloc and function pointers. Init puts it
+ * before the first (key is NFTP_HEAD). next/prev return 0 when moving
+ * out, with key NFTP_TAIL/NFTP_HEAD. No lock is taken, so the container
+ * must not change while iterating.
+ */
+typedef struct {
+	int        key;
+	void *     val;
+	nftp_vec * v;
+} nftp_vec_it;
+
+static inline void
+nftp_vec_it_init(nftp_vec_it *it, nftp_vec *v)
+{
+	it->key = NFTP_HEAD;
+	it->val = NULL;
+	it->v   = v;
+}
+
+static inline int
+nftp_vec_it_next(nftp_vec_it *it)
+{
+	if (it->key == NFTP_TAIL || ++it->key >= it->v->len) {
+		it->key = NFTP_TAIL;
+		it->val = NULL;
+		return 0;
+	}
+	it->val = it->v->vec[(it->v->low + it->key) % it->v->cap];
+	return 1;
+}
+
+static inline int
+nftp_vec_it_prev(nftp_vec_it *it)
+{
+	if (it->key == NFTP_TAIL)
+		it->key = it->v->len;
+	if (it->key == NFTP_HEAD || --it->key < 0) {
+		it->key = NFTP_HEAD;
+		it->val = NULL;
+		return 0;
+	}
+	it->val = it->v->vec[(it->v->low + it->key) % it->v->cap];
+	return 1;
+}
+
+// for each element e (a pointer) at index i of v, v must not change in it
+#define NFTP_VEC_FOREACH(v, i, e)                 \
+	for (int i = 0; i < (v)->len &&            \
+	     (((e) = (v)->vec[((v)->low + i) % (v)->cap]), 1); ++i)
+
+/*
+ * Bounded lock-free queues for handing entries between threads, SPSC for
+ * one producer and one consumer, MPMC for any. Capacity is rounded up to
+ * a power of 2. Push returns NFTP_ERR_OVERFLOW if full and pop returns
+ * NFTP_ERR_EMPTY if empty. The _n variants move up to n entries at once,
+ * *cntp is the number moved.
+ */
+typedef struct _spsc nftp_spsc;
+typedef struct _mpmc nftp_mpmc;
+
+int nftp_spsc_alloc(nftp_spsc **, int);
+int nftp_spsc_free(nftp_spsc *);
+int nftp_spsc_push(nftp_spsc *, void *);
+int nftp_spsc_pop(nftp_spsc *, void **);
+int nftp_spsc_push_n(nftp_spsc *, void **, int n, int *cntp);
+int nftp_spsc_pop_n(nftp_spsc *, void **, int n, int *cntp);
+int nftp_spsc_len(nftp_spsc *);
+int nftp_spsc_cap(nftp_spsc *);
+
+int nftp_mpmc_alloc(nftp_mpmc **, int);
+int nftp_mpmc_free(nftp_mpmc *);
+int nftp_mpmc_push(nftp_mpmc *, void *);
+int nftp_mpmc_pop(nftp_mpmc *, void **);
+int nftp_mpmc_push_n(nftp_mpmc *, void **, int n, int *cntp);
+int nftp_mpmc_pop_n(nftp_mpmc *, void **, int n, int *cntp);
+int nftp_mpmc_len(nftp_mpmc *);
+int nftp_mpmc_cap(nftp_mpmc *);
+
+#define NFTP_IOVS_INLINE 8 // iovs held in nftp_iovs before spilling to heap
+
+/*
+ * Fields are private. It's public only to be embedded in a stack frame or
+ * a struct by nftp_iovs_init, so a packet of a few iovs needs no malloc.
+ */
+typedef struct _iovs {
+	struct iovec *   iovs;
+	struct iovs_rel *rel; // Parallel to iovs, NULL until a release is set
+	size_t           low; // iov loaded from iovs+low
+	size_t           len; // counter of iov in iovs
+	size_t           cap;
+	size_t           iolen;
+	int              nolock; // Single owner, mtx is not used
+	size_t           sent; // Cursor of writev, bytes written from low
+	size_t           sidx; // iov the cursor is in
+	size_t           soff; // offset in that iov
+	pthread_mutex_t  mtx;
+	struct iovec     inl[NFTP_IOVS_INLINE];
+} nftp_iovs;
 
 int nftp_iovs_alloc(nftp_iovs **);
+// Without lock, for iovs owned by one thread like in the codec
+int nftp_iovs_alloc_nolock(nftp_iovs **);
+// In place with inline storage and without lock. Pair with nftp_iovs_fini.
+int nftp_iovs_init(nftp_iovs *);
+int nftp_iovs_fini(nftp_iovs *);
+// Room for n more iovs at tail without growing again
+int nftp_iovs_reserve(nftp_iovs *, size_t);
 int nftp_iovs_append(nftp_iovs *, void *, size_t);
 int nftp_iovs_insert(nftp_iovs *, void *, size_t, size_t);
 int nftp_iovs_push(nftp_iovs *, void *, size_t, int);
@@ -178,11 +471,107 @@ int nftp_iovs_cat(nftp_iovs *, nftp_iovs *);
 int nftp_iovs_free(nftp_iovs *);
 size_t nftp_iovs_len(nftp_iovs *);
 size_t nftp_iovs_cap(nftp_iovs *);
+size_t nftp_iovs_iolen(nftp_iovs *);
+int nftp_iovs_get(nftp_iovs *, size_t, void **, size_t *);
 // Iterator
 nftp_iter * nftp_iovs_iter(nftp_iovs *);
 
+// Iterator on stack, same as nftp_vec_it. val is the struct iovec *.
+typedef struct {
+	int            key;
+	struct iovec * val;
+	nftp_iovs *    iovs;
+} nftp_iovs_it;
+
+static inline void
+nftp_iovs_it_init(nftp_iovs_it *it, nftp_iovs *iovs)
+{
+	it->key  = NFTP_HEAD;
+	it->val  = NULL;
+	it->iovs = iovs;
+}
+
+static inline int
+nftp_iovs_it_next(nftp_iovs_it *it)
+{
+	if (it->key == NFTP_TAIL || (size_t)++it->key >= it->iovs->len) {
+		it->key = NFTP_TAIL;
+		it->val = NULL;
+		return 0;
+	}
+	it->val = &it->iovs->iovs[it->iovs->low + it->key];
+	return 1;
+}
+
+static inline int
+nftp_iovs_it_prev(nftp_iovs_it *it)
+{
+	if (it->key == NFTP_TAIL)
+		it->key = (int)it->iovs->len;
+	if (it->key == NFTP_HEAD || --it->key < 0) {
+		it->key = NFTP_HEAD;
+		it->val = NULL;
+		return 0;
+	}
+	it->val = &it->iovs->iovs[it->iovs->low + it->key];
+	return 1;
+}
+
+// for each struct iovec *iov at index i of iovs s, s must not change in it
+#define NFTP_IOVS_FOREACH(s, i, iov)     \
+	for (size_t i = 0; i < (s)->len && \
+	     (((iov) = &(s)->iovs[(s)->low + i]), 1); ++i)
+
 int nftp_iovs2stream(nftp_iovs *, uint8_t **, size_t *);
 
+/*
+ * A buffer with a refcount, freed with the last nftp_buf_unref. If it's
+ * from nftp_buf_wrap, release is called on data then.
+ */
+typedef struct {
+	void * data;
+	size_t len;
+	int    refcnt;
+	void (*release)(void *);
+} nftp_buf;
+
+int nftp_buf_alloc(nftp_buf **, size_t);
+int nftp_buf_wrap(nftp_buf **, void *, size_t, void (*)(void *));
+nftp_buf * nftp_buf_ref(nftp_buf *);
+int nftp_buf_unref(nftp_buf *);
+
+/*
+ * Push an iov owned by the iovs. cb(arg) is called once the iov leaves
+ * the iovs, by pop, consume or nftp_iovs_free. So a chain could release
+ * its buffers after the kernel has taken the bytes, by consuming what
+ * nftp_iovs_writev has written. nftp_iovs_push_buf holds a ref of b for
+ * bytes [off, off+len), and slice and cat of such iovs take their own
+ * refs. Other iovs are not owned by copies.
+ */
+int nftp_iovs_push_cb(nftp_iovs *, void *, size_t, int, void (*cb)(void *), void *arg);
+int nftp_iovs_push_buf(nftp_iovs *, nftp_buf *b, size_t off, size_t len, int);
+
+// Drop n bytes from the front, the first iov left may be trimmed
+int nftp_iovs_consume(nftp_iovs *, size_t n);
+// Append iovs of bytes [off, off+len) of src to dst, without copy
+int nftp_iovs_slice(nftp_iovs *src, size_t off, size_t len, nftp_iovs *dst);
+// Copy bytes [off, off+len) to buf
+int nftp_iovs_copyout(nftp_iovs *, size_t off, size_t len, void *buf);
+
+/*
+ * Write iovs to fd without copy, by writev or by sendmsg with flags. The
+ * bytes written are tracked by a cursor, so a non-blocking fd resumes
+ * where it stopped in the next call. Popping written iovs at HEAD keeps
+ * the cursor right, nftp_iovs_rewind() moves it back to the start.
+ *
+ * @return, 0 if all written. NFTP_ERR_AGAIN if fd would block, or
+ * NFTP_ERR_STREAM with errno set.
+ */
+int nftp_iovs_writev(nftp_iovs *, int fd);
+int nftp_iovs_sendmsg(nftp_iovs *, int fd, int flags);
+size_t nftp_iovs_sent(nftp_iovs *);
+int nftp_iovs_rewind(nftp_iovs *);
+
 #define nftp_put_u32(ptr, u)                                  \
 	do {                                                  \
 		(ptr)[0] = (uint8_t)(((uint32_t)(u)) >> 24u); \
@@ -197,6 +586,20 @@ int nftp_iovs2stream(nftp_iovs *, uint8_t **, size_t *);
 	    (((uint32_t)((uint8_t)(ptr)[2])) << 8u) +  \
 	    (((uint32_t)(uint8_t)(ptr)[3]))
 
+#define nftp_put_u64(ptr, u)                                      \
+	do {                                                      \
+		nftp_put_u32(ptr, (uint32_t)(((uint64_t)(u)) >> 32u)); \
+		nftp_put_u32((ptr) + 4, (uint32_t)(u));                 \
+	} while (0)
+
+#define nftp_get_u64(ptr, v)                                         \
+	do {                                                         \
+		uint32_t hi_, lo_;                                   \
+		nftp_get_u32(ptr, hi_);                              \
+		nftp_get_u32((ptr) + 4, lo_);                        \
+		v = (((uint64_t)hi_) << 32u) + lo_;                  \
+	} while (0)
+
 #define nftp_put_u16(ptr, u)                                    \
 	do {                                                 \
 		(ptr)[0] = (uint8_t)(((uint16_t)(u)) >> 8u); \
@@ -208,12 +611,70 @@ int nftp_iovs2stream(nftp_iovs *, uint8_t **, size_t *);
 	    (((uint16_t)(uint8_t)(ptr)[1]))
 
 int nftp_alloc(nftp **);
+int nftp_init(nftp *);
+int nftp_reset(nftp *);
+int nftp_fini(nftp *);
 int nftp_decode_iovs(nftp *, nftp_iovs *);
 int nftp_decode(nftp *, uint8_t *, size_t);
+int nftp_decode_view(nftp_view *, const uint8_t *, size_t);
+int nftp_decode_iovs_view(nftp_view *, nftp_iovs *, nftp_iovs *);
 int nftp_encode_iovs(nftp *, nftp_iovs *);
+// Like nftp_encode_iovs, but the iovs owns what it points to. Header
+// bytes are copied to a nftp_buf and content (malloced) is moved into
+// the iovs, so it outlives nftp.
+int nftp_encode_iovs_owned(nftp *, nftp_iovs *);
 int nftp_encode(nftp *, uint8_t **, size_t *);
+size_t nftp_encoded_size(nftp *);
+int nftp_encode_into(nftp *, uint8_t *, size_t);
 int nftp_free(nftp *);
 
+/*
+ * A session of compact mode, on both sides. It's negotiated by the
+ * NFTP_OPT_COMPACT of HELLO and the sid of ACK.
+ */
+typedef struct {
+	uint8_t  sid;
+	uint32_t fileid;
+} nftp_compact;
+
+int nftp_compact_init(nftp_compact *, uint8_t, uint32_t);
+size_t nftp_compact_size(nftp *, nftp_compact *);
+int nftp_encode_compact(nftp *, nftp_compact *, uint8_t *, size_t);
+int nftp_decode_compact(nftp_view *, nftp_compact *, const uint8_t *, size_t);
+
+/*
+ * Bitmap of blocks in GIVEME (v2.0). The bit i (LSB first) is the block
+ * blockseq+i. A GIVEME without bitmap asks the block blockseq only.
+ */
+typedef struct {
+	uint32_t start;
+	uint32_t len;
+} nftp_run;
+
+size_t nftp_bitmap_runs(const uint8_t *, size_t, nftp_run *, size_t);
+size_t nftp_bitmap_count(const uint8_t *, size_t);
+void nftp_bitmap_invert(uint8_t *, const uint8_t *, size_t, size_t);
+
+/*
+ * Split a byte stream (e.g. TCP) into nftp msgs. Bytes are fed in chunks
+ * of any size, and complete msgs are returned as pointers into the
+ * buffer of framer. They are valid until the next feed or space.
+ */
+typedef struct {
+	uint8_t * buf;
+	size_t    cap;
+	size_t    head; // start of the first msg not returned
+	size_t    tail; // end of the bytes fed
+} nftp_framer;
+
+int nftp_framer_init(nftp_framer *, size_t);
+int nftp_framer_fini(nftp_framer *);
+int nftp_framer_feed(nftp_framer *, const uint8_t *, size_t);
+int nftp_framer_space(nftp_framer *, size_t, uint8_t **, size_t *);
+int nftp_framer_commit(nftp_framer *, size_t);
+int nftp_framer_next(nftp_framer *, const uint8_t **, size_t *);
+size_t nftp_framer_pending(nftp_framer *);
+
 int nftp_proto_init();
 int nftp_proto_fini();
 int nftp_proto_send_start(char *);
@@ -228,7 +689,7 @@ int nftp_proto_hello_get_fname(char *, int, char **, int *);
  * @fpath, Path to file.
  * @type, NFTP_TYPE.
  * @key, A key to present the session of transmission.
- * @n, The index of block (blockseq).
+ * @n, The index of block (blockseq). Or the sid of compact mode for ACK.
  * @rmsg, The msg we created.
  * @rlen, The length of rmsg.
  *
@@ -237,6 +698,66 @@ int nftp_proto_hello_get_fname(char *, int, char **, int *);
 int nftp_proto_maker(char *fpath, int type, int key,
         int n, char **rmsg, int *rlen);
 
+/*
+ * A window of FILE(END) msgs made by nftp_proto_maker_batch. The msg i
+ * is iov[stride*i] (header), iov[stride*i+1] (payload) and, if Block CRC
+ * is on, iov[stride*i+2] (Block CRC). Headers and CRCs are in one slab
+ * and payloads point into one buffer read from file, so the whole window
+ * goes out in one writev(iov, iovcnt) or sendmmsg.
+ */
+typedef struct {
+	struct iovec *iov;
+	int           iovcnt;
+	int           stride; // iovs per msg, 2 or 3
+	int           cnt;    // number of msgs
+	uint8_t *     hdrs;
+	char *        data;
+} nftp_batch;
+
+#define NFTP_FILE_HDRLEN 15 // type & len & fileid & blockseq & ctlen
+
+/*
+ * Create FILE msgs for blocks [n, n+cnt) of a file with one read. The
+ * msg of last block is END. cnt is cut at the end of file.
+ *
+ * @return, 0 if no errors. Or please refer to NFTP_ERR.
+ */
+int nftp_proto_maker_batch(char *fpath, int n, int cnt, nftp_batch *b);
+
+/*
+ * Create a GIVEME (v2.0) of the file being received, which asks all the
+ * blocks missing with a bitmap. The sender replies all of them back to
+ * back in rmsg of nftp_proto_handler (or riovs of
+ * nftp_proto_handler_iovs), which could be split by nftp_framer.
+ *
+ * @return, 0 if no errors. NFTP_ERR_EMPTY if no block is missing.
+ */
+int nftp_proto_maker_giveme(char *fname, char **rmsg, int *rlen);
+int nftp_batch_free(nftp_batch *b);
+
+/*
+ * A sender of one file, built once when HELLO is sent. fileid, type and
+ * flags are kept in a header template, and only len, blockseq and ctlen
+ * are patched for each block. The file stays open, so a block is read
+ * right behind its header. Msgs are in full form.
+ */
+typedef struct {
+	FILE *   fp;
+	size_t   fsize;
+	uint32_t blocksz;
+	uint32_t blocks;
+	uint8_t  flags;   // NFTP_FLAG_BLKCRC
+	uint8_t  hdr[NFTP_FILE_HDRLEN];
+} nftp_sender;
+
+int nftp_sender_init(nftp_sender *, char *fpath);
+int nftp_sender_fini(nftp_sender *);
+// Encoded size of block n, 0 if n is out of the file
+size_t nftp_sender_size(nftp_sender *, int n);
+// Encode block n to buf, the last block is END
+int nftp_sender_encode(nftp_sender *, int n, uint8_t *buf, size_t cap, size_t *lenp);
+int nftp_sender_maker(nftp_sender *, int n, char **rmsg, int *rlen);
+
 /*
  * This function is to handle the NFTP msg and return msg caller needed.
  *
@@ -245,9 +766,17 @@ int nftp_proto_maker(char *fpath, int type, int key,
  * @rmsg, Msg we returned if needed.
  * @rlen, Length of rmsg.
  *
- * @return, 0 if no errors. Or please refer to NFTP_ERR.
+ * @return, 0 if no errors. Or please refer to NFTP_ERR. If the Block CRC
+ * of a FILE msg mismatches, NFTP_ERR_HASH is returned and rmsg is the
+ * GIVEME of that block.
  */
 int nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen);
+/*
+ * Same as nftp_proto_handler, but the reply is appended to riovs. The
+ * blocks asked by a GIVEME with bitmap are not flattened, and riovs
+ * owns what it points to, so it could go to nftp_iovs_writev directly.
+ */
+int nftp_proto_handler_iovs(char *msg, int len, nftp_iovs *riovs);
 
 int nftp_proto_register(char *, int (*cb)(void *), void *);
 int nftp_proto_unregister(char *);
@@ -259,6 +788,18 @@ int nftp_proto_unregister(char *);
 int nftp_set_recvdir(char *);
 int nftp_set_blocksz(uint32_t);
 uint32_t nftp_get_blocksz();
+// The engine (NFTP_HASH_ID) sender uses for HELLO. CRC32C by default.
+int nftp_set_hash(int);
+int nftp_get_hash();
+// Whether sender puts a Block CRC in FILE(END). On by default.
+int nftp_set_blockcrc(int);
+int nftp_get_blockcrc();
+// Whether sender asks compact mode in HELLO. Off by default. If recver
+// agrees, FILE(END) from nftp_proto_maker are in compact form. Sids are
+// global like the fileids of proto, so only one peer is supported on each
+// side.
+int nftp_set_compact(int);
+int nftp_get_compact();
 
 int test();
 
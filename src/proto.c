@@ -21,6 +21,9 @@
 
 static char *recvdir = NULL;
 static uint32_t blocksz = 32*1024; // default block size
+static int      sendhash = NFTP_HASH_CRC32C; // engine for sending
+static int      blockcrc = 1; // Block CRC in FILE(END) for sending
+static int      compact  = 0; // Ask compact mode in HELLO for sending
 
 struct file_cb {
 	char *fname;
@@ -29,21 +32,33 @@ struct file_cb {
 };
 
 struct buf {
-	char* body;
-	int   len;
+	char*    body;
+	int      len;
+	uint8_t  flags; // NFTP_FLAG_BLKCRC if crc is valid
+	uint32_t crc;
 };
 
 HashTable files;
 nftp_vec *fcb_reg = NULL;
 HashTable senderfiles;
 
+// Sessions of compact mode indexed by sid, sid 0 is not used. Like files
+// they are keyed without the peer, only one peer is supported.
+static nftp_compact sendcs[256];
+static struct nctx *recvcs[256];
+
 struct nctx {
 	int             len;
 	int             cap;
 	int             nextid;
 	struct buf *    entries;
+	uint8_t *       recvd; // Bitmap of blocks received
 	uint32_t        fileid;
-	uint32_t        hashcode;
+	uint8_t         hashid;
+	uint64_t        hashcode;
+	uint32_t        filecrc; // Block CRCs of the part file combined
+	uint8_t         crcall;  // Every block appended has a Block CRC
+	nftp_compact    cs;      // Compact mode if cs.sid != 0
 	struct file_cb *fcb;
 	char *          wfname;
 	uint8_t         status;
@@ -61,6 +76,11 @@ nctx_alloc(size_t sz)
 		free(n);
 		return NULL;
 	}
+	if ((n->recvd = calloc((sz + 7) / 8 + 1, 1)) == NULL) {
+		free(n->entries);
+		free(n);
+		return NULL;
+	}
 	for (size_t i=0; i<sz; ++i) {
 		n->entries[i].len = 0;
 		n->entries[i].body = NULL;
@@ -69,6 +89,9 @@ nctx_alloc(size_t sz)
 	n->len      = 0;
 	n->cap      = sz;
 	n->nextid   = 0;
+	n->filecrc  = 0;
+	n->crcall   = 1;
+	n->cs.sid   = 0;
 	n->wfname   = NULL;
 	n->fcb      = NULL;
 
@@ -78,36 +101,20 @@ nctx_alloc(size_t sz)
 static void
 nctx_free(struct nctx * n) {
 	if (!n) return;
+	if (n->cs.sid)
+		recvcs[n->cs.sid] = NULL;
 	if (n->entries) {
 		for (int i=0; i<n->cap; i++)
 			if (n->entries[i].body != NULL)
 				free(n->entries[i].body);
 		free(n->entries);
 	}
+	free(n->recvd);
 	if (n->wfname)
 		free(n->wfname);
 	free(n);
 }
 
-static void
-nctx_free_cb(void *k, void *v, void *u)
-{
-	struct nctx ** vp = v;
-	(void )k;
-	(void )u;
-	if (vp) {
-		nctx_free(*vp);
-	}
-}
-
-static void
-senderfile_free_cb(void *k, void *v, void *u)
-{
-	(void) k;
-	(void) v;
-	(void) u;
-}
-
 int
 nftp_proto_init()
 {
@@ -119,6 +126,8 @@ nftp_proto_init()
 	if (0 != (rv = nftp_proto_register("*", NULL, NULL)))
 		return rv;
 
+	memset(sendcs, 0, sizeof(sendcs));
+	memset(recvcs, 0, sizeof(recvcs));
 	ht_setup(&files, sizeof(uint32_t), sizeof(struct nctx*), NFTP_FILES);
 	ht_setup(&senderfiles, sizeof(uint32_t), NFTP_FNAME_LEN + NFTP_FDIR_LEN, NFTP_FILES);
 
@@ -130,6 +139,8 @@ nftp_proto_fini()
 {
 	int rv;
 	struct file_cb *fcb;
+	HTIter it;
+	HTNode *node;
 	while (0 != nftp_vec_len(fcb_reg)) {
 		nftp_vec_pop(fcb_reg, (void **)&fcb, NFTP_HEAD);
 		free(fcb->fname);
@@ -138,11 +149,11 @@ nftp_proto_fini()
 	if (0 != (rv = nftp_vec_free(fcb_reg)))
 		return rv;
 
-	ht_iterate(&files, NULL, nctx_free_cb);
+	HT_FOREACH(&files, it, node)
+		nctx_free(*(struct nctx **)node->value);
 	ht_clear(&files);
 	ht_destroy(&files);
 
-	ht_iterate(&senderfiles, NULL, senderfile_free_cb);
 	ht_clear(&senderfiles);
 	ht_destroy(&senderfiles);
 
@@ -172,6 +183,24 @@ nftp_proto_hello_get_fname(char *rmsg, int rlen, char **fnamep, int *lenp)
 	return 0;
 }
 
+static nftp_compact *
+sendcs_find(uint32_t fileid)
+{
+	for (int i = 1; i < 256; ++i)
+		if (sendcs[i].sid && sendcs[i].fileid == fileid)
+			return &sendcs[i];
+	return NULL;
+}
+
+// Close the sessions of fileid, msgs are in normal form until next ACK
+static void
+sendcs_drop(uint32_t fileid)
+{
+	for (int i = 1; i < 256; ++i)
+		if (sendcs[i].sid && sendcs[i].fileid == fileid)
+			sendcs[i].sid = 0;
+}
+
 int
 nftp_proto_send_start(char *fpath)
 {
@@ -187,8 +216,18 @@ nftp_proto_send_start(char *fpath)
 int
 nftp_proto_send_stop(char *fpath)
 {
-	(void) fpath;
+	char *   fname;
+	uint32_t fileid;
+
 	// TODO send something to stop the recver
+	if (NULL == fpath) return (NFTP_ERR_FILEPATH);
+	if ((fname = nftp_file_bname(fpath)) == NULL)
+		return (NFTP_ERR_FILEPATH);
+	fileid = NFTP_HASH((const uint8_t *)fname, strlen(fname));
+	free(fname);
+
+	// Msgs resent later are in normal form
+	sendcs_drop(fileid);
 	return 0;
 }
 
@@ -290,7 +329,8 @@ int
 nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 {
 	int rv;
-	nftp * p;
+	nftp   msg, *p = &msg;
+	nftp_compact *cs;
 	size_t len, blocks;
 	char *v, *fname;
 	char  fullpath[NFTP_FNAME_LEN + NFTP_FDIR_LEN];
@@ -298,13 +338,15 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 	if (NULL == fpath) return (NFTP_ERR_FILEPATH);
 	if ((fname = nftp_file_bname(fpath)) == NULL)
 		return (NFTP_ERR_FILEPATH);
-	if (0 != (rv = nftp_alloc(&p))) return rv;
+	nftp_init(p);
 
 	switch (type) {
 	case NFTP_TYPE_HELLO:
 		p->type = NFTP_TYPE_HELLO;
-		p->len = 5 + 1 + 2 + 2 + strlen(fname) + 4;
+		p->hashid = sendhash;
 		p->id = 0xff & key;
+		if (compact)
+			p->opts |= NFTP_OPT_COMPACT;
 		if (0 != (rv = nftp_file_size(fpath, &len)))
 			return rv;
 
@@ -317,8 +359,9 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 		p->blocks = (uint16_t)blocks;
 		p->fname = fname;
 		p->namelen = strlen(fname);
+		p->len = nftp_encoded_size(p);
 
-		if (0 != (rv = nftp_file_hash(fpath, &p->hashcode)))
+		if (0 != (rv = nftp_file_digest(fpath, p->hashid, &p->hashcode)))
 			return rv;
 
 		// XXX bug here. Here we donot get the fileid.
@@ -333,13 +376,16 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 			nftp_fatal("Error in hash");
 			return (NFTP_ERR_HT);
 		}
+		// A sid of an aborted transfer is stale, wait for the new ACK
+		sendcs_drop(key);
 		break;
 
 	case NFTP_TYPE_ACK:
 		p->type = NFTP_TYPE_ACK;
-		p->len = 6 + 4;
 		p->id = 0xff & key;
+		p->sid = 0xff & n;
 		p->fileid = NFTP_HASH((const uint8_t *)fname, (size_t)strlen(fname));
+		p->len = nftp_encoded_size(p);
 		break;
 
 	case NFTP_TYPE_FILE:
@@ -352,12 +398,14 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 		// Note. No type check.
 		p->type = type;
 
-		p->len = 5 + 4 + 2 + 4 + len;
 		p->fileid = NFTP_HASH((const uint8_t *)fname, (size_t)strlen(fname));
 		p->blockseq = n;
+		if (blockcrc) // Computed in the pass of encoding
+			p->flags |= NFTP_FLAG_BLKCRC;
 
 		p->ctlen = len;
 		p->content = (uint8_t *)v;
+		p->len = nftp_encoded_size(p);
 		break;
 
 	case NFTP_TYPE_GIVEME:
@@ -376,7 +424,16 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 	}
 
 	size_t alen;
-	if (0 != (rv = nftp_encode(p, (uint8_t **)rmsg, &alen))) {
+	if ((type == NFTP_TYPE_FILE || type == NFTP_TYPE_END) &&
+	    (cs = sendcs_find(p->fileid)) != NULL) {
+		alen = nftp_compact_size(p, cs);
+		if ((*rmsg = malloc(alen)) == NULL)
+			return (NFTP_ERR_MEM);
+		rv = nftp_encode_compact(p, cs, (uint8_t *)*rmsg, alen);
+	} else {
+		rv = nftp_encode(p, (uint8_t **)rmsg, &alen);
+	}
+	if (0 != rv) {
 		return rv;
 	}
 	*rlen = alen;
@@ -385,124 +442,513 @@ nftp_proto_maker(char *fpath, int type, int key, int n, char **rmsg, int *rlen)
 		nftp_proto_send_stop(fpath);
 	}
 
-	p->fname = NULL; // Avoid free in nftp_free by mistake
-	nftp_free(p);
+	p->fname = NULL; // Avoid free in nftp_fini by mistake
+	nftp_fini(p);
 	free(fname);
 	return (0);
 }
 
+int
+nftp_sender_init(nftp_sender *s, char *fpath)
+{
+	char *   fname;
+	uint32_t fileid;
+	long     fsize;
+
+	if (!s || !fpath) return (NFTP_ERR_EMPTY);
+	if ((fname = nftp_file_bname(fpath)) == NULL)
+		return (NFTP_ERR_FILEPATH);
+	fileid = NFTP_HASH((const uint8_t *)fname, strlen(fname));
+	free(fname);
+
+	if ((s->fp = fopen(fpath, "rb")) == NULL) {
+		nftp_fatal("open error");
+		return (NFTP_ERR_FILE);
+	}
+	if (0 != fseek(s->fp, 0, SEEK_END) || (fsize = ftell(s->fp)) < 0) {
+		fclose(s->fp);
+		s->fp = NULL;
+		return (NFTP_ERR_FILERD);
+	}
+
+	// Same as HELLO
+	s->fsize   = (size_t)fsize;
+	s->blocksz = nftp_get_blocksz();
+	s->blocks  = s->fsize / s->blocksz + 1;
+	s->flags   = blockcrc ? NFTP_FLAG_BLKCRC : 0;
+	if (s->fsize / s->blocksz + 1 > NFTP_BLOCK_NUM) {
+		nftp_log("File is too large (MAXSIZE: %dKB).",
+		    (s->blocksz * NFTP_BLOCK_NUM / 1024));
+		fclose(s->fp);
+		s->fp = NULL;
+		return (NFTP_ERR_OVERFLOW);
+	}
+
+	memset(s->hdr, 0, NFTP_FILE_HDRLEN);
+	s->hdr[0] = NFTP_TYPE_FILE;
+	nftp_put_u32(s->hdr + 5, fileid);
+	return (0);
+}
+
+int
+nftp_sender_fini(nftp_sender *s)
+{
+	if (!s) return (NFTP_ERR_EMPTY);
+	if (s->fp)
+		fclose(s->fp);
+	s->fp = NULL;
+	return (0);
+}
+
+size_t
+nftp_sender_size(nftp_sender *s, int n)
+{
+	size_t ctlen;
+
+	if (!s || n < 0 || (uint32_t)n >= s->blocks) return (0);
+	if ((uint32_t)n == s->blocks - 1)
+		ctlen = s->fsize - (size_t)n * s->blocksz;
+	else
+		ctlen = s->blocksz;
+	return NFTP_FILE_HDRLEN + ctlen +
+	    (s->flags & NFTP_FLAG_BLKCRC ? 4 : 0);
+}
+
+int
+nftp_sender_encode(nftp_sender *s, int n, uint8_t *buf, size_t cap, size_t *lenp)
+{
+	size_t   len, ctlen;
+	uint32_t crc, fileid;
+
+	if (!s || !s->fp || !buf) return (NFTP_ERR_EMPTY);
+	if ((len = nftp_sender_size(s, n)) == 0) return (NFTP_ERR_BLOCKS);
+	if (len > cap) return (NFTP_ERR_OVERFLOW);
+	ctlen = len - NFTP_FILE_HDRLEN - (s->flags & NFTP_FLAG_BLKCRC ? 4 : 0);
+
+	memcpy(buf, s->hdr, NFTP_FILE_HDRLEN);
+	if ((uint32_t)n == s->blocks - 1)
+		buf[0] = NFTP_TYPE_END;
+	nftp_put_u32(buf + 1, len);
+	nftp_put_u16(buf + 9, n);
+	nftp_put_u32(buf + 11, ctlen);
+
+	if (0 != fseek(s->fp, (long)n * s->blocksz, SEEK_SET) ||
+	    ctlen != fread(buf + NFTP_FILE_HDRLEN, 1, ctlen, s->fp))
+		return (NFTP_ERR_FILERD);
+
+	if (s->flags & NFTP_FLAG_BLKCRC) {
+		crc = nftp_crc32c(buf + NFTP_FILE_HDRLEN, ctlen);
+		nftp_put_u32(buf + NFTP_FILE_HDRLEN + ctlen, crc);
+	}
+	// Same as nftp_proto_send_stop after END of nftp_proto_maker
+	if (buf[0] == NFTP_TYPE_END) {
+		nftp_get_u32(s->hdr + 5, fileid);
+		sendcs_drop(fileid);
+	}
+	if (lenp)
+		*lenp = len;
+	return (0);
+}
+
+int
+nftp_sender_maker(nftp_sender *s, int n, char **rmsg, int *rlen)
+{
+	int    rv;
+	size_t len;
+	char * v;
+
+	if (!s || !rmsg || !rlen) return (NFTP_ERR_EMPTY);
+	if ((len = nftp_sender_size(s, n)) == 0) return (NFTP_ERR_BLOCKS);
+	if ((v = malloc(len)) == NULL) return (NFTP_ERR_MEM);
+	if (0 != (rv = nftp_sender_encode(s, n, (uint8_t *)v, len, NULL))) {
+		free(v);
+		return rv;
+	}
+	*rmsg = v;
+	*rlen = len;
+	return (0);
+}
+
+int
+nftp_proto_maker_giveme(char *fname, char **rmsg, int *rlen)
+{
+	int          rv;
+	struct nctx *ctx;
+	uint32_t     fileid;
+	size_t       nbits, nbytes, len;
+	uint8_t *    bm;
+	nftp         msg;
+
+	/* Remove '.','/',etc */
+	if ((fname = nftp_file_bname(fname)) == NULL)
+		return (NFTP_ERR_FILENAME);
+
+	fileid = NFTP_HASH((uint8_t *)fname, strlen(fname));
+	free(fname);
+
+	if (!ht_contains(&files, &fileid)) {
+		nftp_log("Not found fileid [%d]", fileid);
+		return NFTP_ERR_HT;
+	}
+	ctx = *((struct nctx **)ht_lookup(&files, &fileid));
+
+	// All the blocks before nextid are received
+	nbits = ctx->cap - ctx->nextid;
+	if (nftp_bitmap_count(ctx->recvd, ctx->cap) == (size_t)ctx->cap)
+		return (NFTP_ERR_EMPTY);
+
+	nbytes = (nbits + 7) / 8;
+	if ((bm = malloc(nbytes)) == NULL)
+		return (NFTP_ERR_MEM);
+	nftp_bitmap_invert(bm, ctx->recvd, ctx->nextid, nbits);
+	while (nbytes > 0 && bm[nbytes - 1] == 0)
+		nbytes --;
+
+	nftp_init(&msg);
+	msg.type     = NFTP_TYPE_GIVEME;
+	msg.fileid   = fileid;
+	msg.blockseq = ctx->nextid;
+	// Only the first one, keep it readable for senders of v1
+	if (!(nbytes == 1 && bm[0] == 0x01)) {
+		msg.content = bm;
+		msg.ctlen   = nbytes;
+	}
+	rv = nftp_encode(&msg, (uint8_t **)rmsg, &len);
+	*rlen = len;
+
+	msg.content = NULL;
+	nftp_fini(&msg);
+	free(bm);
+	return rv;
+}
+
+int
+nftp_proto_maker_batch(char *fpath, int n, int cnt, nftp_batch *b)
+{
+	int       rv;
+	char *    fname;
+	size_t    len, blocks, off = 0, blksz = nftp_get_blocksz();
+	size_t    hdrlen = NFTP_FILE_HDRLEN + (blockcrc ? 4 : 0);
+	uint32_t  fileid;
+	uint32_t *crcs = NULL;
+	uint8_t * hdr;
+
+	if (NULL == fpath) return (NFTP_ERR_FILEPATH);
+	if (NULL == b || 0 > n || 0 >= cnt) return (NFTP_ERR_ID);
+	if ((fname = nftp_file_bname(fpath)) == NULL)
+		return (NFTP_ERR_FILEPATH);
+	fileid = NFTP_HASH((const uint8_t *)fname, (size_t)strlen(fname));
+	free(fname);
+
+	if (0 != (rv = nftp_file_blocks(fpath, &blocks)))
+		return rv;
+	if (blockcrc && (crcs = malloc(cnt * sizeof(uint32_t))) == NULL)
+		return (NFTP_ERR_MEM);
+	// Block CRCs are computed in the pass of reading
+	if (0 != (rv = nftp_file_readblks(fpath, n, &cnt, &b->data, &len, crcs))) {
+		free(crcs);
+		return rv;
+	}
+
+	b->stride = blockcrc ? 3 : 2;
+	b->hdrs   = malloc(cnt * hdrlen);
+	b->iov    = malloc(b->stride * cnt * sizeof(struct iovec));
+	if (b->hdrs == NULL || b->iov == NULL) {
+		free(b->hdrs);
+		free(b->iov);
+		free(b->data);
+		free(crcs);
+		return (NFTP_ERR_MEM);
+	}
+	b->cnt    = cnt;
+	b->iovcnt = b->stride * cnt;
+
+	for (int i = 0; i < cnt; ++i) {
+		size_t        ctlen = len - off < blksz ? len - off : blksz;
+		int           seq   = n + i;
+		struct iovec *iov   = b->iov + b->stride * i;
+
+		hdr = b->hdrs + i * hdrlen;
+		hdr[0] = (size_t)seq == blocks - 1 ? NFTP_TYPE_END : NFTP_TYPE_FILE;
+		nftp_put_u32(hdr + 1, hdrlen + ctlen);
+		nftp_put_u32(hdr + 5, fileid);
+		nftp_put_u16(hdr + 9, seq);
+		nftp_put_u32(hdr + 11, ctlen);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len  = NFTP_FILE_HDRLEN;
+		iov[1].iov_base = b->data + off;
+		iov[1].iov_len  = ctlen;
+		if (blockcrc) {
+			// The trailer is kept behind the header in slab
+			nftp_put_u32(hdr + NFTP_FILE_HDRLEN, crcs[i]);
+			iov[2].iov_base = hdr + NFTP_FILE_HDRLEN;
+			iov[2].iov_len  = 4;
+		}
+		off += ctlen;
+	}
+	free(crcs);
+
+	if ((size_t)(n + cnt) == blocks) {
+		nftp_proto_send_stop(fpath);
+	}
+	return (0);
+}
+
+int
+nftp_batch_free(nftp_batch *b)
+{
+	if (NULL == b) return (NFTP_ERR_EMPTY);
+
+	free(b->iov);
+	free(b->hdrs);
+	free(b->data);
+	b->iov  = NULL;
+	b->hdrs = NULL;
+	b->data = NULL;
+	b->iovcnt = b->cnt = b->stride = 0;
+	return (0);
+}
+
+// Track crc32c of the part file, so the file needn't be rehashed in the
+// end if all the blocks have Block CRC.
+static void
+nctx_append_crc(struct nctx *ctx, uint8_t flags, uint32_t crc, size_t len)
+{
+	if (flags & NFTP_FLAG_BLKCRC)
+		ctx->filecrc = nftp_crc32c_combine(ctx->filecrc, crc, len);
+	else
+		ctx->crcall = 0;
+}
+
+// A block was broken in transferring, ask it again
+static int
+blkcrc_reject(nftp_view *v, char **rmsg, int *rlen)
+{
+	nftp   msg;
+	size_t len;
+
+	nftp_log("Block CRC mismatch [%d:%d]", v->fileid, v->blockseq);
+	nftp_init(&msg);
+	msg.type     = NFTP_TYPE_GIVEME;
+	msg.fileid   = v->fileid;
+	msg.blockseq = v->blockseq;
+	if (0 == nftp_encode(&msg, (uint8_t **)rmsg, &len))
+		*rlen = len;
+	return (NFTP_ERR_HASH);
+}
+
+// Move the msgs of batch b to the tail of iovs without copy. Headers and
+// payloads are wrapped in nftp_buf, and each iov holds a ref of its own.
+static int
+batch_to_iovs(nftp_batch *b, nftp_iovs *iovs)
+{
+	nftp_buf *hb = NULL, *db = NULL;
+	size_t    hlen = 0, dlen = 0;
+	uint8_t * base;
+	int       rv = 0;
+
+	for (int k = 0; k < b->iovcnt; ++k) {
+		if (k % b->stride == 1)
+			dlen += b->iov[k].iov_len;
+		else
+			hlen += b->iov[k].iov_len;
+	}
+	if (0 != nftp_buf_wrap(&hb, b->hdrs, hlen, free) ||
+	    0 != nftp_buf_wrap(&db, b->data, dlen, free)) {
+		free(hb);
+		nftp_batch_free(b);
+		return (NFTP_ERR_MEM);
+	}
+	b->hdrs = NULL;
+	b->data = NULL;
+
+	for (int k = 0; k < b->iovcnt && 0 == rv; ++k) {
+		nftp_buf *buf = k % b->stride == 1 ? db : hb;
+
+		base = buf->data;
+		rv = nftp_iovs_push_buf(iovs, buf,
+		    (uint8_t *)b->iov[k].iov_base - base, b->iov[k].iov_len,
+		    NFTP_TAIL);
+	}
+	nftp_buf_unref(hb);
+	nftp_buf_unref(db);
+	nftp_batch_free(b);
+	return rv;
+}
+
+// Make the msgs of all blocks asked by the bitmap of GIVEME, a batch for
+// each run of blocks. They are appended back to back to iovs. A run past
+// the end of file is cut at the last block.
+static int
+giveme_bitmap(char *fpath, nftp_view *v, size_t blocks, nftp_iovs *iovs)
+{
+	int        rv = 0;
+	size_t     nbits = v->ctlen * 8, nruns, start, cnt;
+	nftp_run * runs;
+	nftp_batch b;
+
+	if ((runs = malloc(sizeof(nftp_run) * (nbits / 2 + 1))) == NULL)
+		return (NFTP_ERR_MEM);
+	nruns = nftp_bitmap_runs(v->content, nbits, runs, nbits / 2 + 1);
+
+	for (size_t i = 0; i < nruns; ++i) {
+		start = v->blockseq + runs[i].start;
+		if (start >= blocks)
+			break;
+		cnt = runs[i].len < blocks - start ? runs[i].len : blocks - start;
+		if (0 != (rv = nftp_proto_maker_batch(fpath, start, cnt, &b)))
+			break;
+		if (0 != (rv = batch_to_iovs(&b, iovs)))
+			break;
+	}
+	free(runs);
+	return rv;
+}
+
 // Passing the msg encoded in nftp protocol, Don't worry if
 // the msg is not comply with the nftp protocol, nftp will
 // ignore it.
-int
-nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
+static int
+proto_handler(char *msg, int len, char **rmsg, int *rlen, nftp_iovs *riovs)
 {
 	int             rv       = 0;
-	uint32_t        hashcode = 0;
-	nftp *          n;
+	uint64_t        hashcode = 0;
+	nftp_view       v;
+	char            fname[NFTP_FNAME_LEN + 1];
 	struct nctx *   ctx = NULL;
 	struct file_cb *fcb = NULL;
-	nftp_iter *     iter = NULL;
 	char            partname[NFTP_FNAME_LEN + 8];
 	char            fullpath[NFTP_FNAME_LEN + NFTP_FDIR_LEN];
 	char            fullpath2[NFTP_FNAME_LEN + NFTP_FDIR_LEN];
 	size_t          blocks;
-
-	if (0 != (rv = nftp_alloc(&n))) return rv;
+	char *          body;
 
 	// Set default return value
 	*rmsg = NULL;
 	*rlen = 0;
 
-	if (0 != (rv = nftp_decode(n, (uint8_t *)msg, len))) {
-		nftp_free(n);
-		return rv;
+	// Decode in place, content is copied only when it has to be kept
+	if (len >= 2 && ((uint8_t)msg[0] & NFTP_TYPE_COMPACT)) {
+		if ((ctx = recvcs[(uint8_t)msg[1]]) == NULL) {
+			nftp_fatal("Not found sid [%d]", (uint8_t)msg[1]);
+			return (NFTP_ERR_HT);
+		}
+		rv = nftp_decode_compact(&v, &ctx->cs, (uint8_t *)msg, len);
+	} else {
+		rv = nftp_decode_view(&v, (uint8_t *)msg, len);
 	}
+	if (0 != rv)
+		return rv;
+	if (v.namelen > NFTP_FNAME_LEN)
+		return (NFTP_ERR_FILENAME);
+	if (v.fname) memcpy(fname, v.fname, v.namelen);
+	fname[v.namelen] = '\0';
 
-	switch (n->type) {
+	switch (v.type) {
 	case NFTP_TYPE_HELLO:
-		ctx = nctx_alloc(n->blocks);
-		ctx->fileid = NFTP_HASH((const uint8_t *)n->fname,
-		        strlen(n->fname));
-		ctx->hashcode = n->hashcode;
+		ctx = nctx_alloc(v.blocks);
+		ctx->fileid = NFTP_HASH(v.fname, v.namelen);
+		ctx->hashid = v.hashid;
+		ctx->hashcode = v.hashcode;
 
-		if (ht_contains(&files, &n->fileid)) {
-			nftp_fatal("File with same fileid is processing [%d][%s]", n->fileid, n->fname);
+		if (ht_contains(&files, &v.fileid)) {
+			nftp_fatal("File with same fileid is processing [%d][%s]", v.fileid, fname);
 			nctx_free(ctx);
-			nftp_free(n);
 			return NFTP_ERR_HT;
 		}
 
-		iter = nftp_iter_alloc(NFTP_SCHEMA_VEC, fcb_reg);
-		nftp_iter_next(iter);
-		while (iter->key != NFTP_TAIL) {
-			fcb = iter->val;
-			if (0 == strcmp(fcb->fname, n->fname))
+		NFTP_VEC_FOREACH(fcb_reg, i, fcb) {
+			if (0 == strcmp(fcb->fname, fname))
 				ctx->fcb = fcb;
-			nftp_iter_next(iter);
 		}
-		nftp_iter_free(iter);
 
 		if (NULL == ctx->fcb) {
-			nftp_log("Set default callback for file [%s]", n->fname);
+			nftp_log("Set default callback for file [%s]", fname);
 			nftp_vec_get(fcb_reg, 0, (void **)&fcb);
 			ctx->fcb = fcb;
-			nftp_proto_register(n->fname, fcb->cb, fcb->arg);
+			nftp_proto_register(fname, fcb->cb, fcb->arg);
 		}
 
-		nftp_file_fullpath(fullpath, recvdir, n->fname);
+		nftp_file_fullpath(fullpath, recvdir, fname);
 		if (nftp_file_exist(fullpath)) {
-			nftp_file_newname(n->fname, &ctx->wfname, recvdir);
+			nftp_file_newname(fname, &ctx->wfname, recvdir);
 			nftp_log("File [%s] exists, recver would save to [%s]",
-			        n->fname, ctx->wfname);
+			        fname, ctx->wfname);
 		} else {
-			if ((ctx->wfname = malloc(n->namelen+1)) == NULL) {
-				nftp_free(n);
+			if ((ctx->wfname = malloc(v.namelen+1)) == NULL)
 				return (NFTP_ERR_MEM);
-			}
-			strcpy(ctx->wfname, n->fname);
+			strcpy(ctx->wfname, fname);
 		}
 		nftp_file_partname(partname, ctx->wfname);
 		nftp_file_fullpath(fullpath, recvdir, partname);
 		if (0 != (rv = nftp_file_write(fullpath, "", 0))) { // create file
 			nftp_fatal("File write failed [%s]", fullpath);
-			nftp_free(n);
 			return rv;
 		}
 
 		if (0 != (rv = ht_insert(&files, &ctx->fileid, &ctx))) {
 			nftp_fatal("Error in hash");
-			nftp_free(n);
 			return (NFTP_ERR_HT);
 		}
 		ctx->status = NFTP_STATUS_HELLO;
 
-		nftp_proto_maker(n->fname, NFTP_TYPE_ACK, n->id, 0, rmsg, rlen);
+		// Give a sid if sender could speak compact
+		if (v.opts & NFTP_OPT_COMPACT) {
+			for (int i = 1; i < 256; ++i)
+				if (recvcs[i] == NULL) {
+					recvcs[i] = ctx;
+					nftp_compact_init(&ctx->cs, i, ctx->fileid);
+					break;
+				}
+		}
+
+		nftp_proto_maker(fname, NFTP_TYPE_ACK, v.id, ctx->cs.sid, rmsg, rlen);
 		break;
 
 	case NFTP_TYPE_ACK:
 		// TODO return An Iterator
+		if (v.sid && compact) {
+			sendcs_drop(v.fileid);
+			nftp_compact_init(&sendcs[v.sid], v.sid, v.fileid);
+		}
 		break;
 
 	case NFTP_TYPE_FILE:
 	case NFTP_TYPE_END:
-		if (!ht_contains(&files, &n->fileid)) {
-			nftp_fatal("Not found fileid [%d]", n->fileid);
-			nftp_free(n);
+		if (!ht_contains(&files, &v.fileid)) {
+			nftp_fatal("Not found fileid [%d]", v.fileid);
 			return NFTP_ERR_HT;
 		}
-		ctx = *((struct nctx **)ht_lookup(&files, &n->fileid));
+		ctx = *((struct nctx **)ht_lookup(&files, &v.fileid));
+		if (v.blockseq >= ctx->cap) {
+			nftp_fatal("Invalid blockseq [%d/%d]", v.blockseq, ctx->cap);
+			return (NFTP_ERR_BLOCKS);
+		}
 
 		nftp_file_partname(partname, ctx->wfname);
 		nftp_file_fullpath(fullpath, recvdir, partname);
 
-		if (n->blockseq == ctx->nextid) {
-			rv = nftp_file_append(fullpath, (char *)n->content, n->ctlen);
+		if (v.blockseq == ctx->nextid) {
+			// Verify in the pass of copy to the buffer appended
+			body = (char *)v.content;
+			if (v.flags & NFTP_FLAG_BLKCRC) {
+				if ((body = malloc(v.ctlen)) == NULL)
+					return (NFTP_ERR_MEM);
+				if (v.blkcrc != nftp_crc32c_copy((uint8_t *)body,
+				        v.content, v.ctlen)) {
+					free(body);
+					return blkcrc_reject(&v, rmsg, rlen);
+				}
+			}
+			rv = nftp_file_append(fullpath, body, v.ctlen);
+			if (body != (char *)v.content)
+				free(body);
 			if (0 != rv) {
 				nftp_fatal("Error in file append [%s]", fullpath);
-				nftp_free(n);
 				return rv;
 			}
+			nctx_append_crc(ctx, v.flags, v.blkcrc, v.ctlen);
 			do {
 				ctx->nextid ++;
 				if ((ctx->nextid > ctx->cap-1) ||
@@ -513,31 +959,46 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 				        ctx->entries[ctx->nextid].len);
 				if (0 != rv) {
 					nftp_fatal("Error in file append [%s]", fullpath);
-					nftp_free(n);
 					return rv;
 				}
+				nctx_append_crc(ctx, ctx->entries[ctx->nextid].flags,
+				        ctx->entries[ctx->nextid].crc,
+				        ctx->entries[ctx->nextid].len);
 				free(ctx->entries[ctx->nextid].body);
 				ctx->entries[ctx->nextid].body = NULL;
 				ctx->entries[ctx->nextid].len  = 0;
 			} while (1);
 		} else {
-			// Just store it
-			if (ctx->entries[n->blockseq].len != 0 &&
-			    ctx->entries[n->blockseq].body != NULL) {
-				free(ctx->entries[n->blockseq].body);
+			// Just store it, verify in the pass of copy
+			if ((body = malloc(v.ctlen)) == NULL)
+				return (NFTP_ERR_MEM);
+			if (v.flags & NFTP_FLAG_BLKCRC) {
+				if (v.blkcrc != nftp_crc32c_copy((uint8_t *)body,
+				        v.content, v.ctlen)) {
+					free(body);
+					return blkcrc_reject(&v, rmsg, rlen);
+				}
+			} else {
+				memcpy(body, v.content, v.ctlen);
+			}
+			if (ctx->entries[v.blockseq].len != 0 &&
+			    ctx->entries[v.blockseq].body != NULL) {
+				free(ctx->entries[v.blockseq].body);
 				ctx->len --; // replace rather than add
 			}
-			ctx->entries[n->blockseq].len = n->ctlen;
-			ctx->entries[n->blockseq].body = (char *)n->content;
-			n->content = NULL; // avoid be free
+			ctx->entries[v.blockseq].len = v.ctlen;
+			ctx->entries[v.blockseq].body = body;
+			ctx->entries[v.blockseq].flags = v.flags;
+			ctx->entries[v.blockseq].crc = v.blkcrc;
 		}
 
 		ctx->len ++;
+		ctx->recvd[v.blockseq / 8] |= 1u << (v.blockseq % 8);
 		//nftp_log("Process(recv) [%s]:[%d/%d]",
 		//	ctx->wfname, ctx->nextid, ctx->cap);
 
-		if (n->type == NFTP_TYPE_FILE) ctx->status = NFTP_STATUS_TRANSFER;
-		if (n->type == NFTP_TYPE_END) ctx->status = NFTP_STATUS_END;
+		if (v.type == NFTP_TYPE_FILE) ctx->status = NFTP_STATUS_TRANSFER;
+		if (v.type == NFTP_TYPE_END) ctx->status = NFTP_STATUS_END;
 
 		// Recved finished
 		if (ctx->nextid == ctx->cap) {
@@ -547,21 +1008,21 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 			rv = nftp_file_rename(fullpath, fullpath2);
 			if (0 != rv) {
 				nftp_fatal("Error happened in file rename [%s].", fullpath);
-				nftp_free(n);
 				return rv;
 			}
 			*rmsg = strdup(ctx->wfname);
 			*rlen = strlen(ctx->wfname);
 			// hash check
-			rv = nftp_file_hash(fullpath2, &hashcode);
+			if (ctx->hashid == NFTP_HASH_CRC32C && ctx->crcall)
+				hashcode = ctx->filecrc;
+			else
+				rv = nftp_file_digest(fullpath2, ctx->hashid, &hashcode);
 			if (0 != rv) {
 				nftp_fatal("Error happened in file hash [%s].", fullpath2);
-				nftp_free(n);
 				return rv;
 			}
 			if (ctx->hashcode != hashcode) {
 				nftp_log("Hash check failed [%s].", ctx->wfname);
-				nftp_free(n);
 				return (NFTP_ERR_PROTO);
 			} else {
 				nftp_log("Hash check passed [%s].", ctx->wfname);
@@ -576,15 +1037,15 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 			if (ctx->fcb->cb)
 				ctx->fcb->cb(ctx->fcb->arg);
 
-			// Free resource
-			for (int i=0; i<nftp_vec_len(fcb_reg); ++i)
-				if (0 == nftp_vec_get(fcb_reg, i, (void **)&fcb))
-					if (ctx->fcb == fcb) {
-						if (i == 0)
-							goto next;
-						nftp_vec_delete(fcb_reg, (void **)&fcb, i);
-						break;
-					}
+			// Free resource. fcb_reg must not change in the loop, so
+			// it breaks right after the delete.
+			NFTP_VEC_FOREACH(fcb_reg, i, fcb)
+				if (ctx->fcb == fcb) {
+					if (i == 0)
+						goto next;
+					nftp_vec_delete(fcb_reg, (void **)&fcb, i);
+					break;
+				}
 
 			free(ctx->fcb->fname);
 			free(ctx->fcb);
@@ -592,7 +1053,6 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 		next:
 			if (0 != (rv = ht_erase(&files, &ctx->fileid))) {
 				nftp_fatal("Not find the key [%d] in hashtable.", ctx->fileid);
-				nftp_free(n);
 				return (NFTP_ERR_HT);
 			}
 			nctx_free(ctx);
@@ -600,24 +1060,25 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 		break;
 
 	case NFTP_TYPE_GIVEME:
-		if (!ht_contains(&senderfiles, &n->fileid)) {
-			nftp_fatal("Not found fileid [%d][%s]", n->fileid, n->fname);
-			nftp_free(n);
+		if (!ht_contains(&senderfiles, &v.fileid)) {
+			nftp_fatal("Not found fileid [%d][%s]", v.fileid, fname);
 			return NFTP_ERR_HT;
 		}
 
-		strcpy(fullpath, (char *)ht_lookup(&senderfiles, &n->fileid));
+		strcpy(fullpath, (char *)ht_lookup(&senderfiles, &v.fileid));
 
 		if ((rv = nftp_file_blocks(fullpath, &blocks)) != 0) {
 			nftp_fatal("Error in reading blocks [%s]", fullpath);
-			nftp_free(n);
 			return rv;
 		}
 
-		if (n->blockseq == blocks-1)
-			nftp_proto_maker(fullpath, NFTP_TYPE_END, n->fileid, n->blockseq, rmsg, rlen);
+		if (v.ctlen > 0)
+			return giveme_bitmap(fullpath, &v, blocks, riovs);
+
+		if (v.blockseq == blocks-1)
+			nftp_proto_maker(fullpath, NFTP_TYPE_END, v.fileid, v.blockseq, rmsg, rlen);
 		else
-			nftp_proto_maker(fullpath, NFTP_TYPE_FILE, n->fileid, n->blockseq, rmsg, rlen);
+			nftp_proto_maker(fullpath, NFTP_TYPE_FILE, v.fileid, v.blockseq, rmsg, rlen);
 
 		break;
 
@@ -625,11 +1086,48 @@ nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
 		nftp_fatal("NOT SUPPORTED");
 		break;
 	}
-	nftp_free(n);
 
 	return (0);
 }
 
+int
+nftp_proto_handler(char *msg, int len, char **rmsg, int *rlen)
+{
+	nftp_iovs iovs;
+	uint8_t * v;
+	size_t    sz;
+	int       rv;
+
+	nftp_iovs_init(&iovs);
+	rv = proto_handler(msg, len, rmsg, rlen, &iovs);
+	// Replies of GIVEME with bitmap are flattened only here
+	if (0 == rv && nftp_iovs_iolen(&iovs) > 0) {
+		if (0 == (rv = nftp_iovs2stream(&iovs, &v, &sz))) {
+			*rmsg = (char *)v;
+			*rlen = sz;
+		}
+	}
+	nftp_iovs_fini(&iovs);
+	return rv;
+}
+
+int
+nftp_proto_handler_iovs(char *msg, int len, nftp_iovs *riovs)
+{
+	char *r = NULL;
+	int   rlen = 0, rv, rv2;
+
+	if (NULL == riovs) return (NFTP_ERR_EMPTY);
+	rv = proto_handler(msg, len, &r, &rlen, riovs);
+	// A reply may come with an error, like the GIVEME of NFTP_ERR_HASH
+	if (NULL != r &&
+	    0 != (rv2 = nftp_iovs_push_cb(riovs, r, rlen, NFTP_TAIL, free, r))) {
+		free(r);
+		rv = rv2;
+	}
+	return rv;
+}
+
 // nftp_proto_register function is used to determine the files
 // to to received. Only the msg with fileid registered would
 // be handled. When all the msgs marked with a fileid are
@@ -761,6 +1259,47 @@ nftp_get_blocksz()
 	return blocksz;
 }
 
+int
+nftp_set_hash(int hashid)
+{
+	if (NULL == nftp_hash_engine_get(hashid))
+		return (NFTP_ERR_HASH);
+	sendhash = hashid;
+	return (0);
+}
+
+int
+nftp_get_hash()
+{
+	return sendhash;
+}
+
+int
+nftp_set_compact(int on)
+{
+	compact = !!on;
+	return (0);
+}
+
+int
+nftp_get_compact()
+{
+	return compact;
+}
+
+int
+nftp_set_blockcrc(int on)
+{
+	blockcrc = !!on;
+	return (0);
+}
+
+int
+nftp_get_blockcrc()
+{
+	return blockcrc;
+}
+
 int
 test()
 {
@@ -0,0 +1,299 @@
+// Author: wangha <wangha at emqx dot io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nftp.h"
+
+#define NFTP_CACHELINE 64
+
+#define load_acq(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define load_rlx(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_rel(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// Indexes only grow and are masked into the ring. Head and tail are kept
+// a cache line apart from each other, so producer and consumer never
+// write the same line.
+struct _spsc {
+	void ** ring;
+	size_t  mask;
+	char    pad0[NFTP_CACHELINE];
+	size_t  head;  // Written by consumer
+	size_t  tailc; // Tail seen by consumer last time
+	char    pad1[NFTP_CACHELINE];
+	size_t  tail;  // Written by producer
+	size_t  headc; // Head seen by producer last time
+	char    pad2[NFTP_CACHELINE];
+};
+
+// Bounded MPMC queue. Each cell has a seq telling whose turn it is, so
+// producers and consumers only contend on claiming positions.
+struct mpmc_cell {
+	size_t seq;
+	void * data;
+};
+
+struct _mpmc {
+	struct mpmc_cell *cells;
+	size_t            mask;
+	char              pad0[NFTP_CACHELINE];
+	size_t            tail; // Next position to enqueue
+	char              pad1[NFTP_CACHELINE];
+	size_t            head; // Next position to dequeue
+	char              pad2[NFTP_CACHELINE];
+};
+
+static size_t
+roundup_pow2(int sz)
+{
+	size_t n = 2;
+
+	if (sz <= 0)
+		sz = NFTP_SIZE;
+	while (n < (size_t)sz)
+		n <<= 1;
+	return n;
+}
+
+int
+nftp_spsc_alloc(nftp_spsc **qp, int sz)
+{
+	nftp_spsc *q;
+	size_t     cap = roundup_pow2(sz);
+
+	if ((q = malloc(sizeof(*q))) == NULL)
+		return (NFTP_ERR_MEM);
+	memset(q, 0, sizeof(*q));
+	if ((q->ring = malloc(sizeof(void *) * cap)) == NULL) {
+		free(q);
+		return (NFTP_ERR_MEM);
+	}
+	q->mask = cap - 1;
+
+	*qp = q;
+	return (0);
+}
+
+int
+nftp_spsc_free(nftp_spsc *q)
+{
+	if (!q) return (NFTP_ERR_VEC);
+	free(q->ring);
+	free(q);
+	return (0);
+}
+
+int
+nftp_spsc_push_n(nftp_spsc *q, void **entries, int n, int *cntp)
+{
+	size_t tail = q->tail, room;
+
+	if (n <= 0) return (NFTP_ERR_OVERFLOW);
+
+	room = q->mask + 1 - (tail - q->headc);
+	if (room < (size_t)n) {
+		q->headc = load_acq(&q->head);
+		room = q->mask + 1 - (tail - q->headc);
+		if (room == 0)
+			return (NFTP_ERR_OVERFLOW);
+	}
+	if ((size_t)n > room)
+		n = room;
+
+	for (int i = 0; i < n; ++i)
+		q->ring[(tail + i) & q->mask] = entries[i];
+	store_rel(&q->tail, tail + n);
+
+	if (cntp)
+		*cntp = n;
+	return (0);
+}
+
+int
+nftp_spsc_pop_n(nftp_spsc *q, void **entries, int n, int *cntp)
+{
+	size_t head = q->head, cnt;
+
+	if (n <= 0) return (NFTP_ERR_EMPTY);
+
+	cnt = q->tailc - head;
+	if (cnt < (size_t)n) {
+		q->tailc = load_acq(&q->tail);
+		cnt = q->tailc - head;
+		if (cnt == 0)
+			return (NFTP_ERR_EMPTY);
+	}
+	if ((size_t)n > cnt)
+		n = cnt;
+
+	for (int i = 0; i < n; ++i)
+		entries[i] = q->ring[(head + i) & q->mask];
+	store_rel(&q->head, head + n);
+
+	if (cntp)
+		*cntp = n;
+	return (0);
+}
+
+int
+nftp_spsc_push(nftp_spsc *q, void *entry)
+{
+	return nftp_spsc_push_n(q, &entry, 1, NULL);
+}
+
+int
+nftp_spsc_pop(nftp_spsc *q, void **entryp)
+{
+	return nftp_spsc_pop_n(q, entryp, 1, NULL);
+}
+
+int
+nftp_spsc_len(nftp_spsc *q)
+{
+	return load_acq(&q->tail) - load_acq(&q->head);
+}
+
+int
+nftp_spsc_cap(nftp_spsc *q)
+{
+	return q->mask + 1;
+}
+
+int
+nftp_mpmc_alloc(nftp_mpmc **qp, int sz)
+{
+	nftp_mpmc *q;
+	size_t     cap = roundup_pow2(sz);
+
+	if ((q = malloc(sizeof(*q))) == NULL)
+		return (NFTP_ERR_MEM);
+	memset(q, 0, sizeof(*q));
+	if ((q->cells = malloc(sizeof(struct mpmc_cell) * cap)) == NULL) {
+		free(q);
+		return (NFTP_ERR_MEM);
+	}
+	for (size_t i = 0; i < cap; ++i) {
+		q->cells[i].seq  = i;
+		q->cells[i].data = NULL;
+	}
+	q->mask = cap - 1;
+
+	*qp = q;
+	return (0);
+}
+
+int
+nftp_mpmc_free(nftp_mpmc *q)
+{
+	if (!q) return (NFTP_ERR_VEC);
+	free(q->cells);
+	free(q);
+	return (0);
+}
+
+// Claim up to n cells from position idx, a cell is ready if its seq
+// is pos + off. A ready cell stays ready until its position is claimed,
+// so once the CAS on idx succeeds, the ready prefix checked is ours.
+static size_t
+mpmc_claim(nftp_mpmc *q, size_t *idx, size_t n, size_t off, size_t *posp)
+{
+	size_t   pos = load_rlx(idx), k;
+	intptr_t diff = 0;
+
+	for (;;) {
+		for (k = 0; k < n; ++k) {
+			struct mpmc_cell *c = &q->cells[(pos + k) & q->mask];
+			diff = (intptr_t)(load_acq(&c->seq) - (pos + k + off));
+			if (diff != 0)
+				break;
+		}
+		if (k == 0) {
+			if (diff < 0)
+				return 0; // Full or empty
+			pos = load_rlx(idx);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(idx, &pos, pos + k, 1,
+		        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	*posp = pos;
+	return k;
+}
+
+int
+nftp_mpmc_push_n(nftp_mpmc *q, void **entries, int n, int *cntp)
+{
+	struct mpmc_cell *c;
+	size_t            pos, k;
+
+	if (n <= 0) return (NFTP_ERR_OVERFLOW);
+
+	if ((k = mpmc_claim(q, &q->tail, n, 0, &pos)) == 0)
+		return (NFTP_ERR_OVERFLOW);
+	for (size_t i = 0; i < k; ++i) {
+		c = &q->cells[(pos + i) & q->mask];
+		c->data = entries[i];
+		store_rel(&c->seq, pos + i + 1);
+	}
+
+	if (cntp)
+		*cntp = k;
+	return (0);
+}
+
+int
+nftp_mpmc_pop_n(nftp_mpmc *q, void **entries, int n, int *cntp)
+{
+	struct mpmc_cell *c;
+	size_t            pos, k;
+
+	if (n <= 0) return (NFTP_ERR_EMPTY);
+
+	if ((k = mpmc_claim(q, &q->head, n, 1, &pos)) == 0)
+		return (NFTP_ERR_EMPTY);
+	for (size_t i = 0; i < k; ++i) {
+		c = &q->cells[(pos + i) & q->mask];
+		entries[i] = c->data;
+		// Ready for the producer of next lap
+		store_rel(&c->seq, pos + i + q->mask + 1);
+	}
+
+	if (cntp)
+		*cntp = k;
+	return (0);
+}
+
+int
+nftp_mpmc_push(nftp_mpmc *q, void *entry)
+{
+	return nftp_mpmc_push_n(q, &entry, 1, NULL);
+}
+
+int
+nftp_mpmc_pop(nftp_mpmc *q, void **entryp)
+{
+	return nftp_mpmc_pop_n(q, entryp, 1, NULL);
+}
+
+// Only a snapshot when others are running
+int
+nftp_mpmc_len(nftp_mpmc *q)
+{
+	size_t head = load_acq(&q->head), tail = load_acq(&q->tail);
+
+	return tail > head ? (int)(tail - head) : 0;
+}
+
+int
+nftp_mpmc_cap(nftp_mpmc *q)
+{
+	return q->mask + 1;
+}
@@ -9,25 +9,51 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "nftp.h"
 
-struct _vec {
-	int             cap; // capicity
-	int             len; // number of elements
-	int             low; // elements stored from here
-	void          **vec;
-	pthread_mutex_t mtx;
-};
+static inline void
+vec_lock(nftp_vec *v)
+{
+	if (!v->nolock)
+		pthread_mutex_lock(&v->mtx);
+}
+
+static inline void
+vec_unlock(nftp_vec *v)
+{
+	if (!v->nolock)
+		pthread_mutex_unlock(&v->mtx);
+}
 
-/*
+// Make room for n more elements. Capacity is doubled and the ring is
+// unrolled from cap/4 of the new one, so pushes are amortized O(1).
+// Call with mtx held.
 static int
-resize(nftp_vec *v) // TODO
+resize(nftp_vec *v, int n)
 {
-	(void) v;
+	void **nv;
+	int    cap = v->cap, low, k;
+
+	if (v->len + n <= v->cap)
+		return (0);
+	while (v->len + n > cap)
+		cap *= 2;
+	if ((nv = malloc(sizeof(void *) * cap)) == NULL)
+		return (NFTP_ERR_MEM);
+
+	low = cap / 4;
+	k   = v->cap - v->low < v->len ? v->cap - v->low : v->len;
+	memcpy(nv + low, v->vec + v->low, sizeof(void *) * k);
+	memcpy(nv + low + k, v->vec, sizeof(void *) * (v->len - k));
+
+	free(v->vec);
+	v->vec = nv;
+	v->cap = cap;
+	v->low = low;
 	return (0);
 }
-*/
 
 int
 nftp_vec_alloc(nftp_vec **vp, int sz)
@@ -38,10 +64,13 @@ nftp_vec_alloc(nftp_vec **vp, int sz)
 		return (NFTP_ERR_MEM);
 	if (sz <= 0)
 		sz = NFTP_SIZE;
-	if ((v->vec = malloc(sizeof(void *) * sz)) == NULL)
+	if ((v->vec = malloc(sizeof(void *) * sz)) == NULL) {
+		free(v);
 		return (NFTP_ERR_MEM);
+	}
 	pthread_mutex_init(&v->mtx, NULL);
 
+	v->nolock = 0;
 	v->len = 0;
 	v->cap = sz;
 	v->low = v->cap/4;
@@ -50,6 +79,17 @@ nftp_vec_alloc(nftp_vec **vp, int sz)
 	return (0);
 }
 
+int
+nftp_vec_alloc_nolock(nftp_vec **vp, int sz)
+{
+	int rv;
+
+	if (0 != (rv = nftp_vec_alloc(vp, sz)))
+		return rv;
+	(*vp)->nolock = 1;
+	return (0);
+}
+
 int
 nftp_vec_free(nftp_vec *v)
 {
@@ -69,22 +109,25 @@ nftp_vec_append(nftp_vec *v, void *entry)
 int
 nftp_vec_insert(nftp_vec *v, void *entry, int pos)
 {
-	if (!v) return (NFTP_ERR_VEC);
+	int rv;
 
-	if (v->len == v->cap)
-		return (NFTP_ERR_OVERFLOW);
+	if (!v) return (NFTP_ERR_VEC);
 
 	if (pos > v->len)
 		return nftp_vec_push(v, entry, NFTP_TAIL);
 
-	pthread_mutex_lock(&v->mtx);
+	vec_lock(v);
+	if (0 != (rv = resize(v, 1))) {
+		vec_unlock(v);
+		return rv;
+	}
 	for (int i = v->low + v->len; i > v->low + pos; --i)
 		v->vec[i % v->cap] = v->vec[(i-1) % v->cap];
 	v->vec[(v->low + pos) % v->cap] = entry;
 	// nftp_log("after insert v[%d]=%p(%c)", (v->low + pos) % v->cap, entry, *(((char*)entry) + 1));
 
 	v->len ++;
-	pthread_mutex_unlock(&v->mtx);
+	vec_unlock(v);
 
 	return (0);
 }
@@ -97,13 +140,13 @@ nftp_vec_delete(nftp_vec *v, void **entryp, int pos)
 	if (pos < 0 || pos > v->len-1)
 		return (NFTP_ERR_OVERFLOW);
 
-	pthread_mutex_lock(&v->mtx);
+	vec_lock(v);
 	*entryp = v->vec[(v->low + pos) % v->cap];
 	for (int i = v->low + pos + 1; i < v->low + v->len; ++i) {
 		v->vec[(i-1) % v->cap] = v->vec[i % v->cap];
 	}
 	v->len --;
-	pthread_mutex_unlock(&v->mtx);
+	vec_unlock(v);
 
 	return (0);
 }
@@ -111,14 +154,14 @@ nftp_vec_delete(nftp_vec *v, void **entryp, int pos)
 int
 nftp_vec_push(nftp_vec *v, void *entry, int flag)
 {
-	int pos = 0;
+	int pos = 0, rv;
 
 	if (!v) return (NFTP_ERR_VEC);
 
-	pthread_mutex_lock(&v->mtx);
-	if (v->len == v->cap) {
-		pthread_mutex_unlock(&v->mtx);
-		return (NFTP_ERR_OVERFLOW);
+	vec_lock(v);
+	if (0 != (rv = resize(v, 1))) {
+		vec_unlock(v);
+		return rv;
 	}
 
 	if (NFTP_HEAD == flag) {
@@ -130,13 +173,13 @@ nftp_vec_push(nftp_vec *v, void *entry, int flag)
 		pos = v->low + v->len;
 		pos %= v->cap;
 	} else {
-		pthread_mutex_unlock(&v->mtx);
+		vec_unlock(v);
 		return (NFTP_ERR_FLAG);
 	}
 	v->len ++;
 	// nftp_log("push pos %d", pos);
 	v->vec[pos] = entry;
-	pthread_mutex_unlock(&v->mtx);
+	vec_unlock(v);
 
 	return (0);
 }
@@ -150,7 +193,7 @@ nftp_vec_pop(nftp_vec *v, void **entryp, int flag)
 
 	if (v->len == 0) return (NFTP_ERR_EMPTY);
 
-	pthread_mutex_lock(&v->mtx);
+	vec_lock(v);
 	if (NFTP_HEAD == flag) {
 		pos = v->low;
 		v->low ++;
@@ -159,7 +202,7 @@ nftp_vec_pop(nftp_vec *v, void **entryp, int flag)
 		pos = v->low + v->len - 1;
 		pos %= v->cap;
 	} else {
-		pthread_mutex_unlock(&v->mtx);
+		vec_unlock(v);
 		return (NFTP_ERR_FLAG);
 	}
 
@@ -168,8 +211,58 @@ nftp_vec_pop(nftp_vec *v, void **entryp, int flag)
 	// nftp_log("pop pos %d", pos);
 
 	v->len --;
-	pthread_mutex_unlock(&v->mtx);
+	vec_unlock(v);
+
+	return (0);
+}
+
+int
+nftp_vec_append_n(nftp_vec *v, void **entries, int n)
+{
+	int pos, k, rv;
+
+	if (!v) return (NFTP_ERR_VEC);
+	if (n < 0) return (NFTP_ERR_OVERFLOW);
 
+	vec_lock(v);
+	if (0 != (rv = resize(v, n))) {
+		vec_unlock(v);
+		return rv;
+	}
+	// At most two runs in the ring
+	pos = (v->low + v->len) % v->cap;
+	k   = v->cap - pos < n ? v->cap - pos : n;
+	memcpy(v->vec + pos, entries, sizeof(void *) * k);
+	memcpy(v->vec, entries + k, sizeof(void *) * (n - k));
+	v->len += n;
+	vec_unlock(v);
+
+	return (0);
+}
+
+int
+nftp_vec_pop_n(nftp_vec *v, void **entries, int n, int *cntp)
+{
+	int k;
+
+	if (!v) return (NFTP_ERR_VEC);
+	if (n < 0) return (NFTP_ERR_OVERFLOW);
+
+	vec_lock(v);
+	if (v->len == 0) {
+		vec_unlock(v);
+		return (NFTP_ERR_EMPTY);
+	}
+	if (n > v->len)
+		n = v->len;
+	k = v->cap - v->low < n ? v->cap - v->low : n;
+	memcpy(entries, v->vec + v->low, sizeof(void *) * k);
+	memcpy(entries + k, v->vec, sizeof(void *) * (n - k));
+	v->low = (v->low + n) % v->cap;
+	v->len -= n;
+	vec_unlock(v);
+
+	*cntp = n;
 	return (0);
 }
 
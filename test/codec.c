@@ -17,20 +17,38 @@
 #include "test.h"
 
 static int test_codec_hello();
+static int test_codec_hello_engine();
 static int test_codec_ack();
 static int test_codec_file();
 static int test_codec_end();
 static int test_codec_giveme();
+static int test_codec_view();
+static int test_codec_iovs_view();
+static int test_codec_reset();
+static int test_codec_framer();
+static int test_codec_blkcrc();
+static int test_codec_bitmap();
+static int test_codec_compact();
+static int test_codec_owned();
 
 int
 test_codec()
 {
 	nftp_log("test_codec");
 	test_codec_hello();
+	test_codec_hello_engine();
 	test_codec_ack();
 	test_codec_file();
 	test_codec_end();
 	test_codec_giveme();
+	test_codec_view();
+	test_codec_iovs_view();
+	test_codec_reset();
+	test_codec_framer();
+	test_codec_blkcrc();
+	test_codec_bitmap();
+	test_codec_compact();
+	test_codec_owned();
 
 	return (0);
 }
@@ -71,6 +89,82 @@ test_codec_hello()
 	return (0);
 }
 
+static int
+test_codec_hello_engine()
+{
+	nftp *     p;
+	nftp_view  view;
+	nftp_iovs *iovs;
+	size_t     len;
+	uint8_t *  v;
+
+	uint8_t demo1_hello[] = {
+		0x01, 0x00, 0x00, 0x00, 0x17, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x04,                               // hash engine (xxh64)
+		0x01, 0x02, 0x03, 0x04,             // hashval
+		0x05, 0x06, 0x07, 0x08,
+	};
+	uint8_t demo1_hello_opts[] = {
+		0x01, 0x00, 0x00, 0x00, 0x15, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x7c, 0x6d, 0x8b, 0xab,             // hashval
+		0x00, 0x01, 0x01,                   // 1 byte of opts (compact)
+	};
+
+	assert(0 == nftp_alloc(&p));
+
+	assert(0 == nftp_decode(p, demo1_hello, sizeof(demo1_hello)));
+
+	assert(NFTP_TYPE_HELLO == p->type);
+	assert(NFTP_HASH_XXH64 == p->hashid);
+	assert(0x0102030405060708ULL == p->hashcode);
+	assert(0 == strcmp("ab.c", p->fname));
+
+	assert(0 == nftp_encode(p, &v, &len));
+	assert(sizeof(demo1_hello) == len);
+	for (size_t i=0; i<len; i++) {
+		assert(demo1_hello[i] == v[i]);
+	}
+
+	assert(0 == nftp_free(p));
+	free(v);
+
+	// Unknown engine
+	demo1_hello[14] = 0xee;
+	assert(0 == nftp_alloc(&p));
+	assert(NFTP_ERR_HASH == nftp_decode(p, demo1_hello, sizeof(demo1_hello)));
+	assert(0 == nftp_free(p));
+
+	// CRC32C with options keeps the v1 hash at the head of trailer
+	assert(0 == nftp_decode_view(&view, demo1_hello_opts, sizeof(demo1_hello_opts)));
+	assert(NFTP_HASH_CRC32C == view.hashid);
+	assert(0x7c6d8bab == view.hashcode);
+	assert(NFTP_OPT_COMPACT == view.opts);
+
+	assert(0 == nftp_alloc(&p));
+	assert(0 == nftp_decode(p, demo1_hello_opts, sizeof(demo1_hello_opts)));
+	assert(NFTP_OPT_COMPACT == p->opts);
+	assert(0 == nftp_encode(p, &v, &len));
+	assert(sizeof(demo1_hello_opts) == len);
+	assert(0 == memcmp(demo1_hello_opts, v, len));
+	free(v);
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_encode_iovs(p, iovs));
+	assert(0 == nftp_iovs2stream(iovs, &v, &len));
+	assert(sizeof(demo1_hello_opts) == len);
+	assert(0 == memcmp(demo1_hello_opts, v, len));
+	free(v);
+	assert(0 == nftp_iovs_free(iovs));
+	assert(0 == nftp_free(p));
+
+	demo1_hello_opts[19] = 0x02;
+	assert(NFTP_ERR_HASH == nftp_decode_view(&view, demo1_hello_opts, sizeof(demo1_hello_opts)));
+	return (0);
+}
+
 static int
 test_codec_ack()
 {
@@ -135,6 +229,13 @@ test_codec_file()
 		assert(demo1_file[i] == v[i]);
 	}
 
+	// Encode into the buffer of caller
+	assert(sizeof(demo1_file) == nftp_encoded_size(p));
+	memset(v, 0, len);
+	assert(NFTP_ERR_OVERFLOW == nftp_encode_into(p, v, len - 1));
+	assert(0 == nftp_encode_into(p, v, len));
+	assert(0 == memcmp(demo1_file, v, len));
+
 	assert(0 == nftp_free(p));
 	free(v);
 	return (0);
@@ -209,3 +310,527 @@ test_codec_giveme()
 	return (0);
 }
 
+
+static int
+test_codec_view()
+{
+	nftp_view v;
+
+	uint8_t demo1_hello[] = {
+		0x01, 0x00, 0x00, 0x00, 0x12, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x7c, 0x6d, 0x8b, 0xab,             // hashval
+	};
+	uint8_t demo1_file[] = {
+		0x03, 0x00, 0x00, 0x00, 0x15,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x06, // blockseq & length of content
+		0x61, 0x62, 0x63, 0x64, 0x65, 0x66  // content
+	};
+
+	assert(0 == nftp_decode_view(&v, demo1_hello, sizeof(demo1_hello)));
+	assert(NFTP_TYPE_HELLO == v.type);
+	assert(3 == v.blocks);
+	assert(4 == v.namelen);
+	assert(demo1_hello + 10 == v.fname);
+	assert(NFTP_HASH_CRC32C == v.hashid);
+	assert(0x7c6d8bab == v.hashcode);
+
+	assert(0 == nftp_decode_view(&v, demo1_file, sizeof(demo1_file)));
+	assert(NFTP_TYPE_FILE == v.type);
+	assert(2 == v.blockseq);
+	assert(6 == v.ctlen);
+	assert(demo1_file + 15 == v.content);
+
+	// Truncated
+	assert(NFTP_ERR_STREAM == nftp_decode_view(&v, demo1_file, 10));
+
+	// Length of content runs past the msg
+	demo1_file[14] = 0x07;
+	assert(NFTP_ERR_STREAM == nftp_decode_view(&v, demo1_file, sizeof(demo1_file)));
+
+	// Length of filename runs past the msg
+	demo1_hello[9] = 0x20;
+	assert(NFTP_ERR_STREAM == nftp_decode_view(&v, demo1_hello, sizeof(demo1_hello)));
+	return (0);
+}
+
+static int
+test_codec_iovs_view()
+{
+	nftp *      p;
+	nftp_view   v;
+	nftp_iovs * iovs, *ct;
+	void *      ptr;
+	size_t      len;
+
+	uint8_t demo1_hello[] = {
+		0x01, 0x00, 0x00, 0x00, 0x12, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x7c, 0x6d, 0x8b, 0xab,             // hashval
+	};
+	uint8_t demo1_file[] = {
+		0x03, 0x00, 0x00, 0x00, 0x15,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x06, // blockseq & length of content
+		0x61, 0x62, 0x63, 0x64, 0x65, 0x66  // content
+	};
+
+	// Split in the middle of len, filename and hash
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_iovs_append(iovs, demo1_hello, 3));
+	assert(0 == nftp_iovs_append(iovs, demo1_hello + 3, 9));
+	assert(0 == nftp_iovs_append(iovs, demo1_hello + 12, 0));
+	assert(0 == nftp_iovs_append(iovs, demo1_hello + 12, 4));
+	assert(0 == nftp_iovs_append(iovs, demo1_hello + 16, 2));
+
+	assert(0 == nftp_decode_iovs_view(&v, NULL, iovs));
+	assert(NFTP_TYPE_HELLO == v.type);
+	assert(3 == v.blocks);
+	assert(v.namebuf == v.fname);
+	assert(0 == memcmp("ab.c", v.fname, 4));
+	assert(0x7c6d8bab == v.hashcode);
+	assert(NULL == v.content);
+
+	assert(0 == nftp_alloc(&p));
+	assert(0 == nftp_decode_iovs(p, iovs));
+	assert(0 == strcmp("ab.c", p->fname));
+	assert(0x7c6d8bab == p->hashcode);
+	assert(0 == nftp_free(p));
+	assert(0 == nftp_iovs_free(iovs));
+
+	// Content is split into two segments
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_iovs_alloc(&ct));
+	assert(0 == nftp_iovs_append(iovs, demo1_file, 17));
+	assert(0 == nftp_iovs_append(iovs, demo1_file + 17, 4));
+
+	assert(0 == nftp_decode_iovs_view(&v, ct, iovs));
+	assert(NFTP_TYPE_FILE == v.type);
+	assert(2 == v.blockseq);
+	assert(6 == v.ctlen);
+	assert(NULL == v.content);
+	assert(2 == nftp_iovs_len(ct));
+	assert(6 == nftp_iovs_iolen(ct));
+	assert(0 == nftp_iovs_get(ct, 0, &ptr, &len));
+	assert(demo1_file + 15 == ptr && 2 == len);
+	assert(0 == nftp_iovs_get(ct, 1, &ptr, &len));
+	assert(demo1_file + 17 == ptr && 4 == len);
+
+	assert(0 == nftp_alloc(&p));
+	assert(0 == nftp_decode_iovs(p, iovs));
+	assert(6 == p->ctlen);
+	assert(0 == memcmp(demo1_file + 15, p->content, 6));
+	assert(0 == nftp_free(p));
+
+	// Truncated
+	assert(0 == nftp_iovs_pop(iovs, &ptr, &len, NFTP_TAIL));
+	assert(NFTP_ERR_STREAM == nftp_decode_iovs_view(&v, NULL, iovs));
+
+	assert(0 == nftp_iovs_free(ct));
+	assert(0 == nftp_iovs_free(iovs));
+	return (0);
+}
+
+static int
+test_codec_reset()
+{
+	nftp    p;
+	size_t  len;
+	uint8_t v[32];
+
+	uint8_t demo1_hello[] = {
+		0x01, 0x00, 0x00, 0x00, 0x12, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x7c, 0x6d, 0x8b, 0xab,             // hashval
+	};
+	uint8_t demo1_file[] = {
+		0x03, 0x00, 0x00, 0x00, 0x15,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x06, // blockseq & length of content
+		0x61, 0x62, 0x63, 0x64, 0x65, 0x66  // content
+	};
+
+	// One nftp on stack for several msgs
+	assert(0 == nftp_init(&p));
+	assert(0 == nftp_decode(&p, demo1_hello, sizeof(demo1_hello)));
+	assert(0 == strcmp("ab.c", p.fname));
+	len = nftp_encoded_size(&p);
+	assert(0 == nftp_encode_into(&p, v, sizeof(v)));
+	assert(0 == memcmp(demo1_hello, v, len));
+
+	assert(0 == nftp_reset(&p));
+	assert(NULL == p.fname && NULL == p.content);
+	assert(0 == nftp_decode(&p, demo1_file, sizeof(demo1_file)));
+	assert(NULL == p.fname);
+	assert(2 == p.blockseq);
+	len = nftp_encoded_size(&p);
+	assert(0 == nftp_encode_into(&p, v, sizeof(v)));
+	assert(0 == memcmp(demo1_file, v, len));
+
+	assert(0 == nftp_fini(&p));
+	return (0);
+}
+
+static int
+test_codec_framer()
+{
+	nftp_framer    f;
+	nftp           p;
+	nftp_compact   cs;
+	const uint8_t *msg;
+	uint8_t *      ptr;
+	size_t         len, c1len, c2len;
+	uint8_t        stream[2 * 0x15 + 0x12];
+	uint8_t        ct[200], c1[256], c2[32];
+
+	uint8_t demo1_hello[] = {
+		0x01, 0x00, 0x00, 0x00, 0x12, 0x00, // type & length & id
+		0x00, 0x03, 0x00, 0x04,             // blocks & length of filename
+		0x61, 0x62, 0x2e, 0x63,             // filename
+		0x7c, 0x6d, 0x8b, 0xab,             // hashval
+	};
+	uint8_t demo1_file[] = {
+		0x03, 0x00, 0x00, 0x00, 0x15,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x06, // blockseq & length of content
+		0x61, 0x62, 0x63, 0x64, 0x65, 0x66  // content
+	};
+
+	memcpy(stream, demo1_hello, 0x12);
+	memcpy(stream + 0x12, demo1_file, 0x15);
+	memcpy(stream + 0x12 + 0x15, demo1_file, 0x15);
+
+	// A small buffer makes framer compact and grow
+	assert(0 == nftp_framer_init(&f, 8));
+
+	// The len of hello is split
+	assert(0 == nftp_framer_feed(&f, stream, 3));
+	assert(NFTP_ERR_EMPTY == nftp_framer_next(&f, &msg, &len));
+	assert(3 == nftp_framer_pending(&f));
+
+	// Rest of hello, a file and a part of next one
+	assert(0 == nftp_framer_feed(&f, stream + 3, 0x12 + 0x15 + 7 - 3));
+	assert(0 == nftp_framer_next(&f, &msg, &len));
+	assert(0x12 == len && 0 == memcmp(demo1_hello, msg, len));
+	assert(0 == nftp_framer_next(&f, &msg, &len));
+	assert(0x15 == len && 0 == memcmp(demo1_file, msg, len));
+	assert(NFTP_ERR_EMPTY == nftp_framer_next(&f, &msg, &len));
+	assert(7 == nftp_framer_pending(&f));
+
+	// Receive the rest in place
+	assert(0 == nftp_framer_space(&f, 0x15 - 7, &ptr, &len));
+	assert(len >= 0x15 - 7);
+	memcpy(ptr, stream + 0x12 + 0x15 + 7, 0x15 - 7);
+	assert(0 == nftp_framer_commit(&f, 0x15 - 7));
+	assert(0 == nftp_framer_next(&f, &msg, &len));
+	assert(0x15 == len && 0 == memcmp(demo1_file, msg, len));
+	assert(0 == nftp_framer_pending(&f));
+
+	// Compact msgs between v1 msgs, fed byte by byte. The len of the
+	// first one takes 2 bytes of varint.
+	assert(0 == nftp_compact_init(&cs, 1, 0xab8b6d7c));
+	assert(0 == nftp_init(&p));
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 0;
+	p.content  = ct;
+	p.ctlen    = sizeof(ct);
+	memset(ct, 'a', sizeof(ct));
+	c1len = nftp_compact_size(&p, &cs);
+	assert(c1len > 0x80);
+	assert(0 == nftp_encode_compact(&p, &cs, c1, sizeof(c1)));
+	p.blockseq = 1;
+	p.ctlen    = 6;
+	c2len = nftp_compact_size(&p, &cs);
+	assert(0 == nftp_encode_compact(&p, &cs, c2, sizeof(c2)));
+	p.content = NULL;
+	assert(0 == nftp_fini(&p));
+
+	for (int r = 0; r < 2; ++r) {
+		const uint8_t *m[] = { c1, demo1_file, c2, demo1_hello };
+		size_t         l[] = { c1len, 0x15, c2len, 0x12 };
+
+		for (int i = 0; i < 4; ++i) {
+			for (size_t k = 0; k < l[i]; ++k) {
+				assert(NFTP_ERR_EMPTY == nftp_framer_next(&f, &msg, &len));
+				assert(0 == nftp_framer_feed(&f, m[i] + k, 1));
+			}
+			assert(0 == nftp_framer_next(&f, &msg, &len));
+			assert(l[i] == len && 0 == memcmp(m[i], msg, len));
+		}
+		assert(0 == nftp_framer_pending(&f));
+	}
+
+	// Broken len of compact msg, 0 or too long varint
+	assert(0 == nftp_framer_feed(&f, (uint8_t *)"\x83\x01\x00", 3));
+	assert(NFTP_ERR_STREAM == nftp_framer_next(&f, &msg, &len));
+	assert(0 == nftp_framer_fini(&f));
+	assert(0 == nftp_framer_init(&f, 8));
+	assert(0 == nftp_framer_feed(&f, (uint8_t *)"\x83\x01\xff\xff\xff\xff", 6));
+	assert(NFTP_ERR_EMPTY == nftp_framer_next(&f, &msg, &len));
+	assert(0 == nftp_framer_feed(&f, (uint8_t *)"\xff", 1));
+	assert(NFTP_ERR_STREAM == nftp_framer_next(&f, &msg, &len));
+	assert(0 == nftp_framer_fini(&f));
+	assert(0 == nftp_framer_init(&f, 8));
+
+	// Broken len
+	assert(0 == nftp_framer_feed(&f, (uint8_t *)"\x03\x00\x00\x00\x02", 5));
+	assert(NFTP_ERR_STREAM == nftp_framer_next(&f, &msg, &len));
+
+	assert(0 == nftp_framer_fini(&f));
+	return (0);
+}
+
+static int
+test_codec_blkcrc()
+{
+	nftp       p;
+	nftp_view  v;
+	nftp_iovs *iovs;
+	uint8_t    buf[32];
+	size_t     len;
+
+	uint8_t demo1_file[] = {
+		0x03, 0x00, 0x00, 0x00, 0x19,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x06, // blockseq & length of content
+		0x61, 0x62, 0x63, 0x64, 0x65, 0x66, // content
+		0x00, 0x00, 0x00, 0x00,             // block crc
+	};
+	uint32_t crc = nftp_crc32c(demo1_file + 15, 6);
+	nftp_put_u32(demo1_file + 21, crc);
+
+	assert(0 == nftp_decode_view(&v, demo1_file, sizeof(demo1_file)));
+	assert(NFTP_FLAG_BLKCRC & v.flags);
+	assert(crc == v.blkcrc);
+	assert(6 == v.ctlen);
+
+	assert(0 == nftp_init(&p));
+	assert(0 == nftp_decode(&p, demo1_file, sizeof(demo1_file)));
+	assert(crc == p.blkcrc);
+	assert(0 == memcmp(demo1_file + 15, p.content, 6));
+
+	// Trailer is written in the pass of copy
+	len = nftp_encoded_size(&p);
+	assert(sizeof(demo1_file) == len);
+	memset(buf, 0, sizeof(buf));
+	assert(0 == nftp_encode_into(&p, buf, sizeof(buf)));
+	assert(0 == memcmp(demo1_file, buf, len));
+	assert(0 == nftp_fini(&p));
+
+	// Broken content
+	demo1_file[16] ^= 0x01;
+	assert(0 == nftp_init(&p));
+	assert(NFTP_ERR_HASH == nftp_decode(&p, demo1_file, sizeof(demo1_file)));
+	assert(0 == nftp_fini(&p));
+
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_iovs_append(iovs, demo1_file, 17));
+	assert(0 == nftp_iovs_append(iovs, demo1_file + 17, 8));
+	assert(0 == nftp_init(&p));
+	assert(NFTP_ERR_HASH == nftp_decode_iovs(&p, iovs));
+	assert(0 == nftp_fini(&p));
+	demo1_file[16] ^= 0x01;
+	assert(0 == nftp_init(&p));
+	assert(0 == nftp_decode_iovs(&p, iovs));
+	assert(crc == p.blkcrc);
+	assert(0 == nftp_fini(&p));
+	assert(0 == nftp_iovs_free(iovs));
+
+	// A cut trailer is not taken as a msg without Block CRC
+	demo1_file[4] = 0x18;
+	assert(NFTP_ERR_STREAM == nftp_decode_view(&v, demo1_file, 0x18));
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_iovs_append(iovs, demo1_file, 17));
+	assert(0 == nftp_iovs_append(iovs, demo1_file + 17, 7));
+	assert(0 == nftp_init(&p));
+	assert(NFTP_ERR_STREAM == nftp_decode_iovs(&p, iovs));
+	assert(0 == nftp_fini(&p));
+	assert(0 == nftp_iovs_free(iovs));
+	return (0);
+}
+
+static int
+test_codec_bitmap()
+{
+	nftp     p;
+	uint8_t *v;
+	size_t   len;
+	nftp_run runs[8];
+	uint8_t  bm[200], inv[200];
+
+	// Blocks 0, 2, 3 from blockseq 7 are asked
+	uint8_t demo1_giveme[] = {
+		0x05, 0x00, 0x00, 0x00, 0x0c,       // type & length
+		0x7c, 0x6d, 0x8b, 0xab,             // fileid
+		0x00, 0x07,                         // blockseq
+		0x0d,                               // bitmap
+	};
+
+	assert(0 == nftp_init(&p));
+	assert(0 == nftp_decode(&p, demo1_giveme, sizeof(demo1_giveme)));
+	assert(NFTP_TYPE_GIVEME == p.type);
+	assert(7 == p.blockseq);
+	assert(1 == p.ctlen);
+	assert(2 == nftp_bitmap_runs(p.content, 8, runs, 8));
+	assert(0 == runs[0].start && 1 == runs[0].len);
+	assert(2 == runs[1].start && 2 == runs[1].len);
+
+	assert(0 == nftp_encode(&p, &v, &len));
+	assert(sizeof(demo1_giveme) == len);
+	assert(0 == memcmp(demo1_giveme, v, len));
+	free(v);
+	assert(0 == nftp_fini(&p));
+
+	// Runs across words, and bits out of nbits are ignored
+	memset(bm, 0, sizeof(bm));
+	for (int i = 60; i < 1000; ++i)
+		bm[i / 8] |= 1u << (i % 8);
+	bm[1500 / 8] |= 1u << (1500 % 8);
+	assert(2 == nftp_bitmap_runs(bm, 1600, runs, 8));
+	assert(60 == runs[0].start && 940 == runs[0].len);
+	assert(1500 == runs[1].start && 1 == runs[1].len);
+	assert(1 == nftp_bitmap_runs(bm, 1500, runs, 8));
+	assert(1 == nftp_bitmap_runs(bm, 1600, runs, 1));
+	assert(941 == nftp_bitmap_count(bm, 1600));
+
+	// Missing blocks from 59, with an unaligned offset
+	nftp_bitmap_invert(inv, bm, 59, 1000);
+	assert(2 == nftp_bitmap_runs(inv, 1000, runs, 8));
+	assert(0 == runs[0].start && 1 == runs[0].len);
+	assert(941 == runs[1].start && 59 == runs[1].len);
+	assert(60 == nftp_bitmap_count(inv, 1000));
+	return (0);
+}
+
+static int
+test_codec_compact()
+{
+	nftp         p;
+	nftp_view    v;
+	nftp_compact tx, rx, other;
+	uint8_t      buf[32];
+	size_t       len;
+
+	assert(0 == nftp_compact_init(&tx, 7, 0xab8b6d7c));
+	assert(0 == nftp_compact_init(&rx, 7, 0xab8b6d7c));
+
+	assert(0 == nftp_init(&p));
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.content  = (uint8_t *)"abcdef";
+	p.ctlen    = 6;
+
+	// type, sid, len, blockseq and content. blockseq is 1 byte below 128.
+	for (int i = 0; i < 3; ++i) {
+		p.blockseq = i;
+		len = nftp_compact_size(&p, &tx);
+		assert(4 + 6 == len);
+		assert(0 == nftp_encode_compact(&p, &tx, buf, sizeof(buf)));
+		assert((NFTP_TYPE_FILE | NFTP_TYPE_COMPACT) == buf[0]);
+		assert(7 == buf[1]);
+		assert(0 == nftp_decode_compact(&v, &rx, buf, len));
+		assert(NFTP_TYPE_FILE == v.type);
+		assert(0xab8b6d7c == v.fileid);
+		assert(i == v.blockseq);
+		assert(6 == v.ctlen);
+		assert(0 == memcmp("abcdef", v.content, 6));
+	}
+
+	// Skip forward and step back, no state is kept between msgs
+	p.blockseq = 300;
+	len = nftp_compact_size(&p, &tx);
+	assert(5 + 6 == len);
+	assert(0 == nftp_encode_compact(&p, &tx, buf, sizeof(buf)));
+	assert(0 == nftp_decode_compact(&v, &rx, buf, len));
+	assert(300 == v.blockseq);
+	p.blockseq = 1;
+	p.type     = NFTP_TYPE_END;
+	len = nftp_compact_size(&p, &tx);
+	assert(0 == nftp_encode_compact(&p, &tx, buf, sizeof(buf)));
+	assert(0 == nftp_decode_compact(&v, &rx, buf, len));
+	assert(NFTP_TYPE_END == v.type);
+	assert(1 == v.blockseq);
+
+	// With Block CRC
+	p.flags  = NFTP_FLAG_BLKCRC;
+	p.blkcrc = nftp_crc32c(p.content, 6);
+	p.blockseq = 2;
+	len = nftp_compact_size(&p, &tx);
+	assert(4 + 6 + 4 == len);
+	assert(0 == nftp_encode_compact(&p, &tx, buf, sizeof(buf)));
+	assert(NFTP_TYPE_BLKCRC & buf[0]);
+	assert(0 == nftp_decode_compact(&v, &rx, buf, len));
+	assert(NFTP_FLAG_BLKCRC & v.flags);
+	assert(p.blkcrc == v.blkcrc);
+
+	// Wrong session and truncated msg
+	assert(0 == nftp_compact_init(&other, 8, 0xab8b6d7c));
+	assert(NFTP_ERR_ID == nftp_decode_compact(&v, &other, buf, len));
+	assert(0 != nftp_decode_compact(&v, &rx, buf, len - 1));
+	assert(NFTP_ERR_OVERFLOW == nftp_encode_compact(&p, &tx, buf, len - 1));
+
+	p.content = NULL;
+	assert(0 == nftp_fini(&p));
+	return (0);
+}
+
+static int
+test_codec_owned()
+{
+	nftp       p;
+	nftp_iovs *iovs;
+	uint8_t *  exp, *got;
+	size_t     explen, gotlen;
+
+	assert(0 == nftp_init(&p));
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 2;
+	p.ctlen    = 6;
+	p.flags    = NFTP_FLAG_BLKCRC;
+	assert(NULL != (p.content = malloc(6)));
+	memcpy(p.content, "abcdef", 6);
+	p.len = nftp_encoded_size(&p);
+	assert(0 == nftp_encode(&p, &exp, &explen));
+
+	// The chain outlives the msg. header | content | crc
+	assert(0 == nftp_iovs_alloc_nolock(&iovs));
+	assert(0 == nftp_encode_iovs_owned(&p, iovs));
+	assert(NULL == p.content);
+	assert(0 == nftp_fini(&p));
+	assert(3 == nftp_iovs_len(iovs));
+	assert(0 == nftp_iovs2stream(iovs, &got, &gotlen));
+	assert(explen == gotlen);
+	assert(0 == memcmp(exp, got, explen));
+	free(got);
+
+	// As written, content is freed
+	assert(0 == nftp_iovs_consume(iovs, NFTP_FILE_HDRLEN + 6));
+	assert(1 == nftp_iovs_len(iovs));
+	assert(0 == nftp_iovs_free(iovs));
+
+	// No content
+	assert(0 == nftp_init(&p));
+	p.type   = NFTP_TYPE_ACK;
+	p.id     = 1;
+	p.fileid = 0xab8b6d7c;
+	p.len    = nftp_encoded_size(&p);
+	free(exp);
+	assert(0 == nftp_encode(&p, &exp, &explen));
+	assert(0 == nftp_iovs_alloc_nolock(&iovs));
+	assert(0 == nftp_encode_iovs_owned(&p, iovs));
+	assert(0 == nftp_fini(&p));
+	assert(1 == nftp_iovs_len(iovs));
+	assert(0 == nftp_iovs2stream(iovs, &got, &gotlen));
+	assert(explen == gotlen);
+	assert(0 == memcmp(exp, got, explen));
+	assert(0 == nftp_iovs_free(iovs));
+	free(got);
+	free(exp);
+	return (0);
+}
@@ -63,6 +63,33 @@ test_file()
 
 	free(demo);
 
+	// Large enough to be split over several workers
+	char * big;
+	char   bigfile[] = "demo_mt.txt";
+	size_t bigsz     = 17 * 1024 * 1024 + 13;
+	uint32_t hashval2;
+	uint64_t digest;
+
+	assert(NULL != (big = malloc(bigsz)));
+	for (size_t i = 0; i < bigsz; ++i)
+		big[i] = (char) (i * 31 + (i >> 12));
+	assert(0 == nftp_file_write(bigfile, big, bigsz));
+	assert(0 == nftp_file_hash(bigfile, &hashval));
+	assert(0 == nftp_file_hash_mt(bigfile, &hashval2, 4));
+	assert(hashval == hashval2);
+	assert(0 == nftp_file_hash_mt(bigfile, &hashval2, 0));
+	assert(hashval == hashval2);
+	assert(0 == nftp_file_hash_mt(file, &hashval2, 4));
+	assert(NFTP_HASH((uint8_t *)str2, strlen(str2)) == hashval2);
+
+	// Engines which combine are split as well, others are streamed
+	assert(0 == nftp_file_digest(bigfile, NFTP_HASH_CRC32C, &digest));
+	assert(hashval == digest);
+	assert(0 == nftp_file_digest(bigfile, NFTP_HASH_XXH64, &digest));
+	assert(nftp_xxh64((uint8_t *)big, bigsz) == digest);
+	assert(0 == nftp_file_remove(bigfile));
+	free(big);
+
 	return (0);
 }
 
@@ -9,10 +9,156 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "nftp.h"
 #include "test.h"
 
+// Accelerated crc32c must agree with the table version on any length and
+// alignment, including the three-way interleaved paths for long buffers.
+static void
+test_hash_crc32c_hw()
+{
+	size_t   sz = 3 * 8192 * 2 + 64;
+	uint8_t *buf, *dst;
+
+	assert(NULL != (buf = malloc(sz)));
+	srand(1);
+	for (size_t i = 0; i < sz; ++i)
+		buf[i] = (uint8_t) rand();
+
+	assert(NULL != (dst = malloc(sz)));
+	for (size_t off = 0; off < 8; ++off) {
+		assert(nftp_crc32c(buf + off, sz - off - 8) ==
+		    nftp_crc32c_sw(buf + off, sz - off - 8));
+		for (int i = 0; i < 64; ++i) {
+			size_t n = (size_t) rand() % (sz - off);
+			assert(nftp_crc32c(buf + off, n) ==
+			    nftp_crc32c_sw(buf + off, n));
+			// Fused copy
+			memset(dst, 0, sz);
+			assert(nftp_crc32c_copy(dst + 1, buf + off, n) ==
+			    nftp_crc32c_sw(buf + off, n));
+			assert(0 == memcmp(dst + 1, buf + off, n));
+			assert(0 == dst[0] && (n + 1 == sz || 0 == dst[n + 1]));
+		}
+	}
+	free(dst);
+	free(buf);
+}
+
+// Folding crc32 must agree with the table version on random lengths and
+// alignments, covering the 16, 64 and 256 bytes folding steps and tails.
+static void
+test_hash_crc32_fold()
+{
+	size_t   sz = 64 * 1024 + 64;
+	uint8_t *buf;
+
+	int      kernel = nftp_crc32_get_kernel();
+
+	assert(NULL != (buf = malloc(sz)));
+	srand(2);
+	for (size_t i = 0; i < sz; ++i)
+		buf[i] = (uint8_t) rand();
+
+	// Each kernel the cpu has, on small and large inputs
+	for (int k = NFTP_CRC32_SW; k <= NFTP_CRC32_VPCLMUL; ++k) {
+		if (0 != nftp_crc32_set_kernel(k))
+			continue;
+		assert(k == nftp_crc32_get_kernel());
+		for (size_t n = 0; n < 1024; ++n)
+			assert(nftp_crc32(buf + (n & 15), n) ==
+			    nftp_crc32_sw(buf + (n & 15), n));
+		for (int i = 0; i < 256; ++i) {
+			size_t off = (size_t) rand() % 64;
+			size_t n   = (size_t) rand() % (sz - off);
+			assert(nftp_crc32(buf + off, n) ==
+			    nftp_crc32_sw(buf + off, n));
+		}
+		assert(nftp_crc32(buf, sz) == nftp_crc32_sw(buf, sz));
+	}
+	assert(NFTP_ERR_HASH == nftp_crc32_set_kernel(-1));
+	assert(0 == nftp_crc32_set_kernel(kernel));
+	free(buf);
+}
+
+// Hashing in chunks gives the same result as hashing at once
+static void
+test_hash_stream()
+{
+	const uint8_t *s = (uint8_t *) "It's a demo.\nIt's a demo.\n";
+	size_t         n = strlen((char *) s);
+
+	for (size_t cut = 0; cut <= n; ++cut) {
+		nftp_djb_ctx    djb;
+		nftp_fnv1a_ctx  fnv;
+		nftp_crc_ctx    crc;
+		nftp_crc32_ctx  crc32;
+		nftp_crc32c_ctx crc32c;
+
+		nftp_djb_init(&djb);
+		nftp_djb_update(&djb, s, cut);
+		nftp_djb_update(&djb, s + cut, n - cut);
+		assert(nftp_djb_final(&djb) == nftp_djb_hashn(s, n));
+
+		nftp_fnv1a_init(&fnv);
+		nftp_fnv1a_update(&fnv, s, cut);
+		nftp_fnv1a_update(&fnv, s + cut, n - cut);
+		assert(nftp_fnv1a_final(&fnv) == nftp_fnv1a_hashn(s, n));
+
+		nftp_crc_init(&crc);
+		nftp_crc_update(&crc, s, cut);
+		nftp_crc_update(&crc, s + cut, n - cut);
+		assert(nftp_crc_final(&crc) == nftp_crc(s, n));
+
+		nftp_crc32_init(&crc32);
+		nftp_crc32_update(&crc32, s, cut);
+		nftp_crc32_update(&crc32, s + cut, n - cut);
+		assert(nftp_crc32_final(&crc32) == nftp_crc32(s, n));
+
+		nftp_crc32c_init(&crc32c);
+		nftp_crc32c_update(&crc32c, s, cut);
+		nftp_crc32c_update(&crc32c, s + cut, n - cut);
+		assert(nftp_crc32c_final(&crc32c) == nftp_crc32c(s, n));
+	}
+}
+
+static void
+test_hash_engine()
+{
+	const uint8_t *s = (uint8_t *) "It's a demo.\nIt's a demo.\nIt's a demo.\n";
+	size_t         n = strlen((char *) s);
+	nftp_hash_ctx  ctx;
+	const nftp_hash_engine *e;
+
+	assert(nftp_xxh64((uint8_t *) "", 0) == 0xEF46DB3751D8E999ULL);
+	assert(nftp_xxh64((uint8_t *) "abc", 3) == 0x44BC2CF5AD770999ULL);
+
+	assert(NULL == nftp_hash_engine_get(0));
+	assert(NULL != (e = nftp_hash_engine_get(NFTP_HASH_CRC32C)));
+	assert(e->hash(s, n) == NFTP_HASH(s, n));
+
+	for (int id = NFTP_HASH_CRC32C; id <= NFTP_HASH_XXH64; ++id) {
+		assert(NULL != (e = nftp_hash_engine_get(id)));
+		assert(id == e->id);
+		for (size_t cut = 0; cut <= n; cut += 7) {
+			e->init(&ctx);
+			e->update(&ctx, s, cut);
+			e->update(&ctx, s + cut, n - cut);
+			assert(e->final(&ctx) == e->hash(s, n));
+			if (e->combine)
+				assert(e->combine(e->hash(s, cut),
+				    e->hash(s + cut, n - cut), n - cut) ==
+				    e->hash(s, n));
+		}
+	}
+
+	// Builtin ids are taken, and digest must be 4 or 8 bytes
+	assert(NFTP_ERR_HASH == nftp_hash_engine_register(e));
+}
+
 int
 test_hash()
 {
@@ -29,6 +175,18 @@ test_hash()
 	assert(nftp_crc32c((uint8_t *) "small-", 6) == 4099902165);
 	assert(nftp_crc32c((uint8_t *) "small", 5) == 2128476489);
 
+	test_hash_crc32c_hw();
+	test_hash_crc32_fold();
+
+	// crc32c(ab) is crc32c(a) combined with crc32c(b)
+	uint32_t crca = nftp_crc32c((uint8_t *) "small-", 6);
+	uint32_t crcb = nftp_crc32c((uint8_t *) "a.txt", 5);
+	assert(nftp_crc32c_combine(crca, crcb, 5) == 215792439);
+	assert(nftp_crc32c_combine(crca, 0, 0) == crca);
+
+	test_hash_stream();
+	test_hash_engine();
+
 	return (0);
 }
 
@@ -8,11 +8,25 @@
 //
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #include "nftp.h"
 #include "test.h"
 
+static int test_iovs_grow();
+static int test_iovs_writev();
+static int test_iovs_slice();
+static int test_iovs_buf();
+static int test_iovs_inline();
+
 int
 test_iovs()
 {
@@ -63,6 +77,366 @@ test_iovs()
 	assert(0 == nftp_iovs_free(iovs1));
 	free(str2);
 
+	test_iovs_grow();
+	test_iovs_writev();
+	test_iovs_slice();
+	test_iovs_buf();
+	test_iovs_inline();
+	return (0);
+}
+
+static int
+test_iovs_grow()
+{
+	nftp_iovs *iovs, *iovs1;
+	char       str[] = "0123456789";
+	char *     ptr;
+	size_t     sz;
+	size_t     n = 10 * NFTP_SIZE;
+
+	// Both ends grow
+	assert(0 == nftp_iovs_alloc(&iovs));
+	for (size_t i = 0; i < n; ++i) {
+		assert(0 == nftp_iovs_push(iovs, str + 4, 1, NFTP_HEAD));
+		assert(0 == nftp_iovs_push(iovs, str + 5, 1, NFTP_TAIL));
+	}
+	assert(2 * n == nftp_iovs_len(iovs));
+	assert(2 * n == nftp_iovs_iolen(iovs));
+	assert(2 * n <= nftp_iovs_cap(iovs));
+	for (size_t i = 0; i < 2 * n; ++i) {
+		assert(0 == nftp_iovs_get(iovs, i, (void **)&ptr, &sz));
+		assert(1 == sz);
+		assert((i < n ? '4' : '5') == *ptr);
+	}
+
+	// Insert lands at pos
+	assert(0 == nftp_iovs_insert(iovs, str + 9, 1, 3));
+	assert(0 == nftp_iovs_get(iovs, 3, (void **)&ptr, &sz));
+	assert('9' == *ptr);
+	assert(0 == nftp_iovs_get(iovs, 4, (void **)&ptr, &sz));
+	assert('4' == *ptr);
+
+	// Only head pushes after tail pops
+	for (size_t i = 0; i < n; ++i)
+		assert(0 == nftp_iovs_pop(iovs, (void **)&ptr, &sz, NFTP_TAIL));
+	for (size_t i = 0; i < 4 * n; ++i)
+		assert(0 == nftp_iovs_push(iovs, str, 1, NFTP_HEAD));
+	assert(5 * n + 1 == nftp_iovs_len(iovs));
+	assert(0 == nftp_iovs_get(iovs, 4 * n + 3, (void **)&ptr, &sz));
+	assert('9' == *ptr);
+
+	// Reserve then cat without growing
+	assert(0 == nftp_iovs_alloc_nolock(&iovs1));
+	assert(0 == nftp_iovs_reserve(iovs1, 5 * n + 1));
+	sz = nftp_iovs_cap(iovs1);
+	assert(0 == nftp_iovs_cat(iovs1, iovs));
+	assert(sz == nftp_iovs_cap(iovs1));
+	assert(5 * n + 1 == nftp_iovs_len(iovs1));
+	assert(5 * n + 1 == nftp_iovs_iolen(iovs1));
+	assert(0 == nftp_iovs_cat(iovs1, iovs));
+	assert(10 * n + 2 == nftp_iovs_len(iovs1));
+
+	assert(0 == nftp_iovs_free(iovs));
+	assert(0 == nftp_iovs_free(iovs1));
+	return (0);
+}
+
+
+static int
+test_iovs_writev()
+{
+#ifndef _WIN32
+	nftp       p;
+	nftp_iovs *iovs;
+	uint8_t *  ct, *exp, *got;
+	size_t     ctlen = 256 * 1024, explen, gotlen = 0;
+	ssize_t    n;
+	void *     ptr;
+	size_t     sz;
+	int        fds[2], rv, again = 0;
+
+	assert(NULL != (ct = malloc(ctlen)));
+	for (size_t i = 0; i < ctlen; ++i)
+		ct[i] = (uint8_t)(i * 7);
+
+	assert(0 == nftp_init(&p));
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 3;
+	p.content  = ct;
+	p.ctlen    = ctlen;
+	p.flags    = NFTP_FLAG_BLKCRC;
+	p.len      = nftp_encoded_size(&p);
+	assert(0 == nftp_encode(&p, &exp, &explen));
+	assert(NULL != (got = malloc(explen)));
+
+	// A FILE msg to a non-blocking pipe, smaller than the msg
+	assert(0 == nftp_iovs_alloc_nolock(&iovs));
+	assert(0 == nftp_encode_iovs(&p, iovs));
+	assert(explen == nftp_iovs_iolen(iovs));
+	assert(0 == pipe(fds));
+	assert(0 == fcntl(fds[1], F_SETFL, O_NONBLOCK));
+	while (NFTP_ERR_AGAIN == (rv = nftp_iovs_writev(iovs, fds[1]))) {
+		again++;
+		assert(nftp_iovs_sent(iovs) < explen);
+		while (gotlen < nftp_iovs_sent(iovs)) {
+			assert(0 < (n = read(fds[0], got + gotlen, explen - gotlen)));
+			gotlen += n;
+		}
+	}
+	assert(0 == rv);
+	assert(0 < again);
+	assert(explen == nftp_iovs_sent(iovs));
+	while (gotlen < explen) {
+		assert(0 < (n = read(fds[0], got + gotlen, explen - gotlen)));
+		gotlen += n;
+	}
+	assert(0 == memcmp(exp, got, explen));
+	// Nothing left
+	assert(0 == nftp_iovs_writev(iovs, fds[1]));
+	close(fds[0]);
+	close(fds[1]);
+
+	// Pop written iovs at HEAD, and the rest by sendmsg
+	assert(0 == nftp_iovs_rewind(iovs));
+	assert(0 == nftp_iovs_pop(iovs, &ptr, &sz, NFTP_HEAD));
+	assert(0 == nftp_iovs_push(iovs, ptr, sz, NFTP_HEAD));
+	assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	gotlen = 0;
+	while (NFTP_ERR_AGAIN == (rv = nftp_iovs_sendmsg(iovs, fds[0], MSG_DONTWAIT))) {
+		while (0 < nftp_iovs_sent(iovs) && 0 == nftp_iovs_get(iovs, 0, &ptr, &sz) &&
+		    sz <= nftp_iovs_sent(iovs))
+			assert(0 == nftp_iovs_pop(iovs, &ptr, &sz, NFTP_HEAD));
+		assert(0 < (n = read(fds[1], got + gotlen, explen - gotlen)));
+		gotlen += n;
+	}
+	assert(0 == rv);
+	while (gotlen < explen) {
+		assert(0 < (n = read(fds[1], got + gotlen, explen - gotlen)));
+		gotlen += n;
+	}
+	assert(0 == memcmp(exp, got, explen));
+	close(fds[0]);
+	close(fds[1]);
+
+	// Closed fd
+	assert(0 == nftp_iovs_rewind(iovs));
+	assert(NFTP_ERR_STREAM == nftp_iovs_writev(iovs, fds[1]));
+
+	assert(0 == nftp_iovs_free(iovs));
+	p.content = NULL;
+	assert(0 == nftp_fini(&p));
+	free(ct);
+	free(exp);
+	free(got);
+#endif
 	return (0);
 }
 
+#define SLICE_CNT 2000
+
+static void *
+slice_worker(void *arg)
+{
+	nftp_iovs **pair = arg;
+
+	for (int i = 0; i < SLICE_CNT; ++i)
+		assert(0 == nftp_iovs_slice(pair[0], 0, 1, pair[1]));
+	return NULL;
+}
+
+static int
+test_iovs_slice()
+{
+	nftp_iovs *iovs, *sl, *pair[2];
+	pthread_t  thr;
+	char *     str = "abcdefghij";
+	char       buf[16];
+	uint8_t *  v;
+	char *     ptr;
+	size_t     sz;
+
+	// abc|def|ghij
+	assert(0 == nftp_iovs_alloc_nolock(&iovs));
+	assert(0 == nftp_iovs_append(iovs, str, 3));
+	assert(0 == nftp_iovs_append(iovs, str + 3, 3));
+	assert(0 == nftp_iovs_append(iovs, str + 6, 4));
+
+	// Gather only a part across iovs
+	memset(buf, 0, sizeof(buf));
+	assert(0 == nftp_iovs_copyout(iovs, 2, 5, buf));
+	assert(0 == strcmp(buf, "cdefg"));
+	assert(0 == nftp_iovs_copyout(iovs, 0, 10, buf));
+	assert(0 == strncmp(buf, str, 10));
+	assert(0 == nftp_iovs_copyout(iovs, 10, 0, buf));
+	assert(NFTP_ERR_OVERFLOW == nftp_iovs_copyout(iovs, 8, 3, buf));
+
+	// Slice points into the same memory
+	assert(0 == nftp_iovs_alloc_nolock(&sl));
+	assert(0 == nftp_iovs_slice(iovs, 4, 5, sl)); // ef|ghi
+	assert(2 == nftp_iovs_len(sl));
+	assert(5 == nftp_iovs_iolen(sl));
+	assert(0 == nftp_iovs_get(sl, 0, (void **)&ptr, &sz));
+	assert(str + 4 == ptr);
+	assert(2 == sz);
+	assert(0 == nftp_iovs2stream(sl, &v, &sz));
+	assert(0 == strncmp((char *)v, "efghi", 5));
+	free(v);
+	assert(NFTP_ERR_OVERFLOW == nftp_iovs_slice(iovs, 4, 7, sl));
+	assert(NFTP_ERR_IOVS == nftp_iovs_slice(iovs, 0, 1, iovs));
+
+	// Consume inside an iov then across iovs
+	assert(0 == nftp_iovs_consume(iovs, 1)); // bc|def|ghij
+	assert(3 == nftp_iovs_len(iovs));
+	assert(9 == nftp_iovs_iolen(iovs));
+	assert(0 == nftp_iovs_get(iovs, 0, (void **)&ptr, &sz));
+	assert(str + 1 == ptr);
+	assert(2 == sz);
+	assert(0 == nftp_iovs_consume(iovs, 4)); // f|ghij
+	assert(2 == nftp_iovs_len(iovs));
+	assert(5 == nftp_iovs_iolen(iovs));
+	assert(0 == nftp_iovs_copyout(iovs, 0, 5, buf));
+	assert(0 == strncmp(buf, "fghij", 5));
+	assert(NFTP_ERR_OVERFLOW == nftp_iovs_consume(iovs, 6));
+	assert(0 == nftp_iovs_consume(iovs, 5));
+	assert(0 == nftp_iovs_len(iovs));
+	assert(0 == nftp_iovs_iolen(iovs));
+
+	assert(0 == nftp_iovs_free(iovs));
+	assert(0 == nftp_iovs_free(sl));
+
+	// Slices both ways between two threads don't deadlock
+	assert(0 == nftp_iovs_alloc(&pair[0]));
+	assert(0 == nftp_iovs_alloc(&pair[1]));
+	assert(0 == nftp_iovs_append(pair[0], str, 1));
+	assert(0 == nftp_iovs_append(pair[1], str, 1));
+	assert(0 == pthread_create(&thr, NULL, slice_worker, pair));
+	for (int i = 0; i < SLICE_CNT; ++i)
+		assert(0 == nftp_iovs_slice(pair[1], 0, 1, pair[0]));
+	assert(0 == pthread_join(thr, NULL));
+	assert(SLICE_CNT + 1 == nftp_iovs_len(pair[0]));
+	assert(SLICE_CNT + 1 == nftp_iovs_len(pair[1]));
+	assert(0 == nftp_iovs_free(pair[0]));
+	assert(0 == nftp_iovs_free(pair[1]));
+	return (0);
+}
+
+static int released;
+
+static void
+cb_release(void *arg)
+{
+	released += *(int *)arg;
+}
+
+static int
+test_iovs_buf()
+{
+	nftp_iovs *iovs, *sl;
+	nftp_buf * b;
+	int        one = 1;
+	char *     ptr;
+	size_t     sz;
+
+	released = 0;
+	assert(0 == nftp_buf_alloc(&b, 8));
+	memcpy(b->data, "abcdefgh", 8);
+
+	// x|abcd|efgh|y
+	assert(0 == nftp_iovs_alloc(&iovs));
+	assert(0 == nftp_iovs_push_buf(iovs, b, 0, 4, NFTP_TAIL));
+	assert(0 == nftp_iovs_push_buf(iovs, b, 4, 4, NFTP_TAIL));
+	assert(NFTP_ERR_OVERFLOW == nftp_iovs_push_buf(iovs, b, 4, 5, NFTP_TAIL));
+	assert(0 == nftp_iovs_push_cb(iovs, "x", 1, NFTP_HEAD, cb_release, &one));
+	assert(0 == nftp_iovs_push_cb(iovs, "y", 1, NFTP_TAIL, cb_release, &one));
+	assert(3 == b->refcnt);
+
+	// Owned iovs move with growing
+	for (int i = 0; i < NFTP_SIZE; ++i) {
+		assert(0 == nftp_iovs_push(iovs, "", 0, NFTP_HEAD));
+		assert(0 == nftp_iovs_push(iovs, "", 0, NFTP_TAIL));
+	}
+	assert(0 == nftp_iovs_consume(iovs, 0));
+	assert(0 == released);
+
+	// Slice takes refs of buf only
+	assert(0 == nftp_iovs_alloc_nolock(&sl));
+	assert(0 == nftp_iovs_slice(iovs, 0, 10, sl));
+	assert(5 == b->refcnt);
+	assert(0 == nftp_iovs_free(sl));
+	assert(3 == b->refcnt);
+	assert(0 == released);
+
+	// Consume releases what's gone only
+	assert(0 == nftp_iovs_consume(iovs, 3)); // cd|efgh|y
+	assert(1 == released);
+	assert(3 == b->refcnt);
+	assert(0 == nftp_iovs_consume(iovs, 2)); // efgh|y
+	assert(2 == b->refcnt);
+
+	// Pop and free release too
+	for (int i = 0; i < NFTP_SIZE; ++i)
+		assert(0 == nftp_iovs_pop(iovs, (void **)&ptr, &sz, NFTP_TAIL));
+	assert(0 == nftp_iovs_pop(iovs, (void **)&ptr, &sz, NFTP_TAIL));
+	assert('y' == *ptr);
+	assert(2 == released);
+	assert(0 == nftp_iovs_free(iovs));
+	assert(1 == b->refcnt);
+	assert(0 == nftp_buf_unref(b));
+	return (0);
+}
+
+static int
+test_iovs_inline()
+{
+	nftp_iovs iovs;
+	nftp      p;
+	int       one = 1;
+	char *    str = "0123456789";
+	char *    ptr;
+	size_t    sz;
+	uint8_t * v, *exp;
+	size_t    len, explen;
+
+	// A FILE msg fits inline
+	assert(0 == nftp_init(&p));
+	p.type     = NFTP_TYPE_FILE;
+	p.fileid   = 0xab8b6d7c;
+	p.blockseq = 1;
+	p.content  = (uint8_t *)str;
+	p.ctlen    = 10;
+	p.flags    = NFTP_FLAG_BLKCRC;
+	p.len      = nftp_encoded_size(&p);
+	assert(0 == nftp_iovs_init(&iovs));
+	assert(NFTP_IOVS_INLINE == nftp_iovs_cap(&iovs));
+	assert(0 == nftp_encode_iovs(&p, &iovs));
+	assert(NFTP_IOVS_INLINE == nftp_iovs_cap(&iovs));
+	assert(0 == nftp_iovs2stream(&iovs, &v, &len));
+	assert(0 == nftp_encode(&p, &exp, &explen));
+	assert(explen == len);
+	assert(0 == memcmp(exp, v, len));
+	free(v);
+	free(exp);
+	assert(0 == nftp_iovs_fini(&iovs));
+	p.content = NULL;
+	assert(0 == nftp_fini(&p));
+
+	// Spill to heap on both ends
+	released = 0;
+	assert(0 == nftp_iovs_init(&iovs));
+	assert(0 == nftp_iovs_push_cb(&iovs, str, 1, NFTP_TAIL, cb_release, &one));
+	for (int i = 1; i < 10; ++i) {
+		assert(0 == nftp_iovs_push(&iovs, str + i, 1, NFTP_TAIL));
+		assert(0 == nftp_iovs_push(&iovs, str + i, 1, NFTP_HEAD));
+	}
+	assert(19 == nftp_iovs_len(&iovs));
+	assert(NFTP_IOVS_INLINE < nftp_iovs_cap(&iovs));
+	assert(0 == nftp_iovs_get(&iovs, 9, (void **)&ptr, &sz));
+	assert('0' == *ptr);
+	assert(0 == nftp_iovs_get(&iovs, 0, (void **)&ptr, &sz));
+	assert('9' == *ptr);
+	assert(0 == released);
+	assert(0 == nftp_iovs_fini(&iovs));
+	assert(1 == released);
+	return (0);
+}
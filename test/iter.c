@@ -10,6 +10,9 @@
 #include <assert.h>
 
 #include "nftp.h"
+#include "hashtable.h"
+
+static int test_iter_stack();
 
 int
 test_iter()
@@ -71,5 +74,97 @@ test_iter()
 	nftp_iovs_free(iovs);
 	nftp_iter_free(iter);
 
+	test_iter_stack();
+	return (0);
+}
+
+static int
+test_iter_stack()
+{
+	int            n[3], *e, cnt = 0;
+	nftp_vec *     v;
+	nftp_vec_it    vit;
+	nftp_iovs      iovs;
+	nftp_iovs_it   iit;
+	struct iovec * iov;
+	HashTable      ht;
+	HTIter         hit;
+	HTNode *       node;
+	uint32_t       key;
+	int            sum = 0;
+
+	// Across the end of ring
+	assert(0 == nftp_vec_alloc(&v, 4));
+	assert(0 == nftp_vec_push(v, &n[1], NFTP_HEAD));
+	assert(0 == nftp_vec_push(v, &n[0], NFTP_HEAD));
+	assert(0 == nftp_vec_push(v, &n[2], NFTP_TAIL));
+
+	nftp_vec_it_init(&vit, v);
+	assert(NFTP_HEAD == vit.key);
+	for (int i = 0; i < 3; ++i) {
+		assert(1 == nftp_vec_it_next(&vit));
+		assert(i == vit.key);
+		assert(&n[i] == vit.val);
+	}
+	assert(0 == nftp_vec_it_next(&vit));
+	assert(NFTP_TAIL == vit.key);
+	assert(NULL == vit.val);
+	for (int i = 2; i >= 0; --i) {
+		assert(1 == nftp_vec_it_prev(&vit));
+		assert(&n[i] == vit.val);
+	}
+	assert(0 == nftp_vec_it_prev(&vit));
+	assert(NFTP_HEAD == vit.key);
+
+	NFTP_VEC_FOREACH(v, i, e) {
+		assert(&n[i] == e);
+		cnt++;
+	}
+	assert(3 == cnt);
+	nftp_vec_free(v);
+
+	assert(0 == nftp_iovs_init(&iovs));
+	assert(0 == nftp_iovs_append(&iovs, &n[1], 1));
+	assert(0 == nftp_iovs_append(&iovs, &n[2], 2));
+	assert(0 == nftp_iovs_push(&iovs, &n[0], 0, NFTP_HEAD));
+
+	nftp_iovs_it_init(&iit, &iovs);
+	for (int i = 0; i < 3; ++i) {
+		assert(1 == nftp_iovs_it_next(&iit));
+		assert(&n[i] == iit.val->iov_base);
+		assert((size_t)i == iit.val->iov_len);
+	}
+	assert(0 == nftp_iovs_it_next(&iit));
+	assert(NFTP_TAIL == iit.key);
+	assert(1 == nftp_iovs_it_prev(&iit));
+	assert(&n[2] == iit.val->iov_base);
+
+	cnt = 0;
+	NFTP_IOVS_FOREACH(&iovs, i, iov) {
+		assert(&n[i] == iov->iov_base);
+		cnt++;
+	}
+	assert(3 == cnt);
+	nftp_iovs_fini(&iovs);
+
+	// Every node once, over many chains
+	ht_setup(&ht, sizeof(uint32_t), sizeof(int), 8);
+	HT_FOREACH(&ht, hit, node)
+		assert(0);
+	for (key = 1; key <= 100; ++key) {
+		int val = key * 2;
+		assert(HT_INSERTED == ht_insert(&ht, &key, &val));
+	}
+	cnt = 0;
+	HT_FOREACH(&ht, hit, node) {
+		assert(*(int *)node->value == 2 * *(int *)node->key);
+		sum += *(int *)node->key;
+		cnt++;
+	}
+	assert(100 == cnt);
+	assert(5050 == sum);
+	ht_clear(&ht);
+	ht_destroy(&ht);
+
 	return (0);
 }
@@ -22,8 +22,12 @@ static int test_proto_maker_ack();
 static int test_proto_maker_file();
 static int test_proto_maker_end();
 static int test_proto_maker_giveme();
+static int test_proto_maker_batch();
 static int test_proto_handler();
 static int test_proto_stop();
+static int test_proto_giveme();
+static int test_proto_compact();
+static int test_proto_sender();
 
 int
 test_proto()
@@ -44,6 +48,18 @@ test_proto()
 	test_proto_handler();
 	assert(0 == nftp_proto_fini());
 
+	assert(0 == nftp_proto_init());
+	test_proto_giveme();
+	assert(0 == nftp_proto_fini());
+
+	assert(0 == nftp_proto_init());
+	test_proto_compact();
+	assert(0 == nftp_proto_fini());
+
+	assert(0 == nftp_proto_init());
+	test_proto_sender();
+	assert(0 == nftp_proto_fini());
+
 	return (0);
 }
 
@@ -154,12 +170,25 @@ test_proto_handler()
 	char * bname = nftp_file_bname(fname);
 	int    key;
 	int    cap, nextseq;
+	nftp * n;
 
 	assert(0 == nftp_proto_register("aaa", NULL, NULL));
 	assert(NFTP_ERR_HT == nftp_proto_register("aaa", NULL, NULL));
 	assert(0 == nftp_proto_unregister("aaa"));
 	assert(NFTP_ERR_HT == nftp_proto_unregister("aaa"));
 
+	// More than NFTP_FILES registrations
+	for (int i = 0; i < 2 * NFTP_FILES; ++i) {
+		char rname[16];
+		snprintf(rname, sizeof(rname), "reg%d", i);
+		assert(0 == nftp_proto_register(rname, NULL, NULL));
+	}
+	for (int i = 0; i < 2 * NFTP_FILES; ++i) {
+		char rname[16];
+		snprintf(rname, sizeof(rname), "reg%d", i);
+		assert(0 == nftp_proto_unregister(rname));
+	}
+
 	assert(bname != NULL);
 	key = NFTP_HASH((uint8_t *)bname, strlen(bname));
 
@@ -245,8 +274,19 @@ test_proto_handler()
 
 	assert(0 == nftp_proto_send_stop(fname));
 
-	// For recver
+	// For recver. A broken block is asked again.
 	test_recv("END", &r, &rlen);
+	r[15] ^= 0x01;
+	assert(NFTP_ERR_HASH == nftp_proto_handler(r, rlen, &s, &slen));
+	assert(0 == nftp_alloc(&n));
+	assert(0 == nftp_decode(n, (uint8_t *)s, slen));
+	assert(NFTP_TYPE_GIVEME == n->type);
+	assert(0 == n->blockseq);
+	assert(0 == nftp_free(n));
+	free(s);
+	s = NULL; slen = 0;
+	r[15] ^= 0x01;
+
 	assert(0 == nftp_proto_handler(r, rlen, &s, &slen));
 	assert(0 == strcmp(s, "demo.txt")); // s is first (also last) file msg
 	assert((int)strlen(s) == slen);
@@ -270,6 +310,7 @@ test_proto_maker()
 	test_proto_maker_file();
 	test_proto_maker_end();
 	test_proto_maker_giveme();
+	test_proto_maker_batch();
 	return (0);
 }
 
@@ -299,6 +340,21 @@ test_proto_maker_hello()
 
 	assert(0 == nftp_free(p));
 	free(v);
+
+	// The engine is carried in HELLO
+	assert(NFTP_ERR_HASH == nftp_set_hash(0xee));
+	assert(0 == nftp_set_hash(NFTP_HASH_XXH64));
+	assert(0 == nftp_alloc(&p));
+	assert(0 == nftp_proto_maker(fpath, NFTP_TYPE_HELLO, key, 1, &v, &len));
+	assert(0 == nftp_decode(p, (uint8_t *)v, len));
+	assert(len == (int)p->len);
+	assert(0 == strcmp(fname, p->fname));
+	assert(NFTP_HASH_XXH64 == p->hashid);
+	assert(nftp_xxh64((const uint8_t *)str, strlen(str)) == p->hashcode);
+	assert(0 == nftp_free(p));
+	free(v);
+	assert(0 == nftp_set_hash(NFTP_HASH_CRC32C));
+
 	return (0);
 }
 
@@ -388,3 +444,345 @@ test_proto_maker_giveme()
 	return (0);
 }
 
+
+static int
+test_proto_maker_batch()
+{
+	nftp_batch b;
+	char *     v;
+	int        len, pos;
+	char *     fpath = "./demo.txt";
+	uint32_t   blksz = nftp_get_blocksz();
+	uint8_t    buf[64];
+
+	// 26 bytes in 4 blocks
+	nftp_set_blocksz(8);
+
+	assert(NFTP_ERR_BLOCKS == nftp_proto_maker_batch(fpath, 4, 1, &b));
+
+	// Cut at the end of file
+	assert(0 == nftp_proto_maker_batch(fpath, 1, 10, &b));
+	assert(3 == b.cnt);
+	assert(3 == b.stride);
+	assert(9 == b.iovcnt);
+
+	for (int i = 0; i < b.cnt; ++i) {
+		int type = i == b.cnt - 1 ? NFTP_TYPE_END : NFTP_TYPE_FILE;
+		assert(0 == nftp_proto_maker(fpath, type, 0, 1 + i, &v, &len));
+
+		pos = 0;
+		for (int j = b.stride * i; j < b.stride * (i + 1); ++j) {
+			memcpy(buf + pos, b.iov[j].iov_base, b.iov[j].iov_len);
+			pos += b.iov[j].iov_len;
+		}
+		assert(len == pos);
+		assert(0 == memcmp(v, buf, len));
+		free(v);
+	}
+	// Headers are in one slab
+	assert((uint8_t *)b.iov[3].iov_base ==
+	    (uint8_t *)b.iov[0].iov_base + NFTP_FILE_HDRLEN + 4);
+	assert(0 == nftp_batch_free(&b));
+
+	// Without Block CRC
+	assert(0 == nftp_set_blockcrc(0));
+	assert(0 == nftp_proto_maker_batch(fpath, 0, 4, &b));
+	assert(2 == b.stride);
+	assert(8 == b.iovcnt);
+	assert(0 == nftp_proto_maker(fpath, NFTP_TYPE_FILE, 0, 0, &v, &len));
+	assert(len == (int)(b.iov[0].iov_len + b.iov[1].iov_len));
+	free(v);
+	assert(0 == nftp_batch_free(&b));
+	assert(0 == nftp_set_blockcrc(1));
+	nftp_set_blocksz(blksz);
+	return (0);
+}
+
+static int
+test_proto_giveme()
+{
+	char *         fname = "./demo.txt";
+	char *         r = NULL, *s = NULL, *f[4];
+	int            rlen, slen, flen[4];
+	int            key, n = 0;
+	uint32_t       blksz = nftp_get_blocksz();
+	nftp *         p;
+	nftp           g;
+	nftp_iovs      riovs;
+	nftp_framer    fr;
+	const uint8_t *msg;
+	size_t         len;
+	char *         v;
+	int            vlen;
+	uint8_t        bm = 0xf3; // Blocks 2, 3 and 6..9
+
+	assert(0 == nftp_proto_register("*", cb_proto_demo, (void *)"I'm demo recv."));
+	assert(0 == nftp_set_recvdir("./build/"));
+	// 26 bytes in 4 blocks
+	assert(0 == nftp_set_blocksz(8));
+	key = NFTP_HASH((uint8_t *)"demo.txt", strlen("demo.txt"));
+
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_HELLO, key, 0, &r, &rlen));
+	assert(0 == nftp_proto_handler(r, rlen, &s, &slen));
+	free(r);
+	free(s);
+
+	for (int i = 0; i < 4; ++i) {
+		int type = i == 3 ? NFTP_TYPE_END : NFTP_TYPE_FILE;
+		assert(0 == nftp_proto_maker(fname, type, key, i, &f[i], &flen[i]));
+	}
+
+	// Only block 1 arrives
+	s = NULL; slen = 0;
+	assert(0 == nftp_proto_handler(f[1], flen[1], &s, &slen));
+	assert(NULL == s);
+
+	// For recver. Ask 0, 2, 3 in one GIVEME.
+	assert(0 == nftp_proto_maker_giveme(fname, &r, &rlen));
+	assert(0 == nftp_alloc(&p));
+	assert(0 == nftp_decode(p, (uint8_t *)r, rlen));
+	assert(NFTP_TYPE_GIVEME == p->type);
+	assert(0 == p->blockseq);
+	assert(1 == p->ctlen);
+	assert(0x0d == p->content[0]);
+	assert(0 == nftp_free(p));
+
+	// For sender. All the blocks asked are back to back.
+	assert(0 == nftp_proto_handler(r, rlen, &s, &slen));
+	assert(flen[0] + flen[2] + flen[3] == slen);
+
+	// Same bytes in an iovs, not flattened
+	assert(0 == nftp_iovs_init(&riovs));
+	assert(0 == nftp_proto_handler_iovs(r, rlen, &riovs));
+	free(r);
+	assert((size_t)slen == nftp_iovs_iolen(&riovs));
+	assert(nftp_iovs_len(&riovs) > 3);
+	assert(NULL != (r = malloc(slen)));
+	assert(0 == nftp_iovs_copyout(&riovs, 0, slen, r));
+	assert(0 == memcmp(r, s, slen));
+	free(r);
+	assert(0 == nftp_iovs_fini(&riovs));
+
+	// Runs past the end of file are cut at the last block
+	assert(0 == nftp_init(&g));
+	g.type     = NFTP_TYPE_GIVEME;
+	g.fileid   = key;
+	g.blockseq = 2;
+	g.content  = &bm;
+	g.ctlen    = 1;
+	g.len      = nftp_encoded_size(&g);
+	assert(0 == nftp_encode(&g, (uint8_t **)&r, &len));
+	g.content  = NULL;
+	assert(0 == nftp_fini(&g));
+	assert(0 == nftp_proto_handler(r, len, &v, &vlen));
+	free(r);
+	assert(flen[2] + flen[3] == vlen);
+	assert(0 == memcmp(v, f[2], flen[2]));
+	free(v);
+
+	// For recver
+	assert(0 == nftp_framer_init(&fr, 64));
+	assert(0 == nftp_framer_feed(&fr, (uint8_t *)s, slen));
+	free(s);
+	while (0 == nftp_framer_next(&fr, &msg, &len)) {
+		s = NULL;
+		assert(0 == nftp_proto_handler((char *)msg, len, &s, &slen));
+		n++;
+	}
+	assert(3 == n);
+	assert(0 == strcmp(s, "demo.txt"));
+	free(s);
+	assert(0 == nftp_framer_fini(&fr));
+
+	// Nothing is missing any more
+	assert(NFTP_ERR_HT == nftp_proto_maker_giveme(fname, &r, &rlen));
+
+	for (int i = 0; i < 4; ++i)
+		free(f[i]);
+	assert(0 == nftp_set_blocksz(blksz));
+	assert(0 == nftp_file_remove("./build/demo.txt"));
+	return (0);
+}
+
+static int
+test_proto_compact()
+{
+	char *         fname = "./demo.txt";
+	char *         r = NULL, *s = NULL, *f[4];
+	int            rlen, slen, flen[4];
+	int            key;
+	uint32_t       blksz = nftp_get_blocksz();
+	uint32_t       crc, hashcode;
+	uint16_t       namelen;
+	nftp_view      v;
+	char           stale[] = { NFTP_TYPE_FILE | NFTP_TYPE_COMPACT, 0x01, 0x04, 0x00 };
+	int            seqs[] = { 0, 1, 2, 1, 3 };
+
+	assert(0 == nftp_proto_register("*", cb_proto_demo, (void *)"I'm demo recv."));
+	assert(0 == nftp_set_recvdir("./build/"));
+	assert(0 == nftp_set_blocksz(8));
+	assert(0 == nftp_set_compact(1));
+	assert(1 == nftp_get_compact());
+	key = NFTP_HASH((uint8_t *)"demo.txt", strlen("demo.txt"));
+
+	// For sender
+	assert(0 == nftp_proto_send_start(fname));
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_HELLO, key, 0, &r, &rlen));
+	assert(0 == nftp_decode_view(&v, (uint8_t *)r, rlen));
+	assert(NFTP_OPT_COMPACT & v.opts);
+
+	// For recver. ACK has a sid.
+	assert(0 == nftp_proto_handler(r, rlen, &s, &slen));
+	free(r);
+	assert(0 == nftp_decode_view(&v, (uint8_t *)s, slen));
+	assert(NFTP_TYPE_ACK == v.type);
+	assert(0 != v.sid);
+
+	// For sender
+	assert(0 == nftp_proto_handler(s, slen, &r, &rlen));
+	free(s);
+
+	// Block 1 is lost on the link and sent again before END, the blocks
+	// around it must not be shifted
+	for (int i = 0; i < 5; ++i) {
+		int seq  = seqs[i];
+		int type = seq == 3 ? NFTP_TYPE_END : NFTP_TYPE_FILE;
+		assert(0 == nftp_proto_maker(fname, type, key, seq, &f[0], &flen[0]));
+		assert(NFTP_TYPE_COMPACT & (uint8_t)f[0][0]);
+		assert(flen[0] < NFTP_FILE_HDRLEN + 8 + 4);
+		// For recver
+		s = NULL;
+		if (i != 1)
+			assert(0 == nftp_proto_handler(f[0], flen[0], &s, &slen));
+		assert(i == 4 || s == NULL);
+		free(f[0]);
+	}
+	assert(0 == strcmp(s, "demo.txt"));
+	free(s);
+	assert(0 == nftp_file_hash(fname, &crc));
+	assert(0 == nftp_file_hash("./build/demo.txt", &hashcode));
+	assert(crc == hashcode);
+
+	// Session is closed with the file
+	assert(NFTP_ERR_HT == nftp_proto_handler(stale, sizeof(stale), &s, &slen));
+
+	// Back to normal form after stop
+	assert(0 == nftp_proto_send_stop(fname));
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 0, &r, &rlen));
+	assert(NFTP_TYPE_FILE == r[0]);
+	free(r);
+
+	// A v1 recver reads the 4 bytes after fname as CRC32C, and sends
+	// an ACK without sid. The sender stays in normal form.
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_HELLO, key, 0, &r, &rlen));
+	assert(0 == nftp_file_hash(fname, &crc));
+	nftp_get_u16((uint8_t *)r + 8, namelen);
+	nftp_get_u32((uint8_t *)r + 10 + namelen, hashcode);
+	assert(crc == hashcode);
+	free(r);
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_ACK, key, 0, &s, &slen));
+	assert(0 == nftp_proto_handler(s, slen, &r, &rlen));
+	free(s);
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 0, &r, &rlen));
+	assert(NFTP_TYPE_FILE == r[0]);
+	free(r);
+
+	// The sid of an aborted transfer is not reused by the next one
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_ACK, key, 5, &s, &slen));
+	assert(0 == nftp_proto_handler(s, slen, &r, &rlen));
+	free(s);
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_HELLO, key, 0, &r, &rlen));
+	free(r);
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 0, &r, &rlen));
+	assert(NFTP_TYPE_FILE == r[0]);
+	free(r);
+	for (int sid = 9; sid >= 3; sid -= 6) {
+		assert(0 == nftp_proto_maker(fname, NFTP_TYPE_ACK, key, sid, &s, &slen));
+		assert(0 == nftp_proto_handler(s, slen, &r, &rlen));
+		free(s);
+	}
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 0, &r, &rlen));
+	assert((NFTP_TYPE_FILE | NFTP_TYPE_COMPACT) == (uint8_t)(r[0] & ~NFTP_TYPE_BLKCRC));
+	assert(3 == r[1]);
+	free(r);
+	assert(0 == nftp_proto_send_stop(fname));
+
+	assert(0 == nftp_set_compact(0));
+	assert(0 == nftp_set_blocksz(blksz));
+	assert(0 == nftp_file_remove("./build/demo.txt"));
+	return (0);
+}
+
+static int
+test_proto_sender()
+{
+	char *      fname = "./demo.txt";
+	char *      r, *s;
+	int         rlen, slen, key;
+	uint8_t     buf[16];
+	uint32_t    blksz = nftp_get_blocksz();
+	char *      big;
+	nftp_sender snd;
+
+	// 26 bytes in 4 blocks
+	assert(0 == nftp_set_blocksz(8));
+	key = NFTP_HASH((uint8_t *)"demo.txt", strlen("demo.txt"));
+	assert(0 == nftp_sender_init(&snd, fname));
+	assert(4 == snd.blocks);
+	assert(NFTP_FILE_HDRLEN + 8 + 4 == nftp_sender_size(&snd, 0));
+	assert(NFTP_FILE_HDRLEN + 2 + 4 == nftp_sender_size(&snd, 3));
+	assert(0 == nftp_sender_size(&snd, 4));
+
+	// Same msgs as the maker, in any order
+	for (int i = 3; i >= 0; --i) {
+		int type = i == 3 ? NFTP_TYPE_END : NFTP_TYPE_FILE;
+		assert(0 == nftp_sender_maker(&snd, i, &s, &slen));
+		assert(0 == nftp_proto_maker(fname, type, key, i, &r, &rlen));
+		assert(rlen == slen);
+		assert(0 == memcmp(r, s, rlen));
+		free(r);
+		free(s);
+	}
+
+	// END closes the compact session as nftp_proto_maker does
+	assert(0 == nftp_set_compact(1));
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_ACK, key, 4, &s, &slen));
+	assert(0 == nftp_proto_handler(s, slen, &r, &rlen));
+	free(s);
+	assert(0 == nftp_sender_maker(&snd, 3, &s, &slen));
+	free(s);
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 0, &r, &rlen));
+	assert(NFTP_TYPE_FILE == r[0]);
+	free(r);
+	assert(0 == nftp_set_compact(0));
+
+	assert(NFTP_ERR_BLOCKS == nftp_sender_maker(&snd, 4, &s, &slen));
+	assert(NFTP_ERR_OVERFLOW == nftp_sender_encode(&snd, 0, buf, sizeof(buf), NULL));
+	assert(0 == nftp_sender_fini(&snd));
+
+	// Without Block CRC
+	assert(0 == nftp_set_blockcrc(0));
+	assert(0 == nftp_sender_init(&snd, fname));
+	assert(0 == nftp_sender_maker(&snd, 1, &s, &slen));
+	assert(0 == nftp_proto_maker(fname, NFTP_TYPE_FILE, key, 1, &r, &rlen));
+	assert(NFTP_FILE_HDRLEN + 8 == slen);
+	assert(rlen == slen);
+	assert(0 == memcmp(r, s, rlen));
+	free(r);
+	free(s);
+	assert(0 == nftp_sender_fini(&snd));
+	assert(0 == nftp_set_blockcrc(1));
+
+	assert(NFTP_ERR_FILE == nftp_sender_init(&snd, "./nonexist.txt"));
+
+	// More blocks than a blockseq holds, as HELLO
+	assert(NULL != (big = calloc(1, NFTP_BLOCK_NUM + 1)));
+	assert(0 == nftp_file_write("./build/big.txt", big, NFTP_BLOCK_NUM + 1));
+	free(big);
+	assert(0 == nftp_set_blocksz(1));
+	assert(NFTP_ERR_OVERFLOW == nftp_sender_init(&snd, "./build/big.txt"));
+	assert(NULL == snd.fp);
+	assert(0 == nftp_file_remove("./build/big.txt"));
+	assert(0 == nftp_set_blocksz(blksz));
+	return (0);
+}
@@ -0,0 +1,205 @@
+// Author: wangha <wangha at emqx dot io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+//
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "nftp.h"
+#include "test.h"
+
+#define QUEUE_CNT 100000
+
+static int test_queue_spsc();
+static int test_queue_mpmc();
+
+int
+test_queue()
+{
+	nftp_log("test_queue");
+	test_queue_spsc();
+	test_queue_mpmc();
+
+	return (0);
+}
+
+static void *
+spsc_producer(void *arg)
+{
+	nftp_spsc *q = arg;
+	void *     arr[7];
+	uintptr_t  i = 1;
+	int        cnt;
+
+	while (i <= QUEUE_CNT) {
+		int n = 0;
+		for (; n < 7 && i + n <= QUEUE_CNT; ++n)
+			arr[n] = (void *)(i + n);
+		if (0 == nftp_spsc_push_n(q, arr, n, &cnt))
+			i += cnt;
+		else
+			sched_yield();
+	}
+	return NULL;
+}
+
+static int
+test_queue_spsc()
+{
+	nftp_spsc *q;
+	pthread_t  thr;
+	void *     e, *arr[16];
+	int        cnt;
+	uintptr_t  next = 1;
+	char *     e0 = "e0", *e1 = "e1";
+
+	assert(0 == nftp_spsc_alloc(&q, 5));
+	assert(8 == nftp_spsc_cap(q));
+	assert(NFTP_ERR_EMPTY == nftp_spsc_pop(q, &e));
+
+	assert(0 == nftp_spsc_push(q, e0));
+	assert(0 == nftp_spsc_push(q, e1));
+	assert(2 == nftp_spsc_len(q));
+	assert(0 == nftp_spsc_pop(q, &e));
+	assert(e == e0);
+
+	// Batch is cut at full and at empty, and wraps
+	for (int i = 0; i < 16; ++i)
+		arr[i] = e0;
+	assert(0 == nftp_spsc_push_n(q, arr, 16, &cnt));
+	assert(7 == cnt);
+	assert(NFTP_ERR_OVERFLOW == nftp_spsc_push(q, e0));
+	assert(0 == nftp_spsc_pop_n(q, arr, 16, &cnt));
+	assert(8 == cnt);
+	assert(arr[0] == e1 && arr[7] == e0);
+	assert(NFTP_ERR_EMPTY == nftp_spsc_pop_n(q, arr, 16, &cnt));
+
+	// In order across threads
+	assert(0 == pthread_create(&thr, NULL, spsc_producer, q));
+	while (next <= QUEUE_CNT) {
+		if (0 != nftp_spsc_pop_n(q, arr, 5, &cnt)) {
+			sched_yield();
+			continue;
+		}
+		for (int i = 0; i < cnt; ++i)
+			assert((uintptr_t)arr[i] == next++);
+	}
+	assert(0 == pthread_join(thr, NULL));
+	assert(0 == nftp_spsc_len(q));
+	assert(0 == nftp_spsc_free(q));
+	return (0);
+}
+
+#define MPMC_THRS 3
+
+struct mpmc_arg {
+	nftp_mpmc *q;
+	int        id;
+	uint64_t   sum;
+	int        cnt;
+};
+
+static void *
+mpmc_producer(void *arg)
+{
+	struct mpmc_arg *a = arg;
+	void *           arr[4];
+	uintptr_t        i = 1;
+	int              cnt;
+
+	while (i <= QUEUE_CNT) {
+		int n = 0;
+		for (; n < 4 && i + n <= QUEUE_CNT; ++n)
+			arr[n] = (void *)(i + n);
+		if (a->id % 2) {
+			if (0 == nftp_mpmc_push_n(a->q, arr, n, &cnt)) {
+				i += cnt;
+				continue;
+			}
+		} else if (0 == nftp_mpmc_push(a->q, arr[0])) {
+			i++;
+			continue;
+		}
+		sched_yield();
+	}
+	return NULL;
+}
+
+static void *
+mpmc_consumer(void *arg)
+{
+	struct mpmc_arg *a = arg;
+	void *           arr[3];
+	int              cnt;
+
+	while (a->cnt < QUEUE_CNT) {
+		int n = QUEUE_CNT - a->cnt < 3 ? QUEUE_CNT - a->cnt : 3;
+		if (0 != nftp_mpmc_pop_n(a->q, arr, n, &cnt)) {
+			sched_yield();
+			continue;
+		}
+		for (int i = 0; i < cnt; ++i)
+			a->sum += (uintptr_t)arr[i];
+		a->cnt += cnt;
+	}
+	return NULL;
+}
+
+static int
+test_queue_mpmc()
+{
+	nftp_mpmc *     q;
+	pthread_t       pthr[MPMC_THRS], cthr[MPMC_THRS];
+	struct mpmc_arg parg[MPMC_THRS], carg[MPMC_THRS];
+	void *          e, *arr[16];
+	int             cnt;
+	uint64_t        sum = 0;
+	char *          e0 = "e0", *e1 = "e1";
+
+	assert(0 == nftp_mpmc_alloc(&q, 8));
+	assert(8 == nftp_mpmc_cap(q));
+	assert(NFTP_ERR_EMPTY == nftp_mpmc_pop(q, &e));
+
+	assert(0 == nftp_mpmc_push(q, e0));
+	assert(0 == nftp_mpmc_push(q, e1));
+	assert(2 == nftp_mpmc_len(q));
+	assert(0 == nftp_mpmc_pop(q, &e));
+	assert(e == e0);
+
+	for (int i = 0; i < 16; ++i)
+		arr[i] = e0;
+	assert(0 == nftp_mpmc_push_n(q, arr, 16, &cnt));
+	assert(7 == cnt);
+	assert(NFTP_ERR_OVERFLOW == nftp_mpmc_push(q, e0));
+	assert(0 == nftp_mpmc_pop_n(q, arr, 16, &cnt));
+	assert(8 == cnt);
+	assert(arr[0] == e1 && arr[7] == e0);
+	assert(NFTP_ERR_EMPTY == nftp_mpmc_pop_n(q, arr, 16, &cnt));
+
+	// Every entry is popped once. Each consumer pops as many as one
+	// producer pushes.
+	for (int i = 0; i < MPMC_THRS; ++i) {
+		memset(&parg[i], 0, sizeof(parg[i]));
+		memset(&carg[i], 0, sizeof(carg[i]));
+		parg[i].q = carg[i].q = q;
+		parg[i].id = carg[i].id = i;
+		assert(0 == pthread_create(&pthr[i], NULL, mpmc_producer, &parg[i]));
+		assert(0 == pthread_create(&cthr[i], NULL, mpmc_consumer, &carg[i]));
+	}
+	for (int i = 0; i < MPMC_THRS; ++i) {
+		assert(0 == pthread_join(pthr[i], NULL));
+		assert(0 == pthread_join(cthr[i], NULL));
+		sum += carg[i].sum;
+	}
+	assert(MPMC_THRS * (uint64_t)QUEUE_CNT * (QUEUE_CNT + 1) / 2 == sum);
+	assert(0 == nftp_mpmc_len(q));
+	assert(0 == nftp_mpmc_free(q));
+	return (0);
+}
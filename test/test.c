@@ -15,6 +15,7 @@ main()
 	test_hash();
 	test_file();
 	test_vector();
+	test_queue();
 	test_iovs();
 	test_iter();
 	test_codec();
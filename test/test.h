@@ -4,6 +4,7 @@
 int test_hash();
 int test_file();
 int test_vector();
+int test_queue();
 int test_iovs();
 int test_iter();
 int test_codec();
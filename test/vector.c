@@ -8,6 +8,7 @@
 //
 
 #include <assert.h>
+#include <string.h>
 
 #include "nftp.h"
 #include "test.h"
@@ -41,8 +42,15 @@ test_vector()
 		assert(i+2 == nftp_vec_len(v1));
 	}
 
-	assert(NFTP_ERR_OVERFLOW == nftp_vec_push(v1, (void *) earr[0], NFTP_TAIL));
-	assert(NFTP_ERR_OVERFLOW == nftp_vec_push(v1, (void *) earr[0], NFTP_HEAD));
+	// Grow when it's full, then back to cap entries
+	assert(0 == nftp_vec_push(v1, (void *) e1, NFTP_TAIL));
+	assert(0 == nftp_vec_push(v1, (void *) e2, NFTP_HEAD));
+	assert(cap + 2 == nftp_vec_len(v1));
+	assert(cap < nftp_vec_cap(v1));
+	assert(0 == nftp_vec_pop(v1, (void **)&e, NFTP_TAIL));
+	assert(e == e1);
+	assert(0 == nftp_vec_pop(v1, (void **)&e, NFTP_HEAD));
+	assert(e == e2);
 
 	// Pop test
 	k=0;
@@ -63,8 +71,15 @@ test_vector()
 		assert(i+1 == nftp_vec_len(v1));
 	}
 
-	assert(NFTP_ERR_OVERFLOW == nftp_vec_push(v1, (void *) earr[0], NFTP_TAIL));
-	assert(NFTP_ERR_OVERFLOW == nftp_vec_push(v1, (void *) earr[0], NFTP_HEAD));
+	// Grow when it's full, then back to cap entries
+	assert(0 == nftp_vec_push(v1, (void *) e1, NFTP_TAIL));
+	assert(0 == nftp_vec_push(v1, (void *) e2, NFTP_HEAD));
+	assert(cap + 2 == nftp_vec_len(v1));
+	assert(cap < nftp_vec_cap(v1));
+	assert(0 == nftp_vec_pop(v1, (void **)&e, NFTP_TAIL));
+	assert(e == e1);
+	assert(0 == nftp_vec_pop(v1, (void **)&e, NFTP_HEAD));
+	assert(e == e2);
 
 	k=0;
 	for (int i=0; i<cap; ++i) {
@@ -86,7 +101,9 @@ test_vector()
 		assert(0 == nftp_vec_insert(v1, (void *)earr[k % 3], 1));
 		assert(i+2 == nftp_vec_len(v1));
 	}
-	assert(NFTP_ERR_OVERFLOW == nftp_vec_insert(v1, (void *)earr[0], 1));
+	assert(0 == nftp_vec_insert(v1, (void *)e1, 1));
+	assert(0 == nftp_vec_delete(v1, (void **)&e, 1));
+	assert(e == e1);
 	// get and check
 	k=cap+1;
 	for (int i=0; i<cap; ++i) {
@@ -106,6 +123,42 @@ test_vector()
 
 	assert(0 == nftp_vec_free(v1));
 
+	// Same behaviors without lock
+	assert(0 == nftp_vec_alloc_nolock(&v1, cap));
+	assert(0 == nftp_vec_push(v1, (void *)e1, NFTP_TAIL));
+	assert(0 == nftp_vec_push(v1, (void *)e0, NFTP_HEAD));
+	assert(0 == nftp_vec_insert(v1, (void *)e2, 2));
+	assert(3 == nftp_vec_len(v1));
+	for (int i=0; i<3; ++i) {
+		assert(0 == nftp_vec_pop(v1, (void **)&e, NFTP_HEAD));
+		assert(earr[i] == e);
+	}
+	assert(0 == nftp_vec_free(v1));
+
+	// Bulk ops across the end of ring and growing
+	void *arr[3 * NFTP_SIZE], *out[3 * NFTP_SIZE];
+	int   cnt;
+	for (int i=0; i<3 * NFTP_SIZE; ++i)
+		arr[i] = earr[i % 3];
+	assert(0 == nftp_vec_alloc_nolock(&v1, cap));
+	assert(0 == nftp_vec_append_n(v1, arr, cap - 1));
+	assert(0 == nftp_vec_pop_n(v1, out, cap - 2, &cnt));
+	assert(cap - 2 == cnt);
+	assert(0 == nftp_vec_append_n(v1, arr, 3)); // Wraps
+	assert(4 == nftp_vec_len(v1));
+	assert(cap == nftp_vec_cap(v1));
+	assert(0 == nftp_vec_append_n(v1, arr, 3 * NFTP_SIZE));
+	assert(4 + 3 * NFTP_SIZE == nftp_vec_len(v1));
+	assert(0 == nftp_vec_pop_n(v1, out, 4, &cnt));
+	assert(4 == cnt);
+	assert(out[0] == earr[(cap - 2) % 3]);
+	assert(out[1] == e0 && out[2] == e1 && out[3] == e2);
+	assert(0 == nftp_vec_pop_n(v1, out, 4 * NFTP_SIZE, &cnt));
+	assert(3 * NFTP_SIZE == cnt);
+	assert(0 == memcmp(arr, out, sizeof(arr)));
+	assert(NFTP_ERR_EMPTY == nftp_vec_pop_n(v1, out, 1, &cnt));
+	assert(0 == nftp_vec_free(v1));
+
 	return 0;
 }
 